@@ -0,0 +1,158 @@
+/*
+  glyphbench:  Measure glyph cache hit throughput of a shared font.
+
+  Part of uttf, distributed under the terms in COPYING.txt.
+*/
+
+/* Opens one font in thread-safe mode, warms its glyph cache, then has
+   1, 2, 4... threads measure the same text with it for a while and
+   prints how many glyph lookups per second they managed together.  With
+   lock-free cache hits the rate should grow with the number of cores. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "uttf.h"
+
+#define DEFAULT_PTSIZE  18
+#define DEFAULT_TEXT    "The quick brown fox jumped over the lazy dog"
+#define DEFAULT_SECONDS 1.0
+
+static char *Usage =
+"Usage: %s [-threads max] [-seconds s] [-render] <font>.ttf [ptsize] [text]\n";
+
+static TTF_Font *font;
+static const char *message;
+static int render;
+static int running;
+
+typedef struct {
+    pthread_t thread;
+    unsigned long lookups;
+} Worker;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_worker(void *data)
+{
+    Worker *worker = (Worker *)data;
+    unsigned long glyphs = strlen(message);
+    int w, h;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        if (render) {
+            free(TTF_RenderUTF8_Blended(font, message, 0xFF000000));
+        } else {
+            TTF_SizeUTF8(font, message, &w, &h);
+        }
+        worker->lookups += glyphs;
+    }
+    return NULL;
+}
+
+static double run_threads(int nthreads, double seconds)
+{
+    Worker *workers;
+    unsigned long total = 0;
+    double start;
+    int i;
+
+    workers = (Worker *)calloc(nthreads, sizeof(*workers));
+    if (workers == NULL) {
+        return 0.0;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+    start = now();
+    for (i = 0; i < nthreads; ++i) {
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    while (now() - start < seconds) {
+        usleep(10000);
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].lookups;
+    }
+    seconds = now() - start;
+    free(workers);
+    return total / seconds;
+}
+
+int main(int argc, char *argv[])
+{
+    char *argv0 = argv[0];
+    int maxthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = DEFAULT_SECONDS;
+    int ptsize;
+    int nthreads;
+    double base = 0.0;
+    int w, h;
+
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+        if (strcmp(argv[0], "-threads") == 0 && argc > 1) {
+            maxthreads = atoi(argv[1]);
+            argc--, argv++;
+        } else if (strcmp(argv[0], "-seconds") == 0 && argc > 1) {
+            seconds = atof(argv[1]);
+            argc--, argv++;
+        } else if (strcmp(argv[0], "-render") == 0) {
+            render = 1;
+        } else {
+            fprintf(stderr, Usage, argv0);
+            return(1);
+        }
+    }
+    if (argc < 1 || maxthreads < 1) {
+        fprintf(stderr, Usage, argv0);
+        return(1);
+    }
+
+    if (TTF_Init() < 0) {
+        fprintf(stderr, "Couldn't initialize TTF: %s\n", TTF_GetError());
+        return(2);
+    }
+    ptsize = (argc > 1) ? atoi(argv[1]) : DEFAULT_PTSIZE;
+    message = (argc > 2) ? argv[2] : DEFAULT_TEXT;
+
+    TTF_SetThreadSafe(1);
+    font = TTF_OpenFont(argv[0], ptsize);
+    if (font == NULL) {
+        fprintf(stderr, "Couldn't load %d pt font from %s: %s\n",
+                ptsize, argv[0], TTF_GetError());
+        TTF_Quit();
+        return(2);
+    }
+
+    /* Warm the cache so that the threads only measure hits */
+    TTF_SizeUTF8(font, message, &w, &h);
+    free(TTF_RenderUTF8_Blended(font, message, 0xFF000000));
+
+    printf("%-8s %14s %8s\n", "threads", "lookups/s", "speedup");
+    for (nthreads = 1; nthreads <= maxthreads; ) {
+        double rate = run_threads(nthreads, seconds);
+
+        if (nthreads == 1) {
+            base = rate;
+        }
+        printf("%-8d %14.0f %7.2fx\n", nthreads, rate, base > 0.0 ? rate / base : 0.0);
+        if (nthreads == maxthreads) {
+            break;
+        }
+        nthreads = (nthreads * 2 > maxthreads) ? maxthreads : nthreads * 2;
+    }
+
+    TTF_CloseFont(font);
+    TTF_Quit();
+    return(0);
+}
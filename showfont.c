@@ -73,6 +73,25 @@ Uint32 SDLColorToUint32(SDL_Color col) {
 	return result;
 }
 
+/* Shaded surfaces come with their palette, solid ones only use 0 and 1 */
+static void set_palette(SDL_Surface *sdl_text, Uint8 *text, int rendersolid,
+                        SDL_Color fg, SDL_Color bg)
+{
+    SDL_Palette *palette = sdl_text->format->palette;
+    int index;
+
+    for ( index = 0; index < 256; ++index ) {
+        if ( rendersolid ) {
+            palette->colors[index] = (index == 0) ? bg : fg;
+        } else {
+            Uint32 color = fn_palette(text)[index];
+            palette->colors[index].r = cl_r(color);
+            palette->colors[index].g = cl_g(color);
+            palette->colors[index].b = cl_b(color);
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     char *argv0 = argv[0];
@@ -256,18 +275,7 @@ int main(int argc, char *argv[])
         scene.captionRect.h = fn_h(text);
 	SDL_Surface *sdl_text = fn_to_sdl_surface(text);
 	printf("surf is here! %s\n", __func__);
-            SDL_Palette *palette = sdl_text->format->palette;
-	Uint32 fg = SDLColorToUint32(*forecol);
-	Uint32 bg = SDLColorToUint32(*backcol);
-    int rdiff = cl_r(fg) - cl_r(bg);
-    int gdiff = cl_g(fg) - cl_g(bg);
-    int bdiff = cl_b(fg) - cl_b(bg);
-
-    for ( int index = 0; index < 256; ++index ) {
-        palette->colors[index].r = cl_r(bg) + (index*rdiff) / (255);
-        palette->colors[index].g = cl_g(bg) + (index*gdiff) / (255);
-        palette->colors[index].b = cl_b(bg) + (index*bdiff) / (255);
-    }
+	set_palette(sdl_text, text, rendersolid, *forecol, *backcol);
 
         scene.caption = SDL_CreateTextureFromSurface(renderer, sdl_text);
 	SDL_FreeSurface(sdl_text);
@@ -325,18 +333,7 @@ int main(int argc, char *argv[])
     scene.messageRect.h = fn_h(text);
     SDL_Surface *sdl_text = fn_to_sdl_surface(text);
     printf("surf is here %s\n", __func__);
-            SDL_Palette *palette = sdl_text->format->palette;
-        Uint32 fg = SDLColorToUint32(*forecol);
-        Uint32 bg = SDLColorToUint32(*backcol);
-    int rdiff = cl_r(fg) - cl_r(bg);
-    int gdiff = cl_g(fg) - cl_g(bg);
-    int bdiff = cl_b(fg) - cl_b(bg);
-
-    for ( int index = 0; index < 256; ++index ) {
-        palette->colors[index].r = cl_r(bg) + (index*rdiff) / (255);
-        palette->colors[index].g = cl_g(bg) + (index*gdiff) / (255);
-        palette->colors[index].b = cl_b(bg) + (index*bdiff) / (255);
-    }
+    set_palette(sdl_text, text, rendersolid, *forecol, *backcol);
     scene.message = SDL_CreateTextureFromSurface(renderer, sdl_text);
     printf("Font is generally %d big, and string is %hd big\n",
                         TTF_FontHeight(font), (short)(fn_h(text)));
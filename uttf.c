@@ -21,16 +21,32 @@
   3. This notice may not be removed or altered from any source distribution.
 */
 
+/* Font files over 2 GB on 32-bit systems */
+#define _FILE_OFFSET_BITS 64
+
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_OUTLINE_H
 #include FT_STROKER_H
 #include FT_GLYPH_H
+#include FT_SIZES_H
 #include FT_TRUETYPE_IDS_H
 
 #include "uttf.h"
@@ -38,7 +54,12 @@
 Uint8 *TTF_CreateRGBSurface(int width, int heigth, int depth, int unused0, int unused1, int unused2, int unused3) {
         int pitch = ((width % 4) == 0) ? width : (width + (4 - (width % 4)));
 	pitch *= (depth / 8);
+	if (depth < 8) {
+		/* Packed pixels, MSB first, rows padded to 32 bits */
+		pitch = ((width * depth + 31) / 32) * 4;
+	}
 	Uint8* fn_surf = (Uint8*)malloc(8+pitch*heigth);
+	if (fn_surf == NULL) return NULL;
 	memset(fn_surf, 0, 8+pitch*heigth);
         fn_set_w(fn_surf, width);
         fn_set_h(fn_surf, heigth);
@@ -51,25 +72,110 @@ Uint8 *TTF_CreateRGBSurface(int width, int heigth, int depth, int unused0, int u
         return fn_surf;
 }
 
-char last_error[1024] = { 0 };
-void TTF_SetError(const char *s) {
-	printf("Error set to '%s'\n", s);
-	strcpy(last_error, s);
+/* An 8-bit surface followed by its palette of ARGB8888 colors */
+Uint8 *TTF_CreatePaletteSurface(int width, int heigth, int ncolors) {
+	int pitch = ((width % 4) == 0) ? width : (width + (4 - (width % 4)));
+	Uint8* fn_surf = (Uint8*)malloc(8+pitch*heigth+ncolors*sizeof(Uint32));
+	if (fn_surf == NULL) return NULL;
+	memset(fn_surf, 0, 8+pitch*heigth+ncolors*sizeof(Uint32));
+	fn_set_w(fn_surf, width);
+	fn_set_h(fn_surf, heigth);
+	fn_set_d(fn_surf, 8);
+	fn_set_p(fn_surf, pitch);
+	return fn_surf;
+}
+
+/* Logging is compiled out of release builds unless explicitly requested */
+#if defined(NDEBUG) && !defined(TTF_ENABLE_LOGGING)
+#define TTF_DISABLE_LOGGING
+#endif
+
+#if defined(_MSC_VER)
+#define TTF_THREAD_LOCAL __declspec(thread)
+#else
+#define TTF_THREAD_LOCAL __thread
+#endif
+
+/* Render and pool threads log too, so the callback is set and read
+   under a lock, keeping it paired with its userdata and level.  The
+   level alone is read without it to skip filtered messages quickly. */
+static pthread_mutex_t TTF_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static TTF_LogFunction TTF_log_func = NULL;
+static void *TTF_log_userdata = NULL;
+static int TTF_log_level = TTF_LOG_NONE;
+
+void TTF_SetLogFunction(TTF_LogFunction func, void *userdata, int level) {
+	pthread_mutex_lock(&TTF_log_lock);
+	TTF_log_func = func;
+	TTF_log_userdata = userdata;
+	__atomic_store_n(&TTF_log_level, func ? level : TTF_LOG_NONE, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&TTF_log_lock);
+}
+
+#ifndef TTF_DISABLE_LOGGING
+static void TTF_Log(int level, const char *fmt, ...) {
+	char buffer[1024];
+	TTF_LogFunction func;
+	void *userdata;
+	va_list ap;
+
+	if (level < __atomic_load_n(&TTF_log_level, __ATOMIC_RELAXED)) {
+		return;
+	}
+	pthread_mutex_lock(&TTF_log_lock);
+	func = TTF_log_func;
+	userdata = TTF_log_userdata;
+	if (level < TTF_log_level) {
+		func = NULL;
+	}
+	pthread_mutex_unlock(&TTF_log_lock);
+	if (func == NULL) {
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	func(userdata, level, buffer);
+}
+#else
+#define TTF_Log(level, ...) ((void)0)
+#endif
+
+/* Each thread sees only the errors it caused */
+#define TTF_ERROR_SIZE 1024
+
+static TTF_THREAD_LOCAL char TTF_last_error[TTF_ERROR_SIZE];
+
+void TTF_SetError(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(TTF_last_error, sizeof(TTF_last_error), fmt, ap);
+	va_end(ap);
+	TTF_Log(TTF_LOG_ERROR, "%s", TTF_last_error);
 }
 char *TTF_GetError() {
-	if (last_error[0] == 0) return "No error";
-	return last_error;
+	if (TTF_last_error[0] == 0) return "No error";
+	return TTF_last_error;
 }
 
 void TTF_FillRect(Uint8 *srf, Uint32 pixel) {
-	// TODO: this is wrong !
-	printf("TTF_FillRect pixel = %X pitch=%d depth=%d\n", pixel, fn_p(srf), fn_d(srf));
-	Uint32 *pixels = (Uint32*)(srf + 8);
-	int i = 0;
+	Uint8 *row = srf + 8;
 	for (int y = 0; y < fn_h(srf); y++) {
-		for (int x = 0; x < fn_w(srf); x++) {
-			pixels[i++] = pixel;
+		if (fn_d(srf) == 32) {
+			Uint32 *pixels = (Uint32*)row;
+			for (int x = 0; x < fn_p(srf) / 4; x++) {
+				pixels[x] = pixel;
+			}
+		} else if (fn_d(srf) == 16) {
+			Uint16 *pixels = (Uint16*)row;
+			for (int x = 0; x < fn_p(srf) / 2; x++) {
+				pixels[x] = (Uint16)pixel;
+			}
+		} else {
+			memset(row, (Uint8)pixel, fn_p(srf));
 		}
+		row += fn_p(srf);
 	}
 }
 
@@ -92,6 +198,7 @@ Uint16 TTF_Swap16(Uint16 x)
 #define CACHED_METRICS  0x10
 #define CACHED_BITMAP   0x01
 #define CACHED_PIXMAP   0x02
+#define CACHED_PACKED   0x04
 
 /* Cached glyph information */
 typedef struct cached_glyph {
@@ -99,15 +206,85 @@ typedef struct cached_glyph {
     FT_UInt index;
     FT_Bitmap bitmap;
     FT_Bitmap pixmap;
+    FT_Bitmap packed;   /* 1-bpp, MSB first, as FreeType renders mono */
     int minx;
     int maxx;
     int miny;
     int maxy;
     int yoffset;
     int advance;
-    Uint16 cached;
+    Uint32 cached;      /* character, or CACHE_INDEX_KEY + glyph index */
+    int loading;        /* being rendered by a thread, see Find_CachedGlyph() */
+    struct cached_glyph *next;
 } c_glyph;
 
+/* The glyph cache is a hash table of entries that are only ever added
+   while the font is in use, so lookups need no lock.  Misses lock one of
+   a few stripes of buckets.  Fonts that are not shared are flushed when
+   they hold too many glyphs.  The cache of a shared font stops growing
+   then instead, as other threads may be drawing its glyphs, and keeps
+   them until the style changes or the font is closed; each thread puts
+   the glyphs it misses after that in a cache of its own, flushed like
+   that of an unshared font. */
+#define CACHE_BUCKETS   257     /* 257 is a prime */
+#define CACHE_STRIPES   16
+#define CACHE_MAX_GLYPHS 1024
+
+/* Glyphs looked up by index rather than by character are kept in the
+   same cache, under keys above the 16-bit character range */
+#define CACHE_INDEX_KEY 0x10000
+
+/* Output pixels for every coverage value of one color (or one bg to fg
+   ramp) in one pixel format.  The render kernels composite through this
+   table, so no render path has to convert its surface afterwards.
+*/
+typedef struct {
+    int depth;
+    int shift;                  /* channel holding the coverage... */
+    Uint32 mask;
+    int use_inverse;            /* ...directly, or through inverse[] */
+    Uint8 inverse[NUM_GRAYS];
+    Uint32 pixel[NUM_GRAYS];
+    Uint32 palette[NUM_GRAYS];  /* ARGB8888 colors of a shaded ramp */
+} TTF_PixelLUT;
+
+/* Shaded ramps computed for recent (fg, bg, format) triples */
+#define CACHED_LUTS     4
+
+typedef struct cached_lut {
+    int stored;
+    int format;
+    Uint32 fg;
+    Uint32 bg;
+    TTF_PixelLUT lut;
+} c_lut;
+
+/* Rasterizer state for one thread using a font.  FreeType faces may only
+   be used by one thread at a time, so each thread rendering with a
+   thread-safe font gets its own face over the shared font bytes, along
+   with the shaded ramps it uses.  Other fonts have a single context
+   around their own face.
+*/
+typedef struct _TTF_Context {
+    TTF_Font *font;
+    FT_Face face;
+    int owns_face;
+    FT_Size size;               /* activated on the face before use */
+    int owns_size;
+    pthread_t owner;
+
+    /* Recently used shaded color ramps, replaced round robin */
+    c_lut luts[CACHED_LUTS];
+    int next_lut;
+
+    /* Glyphs missed once the cache of a shared font is full */
+    c_glyph *cache[CACHE_BUCKETS];
+    int cache_count;
+    int cache_pins;             /* renders holding glyphs of the thread */
+
+    struct _TTF_Context *next;
+} TTF_Context;
+
 /* The structure used to hold internal font information */
 struct _TTF_Font {
     /* Freetype2 maintains all sorts of useful info itself */
@@ -135,10 +312,6 @@ struct _TTF_Font {
     int underline_offset;
     int underline_height;
 
-    /* Cache for style-transformed glyphs */
-    c_glyph *current;
-    c_glyph cache[257]; /* 257 is a prime */
-
     /* We are responsible for closing the font stream */
     FILE *src;
     int freesrc;
@@ -147,8 +320,41 @@ struct _TTF_Font {
     /* For non-scalable formats, we must remember which font index size */
     int font_size_family;
 
+    /* What thread contexts need to open their own face */
+    long face_index;
+    FT_F26Dot6 char_size;
+
+    /* The font whose face this size of it shares, or NULL */
+    TTF_Font *base;
+    int sizes;                  /* open fonts sharing this one's face */
+
+    /* Sizes of this font drawn bold and/or italic, made when first used */
+    TTF_Font *variants[4];
+
     /* really just flags passed into FT_Load_Glyph */
     int hinting;
+
+    /* Cache for style-transformed glyphs, shared by all contexts */
+    c_glyph *cache[CACHE_BUCKETS];
+    int cache_count;
+    pthread_mutex_t cache_locks[CACHE_STRIPES];
+    pthread_cond_t cache_loaded[CACHE_STRIPES];
+
+    /* Rasterizer contexts, one per rendering thread if shared */
+    int shared;
+    Uint32 serial;
+    pthread_mutex_t lock;
+    TTF_Context *contexts;
+
+    /* Characters the face has glyphs for, one bit each, found at open */
+    Uint32 *coverage;
+
+    /* The font file in memory, when not read through a stream */
+    Uint8 *data;
+    size_t datasize;
+    int freedata;
+    void *map;                  /* the mapping holding data, if mapped */
+    size_t mapsize;
 };
 
 /* Handle a style only if the font does not already handle it */
@@ -162,13 +368,19 @@ struct _TTF_Font {
 /* Font styles that does not impact glyph drawing */
 #define TTF_STYLE_NO_GLYPH_CHANGE   (TTF_STYLE_UNDERLINE | TTF_STYLE_STRIKETHROUGH)
 
-/* The FreeType font engine/library */
+/* The FreeType font engine/library.  Faces may be opened and closed on
+   it by one thread at a time only; everything else works per face. */
 static FT_Library library;
+static pthread_mutex_t TTF_library_lock = PTHREAD_MUTEX_INITIALIZER;
 static int TTF_initialized = 0;
-static int TTF_byteswapped = 0;
+static int TTF_threadsafe = 0;
+static Uint32 TTF_font_serial = 0;
+static TTF_THREAD_LOCAL int TTF_byteswapped = 0;
+
+#define TTF_INITIALIZED() __atomic_load_n(&TTF_initialized, __ATOMIC_ACQUIRE)
 
 #define TTF_CHECKPOINTER(p, errval)                 \
-    if ( !TTF_initialized ) {                   \
+    if ( !TTF_INITIALIZED() ) {                 \
         TTF_SetError("Library not initialized");        \
         return errval;                      \
     }                               \
@@ -267,7 +479,7 @@ static void TTF_initLineMectrics(const TTF_Font *font, const Uint8 *textbuf, con
 static void TTF_drawLine_Solid(const TTF_Font *font, const Uint8 *textbuf, const int row)
 {
     int line;
-    Uint8 *dst_check = (Uint8*)(textbuf+4) + fn_p(textbuf) * fn_h(textbuf);
+    Uint8 *dst_check = (Uint8*)(textbuf+8) + fn_p(textbuf) * fn_h(textbuf);
     Uint8 *dst;
     int height;
 
@@ -275,58 +487,383 @@ static void TTF_drawLine_Solid(const TTF_Font *font, const Uint8 *textbuf, const
 
     /* Draw line */
     for ( line=height; line>0 && dst < dst_check; --line ) {
-        /* 1 because 0 is the bg color */
-        memset( dst, 1, fn_w(textbuf) );
+        if ( fn_d(textbuf) == 1 ) {
+            memset( dst, 0xFF, fn_w(textbuf) / 8 );
+            if ( fn_w(textbuf) % 8 ) {
+                dst[fn_w(textbuf) / 8] |= (Uint8)(0xFF00 >> (fn_w(textbuf) % 8));
+            }
+        } else {
+            /* 1 because 0 is the bg color */
+            memset( dst, 1, fn_w(textbuf) );
+        }
         dst += fn_p(textbuf);
     }
 }
 
-/* Draw a shaded line of underline_height (+ optional outline)
-   at the given row. The row value must take the
-   outline into account.
+/* Big endian 32-bit access, so packed rows can be handled a word at a
+   time whatever the byte order of the machine.
 */
-static void TTF_drawLine_Shaded(const TTF_Font *font, const Uint8 *textbuf, const int row)
+static __inline__ Uint32 TTF_loadBE32(const Uint8 *p)
 {
-    int line;
-    Uint8 *dst_check = (Uint8*)(textbuf+4) + fn_p(textbuf) * fn_h(textbuf);
-    Uint8 *dst;
-    int height;
+    Uint32 v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
 
-    TTF_initLineMectrics(font, textbuf, row, &dst, &height);
+static __inline__ void TTF_orBE32(Uint8 *p, Uint32 bits)
+{
+    Uint32 v;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    bits = __builtin_bswap32(bits);
+#endif
+    memcpy(&v, p, sizeof(v));
+    v |= bits;
+    memcpy(p, &v, sizeof(v));
+}
 
-    /* Draw line */
-    for ( line=height; line>0 && dst < dst_check; --line ) {
-        memset( dst, NUM_GRAYS - 1, fn_w(textbuf) );
-        dst += fn_p(textbuf);
+/* OR width bits of a packed glyph row into a packed surface row, starting
+   at pixel x.  Whole words are shifted into place and merged at once.
+*/
+static void TTF_orBits(Uint8 *dst, const Uint8 *dst_check, int x, const Uint8 *src, int width)
+{
+    const int shift = x & 7;
+    int whole = width / 8;
+    Uint32 carry = 0;
+    Uint8 last;
+
+    dst += x / 8;
+    while ( whole >= 4 && dst + 4 <= dst_check ) {
+        Uint32 bits = TTF_loadBE32(src);
+        TTF_orBE32(dst, (bits >> shift) | carry);
+        carry = shift ? (bits << (32 - shift)) : 0;
+        src += 4;
+        dst += 4;
+        whole -= 4;
+    }
+    carry >>= 24;
+    while ( whole > 0 && dst < dst_check ) {
+        *dst++ |= (Uint8)((*src >> shift) | carry);
+        carry = (Uint8)(*src++ << (8 - shift));
+        --whole;
+    }
+    /* Bits past the width are masked, the glyph may be clipped */
+    last = (width % 8) ? (Uint8)(*src & (0xFF00 >> (width % 8))) : 0;
+    if ( dst < dst_check ) {
+        *dst++ |= (Uint8)((last >> shift) | carry);
+    }
+    if ( shift && dst < dst_check ) {
+        *dst |= (Uint8)(last << (8 - shift));
     }
 }
 
-/* Draw a blended line of underline_height (+ optional outline)
-   at the given row. The row value must take the
-   outline into account.
+/* row |= row >> shift, on a packed row, in place */
+static void TTF_smearBits(Uint8 *row, int nbytes, int shift)
+{
+    const int skip = shift / 8;
+    const int bits = shift % 8;
+    int i;
+
+    for ( i = nbytes - 1; i >= skip; --i ) {
+        Uint8 v = (Uint8)(row[i - skip] >> bits);
+        if ( bits && i - skip > 0 ) {
+            v |= (Uint8)(row[i - skip - 1] << (8 - bits));
+        }
+        row[i] |= v;
+    }
+}
+
+/* Synthetic bold on a packed row: every pixel becomes the OR of itself
+   and the overhang pixels to its left.  The window doubles each step.
+*/
+static void TTF_boldBits(Uint8 *row, int nbytes, int overhang)
+{
+    int window = 1;
+
+    while ( window <= overhang ) {
+        int step = overhang + 1 - window;
+        if ( step > window ) {
+            step = window;
+        }
+        TTF_smearBits(row, nbytes, step);
+        window += step;
+    }
+}
+
+static void TTF_setLUTChannel(TTF_PixelLUT *lut, int shift, Uint32 mask)
+{
+    lut->shift = shift;
+    lut->mask = mask;
+}
+
+/* Pack an opaque or blended color into one of the output formats */
+static Uint32 TTF_packPixel(int format, Uint32 a, Uint32 r, Uint32 g, Uint32 b)
+{
+    switch (format) {
+        case TTF_PIXELFORMAT_ARGB8888:
+            return (a << 24) | (r << 16) | (g << 8) | b;
+        case TTF_PIXELFORMAT_BGRA8888:
+            return (b << 24) | (g << 16) | (r << 8) | a;
+        case TTF_PIXELFORMAT_RGBA8888:
+            return (r << 24) | (g << 16) | (b << 8) | a;
+        case TTF_PIXELFORMAT_RGB565:
+            return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        default:
+            return a;
+    }
+}
+
+/* Set the depth of a LUT from its format, -1 if the format is unknown */
+static int TTF_initLUTDepth(TTF_PixelLUT *lut, int format)
+{
+    switch (format) {
+        case TTF_PIXELFORMAT_ARGB8888:
+        case TTF_PIXELFORMAT_BGRA8888:
+        case TTF_PIXELFORMAT_RGBA8888:
+            lut->depth = 32;
+            break;
+        case TTF_PIXELFORMAT_RGB565:
+            lut->depth = 16;
+            break;
+        case TTF_PIXELFORMAT_A8:
+        case TTF_PIXELFORMAT_INDEX8:
+            lut->depth = 8;
+            break;
+        default:
+            TTF_SetError("Unknown pixel format");
+            return -1;
+    }
+    return 0;
+}
+
+/* Pick the channel that changes most along the LUT and build the table
+   that maps its value back to a coverage index.  Colors are monotonic
+   along the ramp, so this recovers the coverage under overlapping glyphs
+   without keeping a separate coverage plane.  Returns -1 for a format
+   missing from the table.
+*/
+static int TTF_initLUTInverse(TTF_PixelLUT *lut, int format, int rdiff, int gdiff, int bdiff)
+{
+    static const struct {
+        int shift[3];           /* r, g, b */
+        Uint32 mask[3];
+    } layouts[] = {
+        { { 16, 8, 0 },  { 0xFF, 0xFF, 0xFF } },  /* ARGB8888 */
+        { { 8, 16, 24 }, { 0xFF, 0xFF, 0xFF } },  /* BGRA8888 */
+        { { 24, 16, 8 }, { 0xFF, 0xFF, 0xFF } },  /* RGBA8888 */
+        { { 0, 0, 0 },   { 0xFF, 0xFF, 0xFF } },  /* A8 */
+        { { 11, 5, 0 },  { 0x1F, 0x3F, 0x1F } },  /* RGB565 */
+    };
+    int diff[3];
+    int channel = 0;
+    int i;
+
+    if ( format < 0 || format >= (int)(sizeof(layouts) / sizeof(layouts[0])) ) {
+        TTF_SetError("Unknown pixel format");
+        return -1;
+    }
+
+    diff[0] = abs(rdiff);
+    diff[1] = abs(gdiff);
+    diff[2] = abs(bdiff);
+    for ( i = 1; i < 3; ++i ) {
+        if ( diff[i] > diff[channel] ) {
+            channel = i;
+        }
+    }
+    TTF_setLUTChannel(lut, layouts[format].shift[channel], layouts[format].mask[channel]);
+
+    /* Lowest coverage wins when several map to the same channel value */
+    memset(lut->inverse, 0, sizeof(lut->inverse));
+    for ( i = NUM_GRAYS - 1; i >= 0; --i ) {
+        lut->inverse[(lut->pixel[i] >> lut->shift) & lut->mask] = (Uint8)i;
+    }
+    lut->use_inverse = 1;
+    return 0;
+}
+
+/* Build the LUT of the blended modes: text color at every alpha */
+static int TTF_initPixelLUT(TTF_PixelLUT *lut, int format, Uint32 fg)
+{
+    int premultiplied = (format & TTF_PIXELFORMAT_PREMULTIPLIED);
+    Uint32 a;
+
+    format &= ~TTF_PIXELFORMAT_PREMULTIPLIED;
+    if ( format == TTF_PIXELFORMAT_INDEX8 ) {
+        TTF_SetError("Blended text needs a pixel format with coverage");
+        return -1;
+    }
+    if ( TTF_initLUTDepth(lut, format) < 0 ) {
+        return -1;
+    }
+    if ( format == TTF_PIXELFORMAT_RGB565 ) {
+        /* There is no alpha to keep, so coverage goes into the color */
+        premultiplied = 1;
+    }
+
+    for ( a = 0; a < NUM_GRAYS; ++a ) {
+        Uint32 r = cl_r(fg);
+        Uint32 g = cl_g(fg);
+        Uint32 b = cl_b(fg);
+
+        if ( premultiplied ) {
+            r = (r * a + 127) / 255;
+            g = (g * a + 127) / 255;
+            b = (b * a + 127) / 255;
+        }
+        lut->pixel[a] = TTF_packPixel(format, a, r, g, b);
+    }
+
+    /* The alpha channel is the coverage, except without one */
+    lut->use_inverse = 0;
+    if ( format == TTF_PIXELFORMAT_ARGB8888 ) {
+        TTF_setLUTChannel(lut, 24, 0xFF);
+    } else if ( format == TTF_PIXELFORMAT_RGB565 ) {
+        if ( TTF_initLUTInverse(lut, format, cl_r(fg), cl_g(fg), cl_b(fg)) < 0 ) {
+            return -1;
+        }
+    } else {
+        TTF_setLUTChannel(lut, 0, 0xFF);
+    }
+    return 0;
+}
+
+/* Build the LUT of the shaded modes: NUM_GRAYS opaque levels of shading
+   from bg to fg, or plain indices for an 8-bit paletted surface.
+*/
+static int TTF_initShadedLUT(TTF_PixelLUT *lut, int format, Uint32 fg, Uint32 bg)
+{
+    int rdiff;
+    int gdiff;
+    int bdiff;
+    int index;
+
+    /* The levels are opaque, premultiplying them changes nothing */
+    format &= ~TTF_PIXELFORMAT_PREMULTIPLIED;
+    if ( TTF_initLUTDepth(lut, format) < 0 ) {
+        return -1;
+    }
+
+    rdiff = cl_r(fg) - cl_r(bg);
+    gdiff = cl_g(fg) - cl_g(bg);
+    bdiff = cl_b(fg) - cl_b(bg);
+
+    for ( index = 0; index < NUM_GRAYS; ++index ) {
+        Uint32 r = cl_r(bg) + (index*rdiff) / (NUM_GRAYS-1);
+        Uint32 g = cl_g(bg) + (index*gdiff) / (NUM_GRAYS-1);
+        Uint32 b = cl_b(bg) + (index*bdiff) / (NUM_GRAYS-1);
+
+        lut->palette[index] = TTF_packPixel(TTF_PIXELFORMAT_ARGB8888, 0xFF, r, g, b);
+        if ( lut->depth == 8 ) {
+            lut->pixel[index] = (Uint32)index;
+        } else {
+            lut->pixel[index] = TTF_packPixel(format, 0xFF, r, g, b);
+        }
+    }
+
+    lut->use_inverse = 0;
+    TTF_setLUTChannel(lut, 0, 0xFF);
+    if ( lut->depth != 8 ) {
+        return TTF_initLUTInverse(lut, format, rdiff, gdiff, bdiff);
+    }
+    return 0;
+}
+
+/* Composite one row of glyph coverage into a surface.  Coverage is merged
+   with what is already there exactly like the original ARGB path did
+   (alpha |= coverage), then the pixel is emitted from the LUT.
+*/
+static void TTF_blendRow(const TTF_PixelLUT *lut, Uint8 *dst, const Uint8 *dst_check,
+                         const Uint8 *src, int width)
+{
+    const int shift = lut->shift;
+    const Uint32 mask = lut->mask;
+    int col;
+
+    if ( lut->depth == 32 ) {
+        Uint32 *dst32 = (Uint32 *)dst;
+        if ( lut->use_inverse ) {
+            /* The inverse can be lossy, so leave untouched pixels alone */
+            for ( col = width; col > 0 && (Uint8 *)dst32 < dst_check; --col ) {
+                if ( *src ) {
+                    *dst32 = lut->pixel[lut->inverse[(*dst32 >> shift) & mask] | *src];
+                }
+                ++src;
+                ++dst32;
+            }
+        } else {
+            for ( col = width; col > 0 && (Uint8 *)dst32 < dst_check; --col ) {
+                Uint32 alpha = ((*dst32 >> shift) & mask) | *src++;
+                *dst32++ = lut->pixel[alpha];
+            }
+        }
+    } else if ( lut->depth == 16 ) {
+        Uint16 *dst16 = (Uint16 *)dst;
+        for ( col = width; col > 0 && (Uint8 *)dst16 < dst_check; --col ) {
+            if ( *src ) {
+                *dst16 = (Uint16)lut->pixel[lut->inverse[(*dst16 >> shift) & mask] | *src];
+            }
+            ++src;
+            ++dst16;
+        }
+    } else {
+        for ( col = width; col > 0 && dst < dst_check; --col ) {
+            *dst++ |= *src++;
+        }
+    }
+}
+
+/* Draw a shaded or blended line of underline_height (+ optional outline)
+   at the given row, from column x for width pixels, in full coverage of
+   the LUT. The row value must take the outline into account.
 */
-static void TTF_drawLine_Blended(const TTF_Font *font, const Uint8 *textbuf, const int row, const Uint32 color)
+static void TTF_drawLineSpan_LUT(const TTF_Font *font, const Uint8 *textbuf, const int row, int x, int width, const TTF_PixelLUT *lut)
 {
     int line;
-    Uint32 *dst_check = (Uint32*)(textbuf + 8) + fn_p(textbuf)/4 * fn_h(textbuf);
-    Uint8 *dst8; /* destination, byte version */
-    Uint32 *dst;
+    Uint8 *dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+    Uint8 *dst;
     int height;
     int col;
-    Uint32 pixel = color | 0xFF000000; /* Amask */
+    Uint32 pixel = lut->pixel[NUM_GRAYS - 1];
+
+    if ( x < 0 ) {
+        width += x;
+        x = 0;
+    }
+    if ( x + width > fn_w(textbuf) ) {
+        width = fn_w(textbuf) - x;
+    }
+    if ( width <= 0 ) {
+        return;
+    }
 
-    TTF_initLineMectrics(font, textbuf, row, &dst8, &height);
-    dst = (Uint32 *) dst8;
+    TTF_initLineMectrics(font, textbuf, row, &dst, &height);
+    dst += x * (lut->depth / 8);
 
     /* Draw line */
     for ( line=height; line>0 && dst < dst_check; --line ) {
-        for ( col=0; col < fn_w(textbuf); ++col ) {
-            dst[col] = pixel;
+        if ( lut->depth == 32 ) {
+            for ( col=0; col < width; ++col ) {
+                ((Uint32 *)dst)[col] = pixel;
+            }
+        } else if ( lut->depth == 16 ) {
+            for ( col=0; col < width; ++col ) {
+                ((Uint16 *)dst)[col] = (Uint16)pixel;
+            }
+        } else {
+            memset( dst, (Uint8)pixel, width );
         }
-        dst += fn_p(textbuf)/4;
+        dst += fn_p(textbuf);
     }
 }
 
+static void TTF_drawLine_LUT(const TTF_Font *font, const Uint8 *textbuf, const int row, const TTF_PixelLUT *lut)
+{
+    TTF_drawLineSpan_LUT(font, textbuf, row, 0, fn_w(textbuf), lut);
+}
+
 /* This function tells the library whether UNICODE text is generally
    byteswapped.  A UNICODE BOM character at the beginning of a string
    will override this setting for that string.
@@ -336,6 +873,32 @@ void TTF_ByteSwappedUNICODE(int swapped)
     TTF_byteswapped = swapped;
 }
 
+/* Tables expanding one byte of a packed FreeType bitmap into its pixels:
+   1-bpp to 0/1, 2-bpp and 4-bpp to NUM_GRAYS levels.  Filled once.
+*/
+static Uint8 TTF_unpack_mono[256][8];
+static Uint8 TTF_unpack_gray2[256][4];
+static Uint8 TTF_unpack_gray4[256][2];
+
+static void TTF_initUnpackTables( void )
+{
+    int c, k;
+
+    for ( c = 0; c < 256; ++c ) {
+        for ( k = 0; k < 8; ++k ) {
+            TTF_unpack_mono[c][k] = (c >> (7 - k)) & 0x1;
+        }
+        for ( k = 0; k < 4; ++k ) {
+            int level = (c >> (6 - 2 * k)) & 0x3;
+            TTF_unpack_gray2[c][k] = level ? NUM_GRAYS * level / 3 - 1 : 0;
+        }
+        for ( k = 0; k < 2; ++k ) {
+            int level = (c >> (4 - 4 * k)) & 0xF;
+            TTF_unpack_gray4[c][k] = level ? NUM_GRAYS * level / 15 - 1 : 0;
+        }
+    }
+}
+
 static void TTF_SetFTError(const char *msg, FT_Error error)
 {
 #ifdef USE_FREETYPE_ERRORS
@@ -350,7 +913,6 @@ static void TTF_SetFTError(const char *msg, FT_Error error)
     };
     int i;
     const char *err_msg;
-    char buffer[1024];
 
     err_msg = NULL;
     for ( i=0; i<((sizeof ft_errors)/(sizeof ft_errors[0])); ++i ) {
@@ -362,10 +924,9 @@ static void TTF_SetFTError(const char *msg, FT_Error error)
     if ( ! err_msg ) {
         err_msg = "unknown FreeType error";
     }
-    sprintf(buffer, "%s: %s", msg, err_msg);
-    TTF_SetError(buffer);
+    TTF_SetError("%s: %s", msg, err_msg);
 #else
-    TTF_SetError(msg);
+    TTF_SetError("%s", msg);
 #endif /* USE_FREETYPE_ERRORS */
 }
 
@@ -373,19 +934,59 @@ int TTF_Init( void )
 {
     int status = 0;
 
+    pthread_mutex_lock( &TTF_library_lock );
     if ( ! TTF_initialized ) {
-        FT_Error error = FT_Init_FreeType( &library );
+        FT_Error error;
+
+        TTF_initUnpackTables();
+        error = FT_Init_FreeType( &library );
         if ( error ) {
             TTF_SetFTError("Couldn't init FreeType engine", error);
             status = -1;
         }
     }
     if ( status == 0 ) {
-        ++TTF_initialized;
+        __atomic_add_fetch( &TTF_initialized, 1, __ATOMIC_RELEASE );
     }
+    pthread_mutex_unlock( &TTF_library_lock );
     return status;
 }
 
+/* A font stream over a file.  Files are read with pread() through a small
+   read-ahead buffer, since FreeType asks for many tiny pieces of a font;
+   sources without a file descriptor are read with stdio instead.
+ */
+#define READAHEAD_SIZE  16384
+
+typedef struct {
+    FT_StreamRec stream;
+    FILE *src;
+    int fd;                     /* -1 to read through stdio */
+    Sint64 base;                /* file offset where the font starts */
+    Sint64 pos;                 /* file offset of the buffered bytes */
+    unsigned long len;
+    Uint8 buffer[READAHEAD_SIZE];
+} TTF_FileStream;
+
+/* Read up to count bytes at offset, returning how many were read */
+static unsigned long File_Read( int fd, Uint8 *buffer, unsigned long count, Sint64 offset )
+{
+    unsigned long done = 0;
+    ssize_t n;
+
+    while ( done < count ) {
+        n = pread( fd, buffer + done, count - done, (off_t)(offset + done) );
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n <= 0 ) {
+            break;
+        }
+        done += (unsigned long)n;
+    }
+    return done;
+}
+
 static unsigned long RWread(
     FT_Stream stream,
     unsigned long offset,
@@ -393,89 +994,94 @@ static unsigned long RWread(
     unsigned long count
 )
 {
-    FILE *src;
-
-    src = (FILE*)stream->descriptor.pointer;
-    fseek( src, (int)offset, SEEK_SET ); // TODO
+    TTF_FileStream *file = (TTF_FileStream *)stream;
+    Sint64 start = file->base + (Sint64)offset;
+    unsigned long done = 0;
+    unsigned long n;
+
+    if ( file->fd < 0 ) {
+        if ( fseeko( file->src, (off_t)start, SEEK_SET ) < 0 || count == 0 ) {
+            return 0;
+        }
+        return (unsigned long)fread( buffer, 1, count, file->src );
+    }
     if ( count == 0 ) {
         return 0;
     }
-    return (unsigned long)fread( buffer, 1, (int)count, src );
-}
-
-TTF_Font* TTF_OpenFontIndexRW( FILE *src, int freesrc, int ptsize, long index )
-{
-    TTF_Font* font;
-    FT_Error error;
-    FT_Face face;
-    FT_Fixed scale;
-    FT_Stream stream;
-    FT_CharMap found;
-    Sint64 position;
-    int i;
 
-    if ( ! TTF_initialized ) {
-        TTF_SetError( "Library not initialized" );
-        if ( src && freesrc ) {
-            fclose( src );
+    /* Take what we can from the read-ahead buffer */
+    if ( start >= file->pos && start < file->pos + (Sint64)file->len ) {
+        done = (unsigned long)(file->pos + (Sint64)file->len - start);
+        if ( done > count ) {
+            done = count;
         }
-        return NULL;
-    }
-
-    if ( ! src ) {
-        TTF_SetError( "Passed a NULL font source" );
-        return NULL;
-    }
-
-    /* Check to make sure we can seek in this stream */
-    position = ftell(src);
-    if ( position < 0 ) {
-        TTF_SetError( "Can't seek in stream" );
-        if ( freesrc ) {
-            fclose( src );
+        memcpy( buffer, file->buffer + (start - file->pos), done );
+        if ( done == count ) {
+            return count;
         }
-        return NULL;
+        start += done;
     }
-    fseek(src, 0, SEEK_END);
-    Sint64 fsize = ftell(src);
-    fseek(src, (int)position, SEEK_SET);
 
-    font = (TTF_Font*) malloc(sizeof *font);
-    if ( font == NULL ) {
-        TTF_SetError( "Out of memory" );
-        if ( freesrc ) {
-            fclose( src );
-        }
-        return NULL;
+    /* Large reads go straight to the caller */
+    if ( count - done >= READAHEAD_SIZE ) {
+        return done + File_Read( file->fd, buffer + done, count - done, start );
     }
-    memset(font, 0, sizeof(*font));
-
-    font->src = src;
-    font->freesrc = freesrc;
 
-    stream = (FT_Stream)malloc(sizeof(*stream));
-    if ( stream == NULL ) {
-        TTF_SetError( "Out of memory" );
-        TTF_CloseFont( font );
-        return NULL;
+    file->pos = start;
+    file->len = File_Read( file->fd, file->buffer, READAHEAD_SIZE, start );
+    n = count - done;
+    if ( n > file->len ) {
+        n = file->len;
     }
-    memset(stream, 0, sizeof(*stream));
-
-    stream->read = RWread;
-    stream->descriptor.pointer = src;
-    stream->pos = (unsigned long)position;
-    stream->size = (unsigned long)(fsize - position);
+    memcpy( buffer + done, file->buffer, n );
+    return done + n;
+}
 
-    font->args.flags = FT_OPEN_STREAM;
-    font->args.stream = stream;
+/* Map a regular file into memory from offset to its end */
+static int TTF_MapFile( TTF_Font *font, int fd, Sint64 offset )
+{
+    struct stat st;
+    Sint64 base;
+    long page;
+    void *map;
 
-    error = FT_Open_Face( library, &font->args, index, &font->face );
-    if ( error ) {
-        TTF_SetFTError( "Couldn't load font file", error );
-        TTF_CloseFont( font );
-        return NULL;
+    if ( fstat( fd, &st ) < 0 || !S_ISREG( st.st_mode ) ||
+         offset >= (Sint64)st.st_size ) {
+        return -1;
     }
-    face = font->face;
+    if ( (Uint64)st.st_size > SIZE_MAX ) {
+        return -1;
+    }
+    page = sysconf( _SC_PAGESIZE );
+    base = (page > 0) ? offset - offset % page : 0;
+    map = mmap( NULL, (size_t)(st.st_size - base), PROT_READ, MAP_PRIVATE, fd, (off_t)base );
+    if ( map == MAP_FAILED ) {
+        return -1;
+    }
+    font->map = map;
+    font->mapsize = (size_t)(st.st_size - base);
+    font->data = (Uint8 *)map + (offset - base);
+    font->datasize = (size_t)(st.st_size - offset);
+    return 0;
+}
+
+/* Set the font size on the active size of a face */
+static FT_Error TTF_setSize( const TTF_Font *font, FT_Face face )
+{
+    if ( FT_IS_SCALABLE(face) ) {
+        /* Set the character size and use default DPI (72) */
+        return FT_Set_Char_Size( face, 0, font->char_size, 0, 0 );
+    }
+    return FT_Set_Pixel_Sizes( face,
+            face->available_sizes[font->font_size_family].width,
+            face->available_sizes[font->font_size_family].height );
+}
+
+/* Select the Unicode charmap of a face, if it has one */
+static void TTF_selectCharmap( FT_Face face )
+{
+    FT_CharMap found;
+    int i;
 
     /* Set charmap for loaded font */
     found = 0;
@@ -493,17 +1099,153 @@ TTF_Font* TTF_OpenFontIndexRW( FILE *src, int freesrc, int ptsize, long index )
         /* If this fails, continue using the default charmap */
         FT_Set_Charmap(face, found);
     }
+}
 
-    /* Make sure that our font face is scalable (global metrics) */
-    if ( FT_IS_SCALABLE(face) ) {
-        /* Set the character size and use default DPI (72) */
-        error = FT_Set_Char_Size( font->face, 0, ptsize * 64, 0, 0 );
+/* Select the Unicode charmap and the font size on a newly opened face */
+static FT_Error TTF_initFace( const TTF_Font *font, FT_Face face )
+{
+    TTF_selectCharmap( face );
+    return TTF_setSize( font, face );
+}
+
+static TTF_Context *TTF_GetContext( const TTF_Font* cfont );
+
+/* Add a context for the calling thread to the font.  Without a face to
+   wrap, a new one is opened over the font data, or for a size of another
+   font, a size is added to that font's face.  The font must be locked.
+   A face of its own parses the font again, but one face shared by every
+   thread would need a lock around each glyph load and kerning lookup,
+   which serializes the rasterizing the render threads do in parallel.
+*/
+static TTF_Context *TTF_NewContext( TTF_Font *font, FT_Face face )
+{
+    TTF_Context *ctx;
+    FT_Error error;
+
+    ctx = (TTF_Context *)calloc( 1, sizeof( *ctx ) );
+    if ( ctx == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+
+    if ( font->base ) {
+        TTF_Context *base = TTF_GetContext( font->base );
+
+        if ( base == NULL ) {
+            free( ctx );
+            return NULL;
+        }
+        face = base->face;
+        error = FT_New_Size( face, &ctx->size );
+        if ( !error ) {
+            FT_Activate_Size( ctx->size );
+            error = TTF_setSize( font, face );
+            if ( error ) {
+                FT_Done_Size( ctx->size );
+                FT_Activate_Size( base->size );
+            }
+        }
         if ( error ) {
             TTF_SetFTError( "Couldn't set font size", error );
-            TTF_CloseFont( font );
+            free( ctx );
+            return NULL;
+        }
+        ctx->owns_size = 1;
+    } else if ( face == NULL ) {
+        pthread_mutex_lock( &TTF_library_lock );
+        error = FT_Open_Face( library, &font->args, font->face_index, &face );
+        pthread_mutex_unlock( &TTF_library_lock );
+        if ( !error ) {
+            error = TTF_initFace( font, face );
+            if ( error ) {
+                pthread_mutex_lock( &TTF_library_lock );
+                FT_Done_Face( face );
+                pthread_mutex_unlock( &TTF_library_lock );
+            }
+        }
+        if ( error ) {
+            TTF_SetFTError( "Couldn't open font for this thread", error );
+            free( ctx );
             return NULL;
         }
+        ctx->owns_face = 1;
+    }
+
+    ctx->font = font;
+    ctx->face = face;
+    if ( ctx->size == NULL ) {
+        ctx->size = face->size;
+    }
+    ctx->owner = pthread_self();
+    ctx->next = font->contexts;
+    font->contexts = ctx;
+    return ctx;
+}
+
+/* Allocate an empty font with its locks set up */
+static TTF_Font *TTF_NewFont( long index )
+{
+    TTF_Font *font;
+    int i;
+
+    font = (TTF_Font*) malloc(sizeof *font);
+    if ( font == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    memset(font, 0, sizeof(*font));
+    pthread_mutex_init( &font->lock, NULL );
+    for ( i = 0; i < CACHE_STRIPES; ++i ) {
+        pthread_mutex_init( &font->cache_locks[i], NULL );
+        pthread_cond_init( &font->cache_loaded[i], NULL );
+    }
+    font->face_index = index;
+    font->shared = __atomic_load_n( &TTF_threadsafe, __ATOMIC_ACQUIRE );
+    font->serial = __atomic_add_fetch( &TTF_font_serial, 1, __ATOMIC_RELAXED );
+    return font;
+}
+
+/* Choose the size of a font from a 26.6 point size.  For non-scalable
+   fonts the size is the index of one of the sizes in the font instead,
+   the last one if too high.
+ */
+static void TTF_chooseSize( TTF_Font *font, FT_Face face, FT_F26Dot6 ptsize )
+{
+    long family;
 
+    if ( FT_IS_SCALABLE(face) ) {
+        font->char_size = ptsize;
+        font->font_size_family = 0;
+        return;
+    }
+    family = (long)((ptsize + 32) / 64);
+    if ( family >= face->num_fixed_sizes ) {
+        family = face->num_fixed_sizes - 1;
+    }
+    if ( family < 0 ) {
+        family = 0;
+    }
+    font->font_size_family = (int)family;
+}
+
+/* The size of a font as TTF_OpenFontSizeFixed() takes it: 26.6 points,
+   or for non-scalable fonts the index of the strike times 64 */
+static FT_F26Dot6 TTF_sizeKey( const TTF_Font *font )
+{
+    if ( FT_IS_SCALABLE(font->face) ) {
+        return font->char_size;
+    }
+    return (FT_F26Dot6)font->font_size_family * 64;
+}
+
+/* Set up the metrics and default style of a font from the active size of
+   its face */
+static void TTF_initMetrics( TTF_Font *font, FT_Face face )
+{
+    FT_Fixed scale;
+
+    /* Make sure that our font face is scalable (global metrics) */
+    if ( FT_IS_SCALABLE(face) ) {
         /* Get the scalable font metrics for this font */
         scale = face->size->metrics.y_scale;
         font->ascent  = FT_CEIL(FT_MulFix(face->ascender, scale));
@@ -514,30 +1256,14 @@ TTF_Font* TTF_OpenFontIndexRW( FILE *src, int freesrc, int ptsize, long index )
         font->underline_height = FT_FLOOR(FT_MulFix(face->underline_thickness, scale));
 
     } else {
-        /* Non-scalable font case.  ptsize determines which family
-         * or series of fonts to grab from the non-scalable format.
-         * It is not the point size of the font.
-         * */
-        if ( ptsize >= font->face->num_fixed_sizes )
-            ptsize = font->face->num_fixed_sizes - 1;
-        font->font_size_family = ptsize;
-        error = FT_Set_Pixel_Sizes( face,
-                face->available_sizes[ptsize].width,
-                face->available_sizes[ptsize].height );
-        if ( error ) {
-            TTF_SetFTError( "Couldn't set font size", error );
-            TTF_CloseFont( font );
-            return NULL;
-        }
-
         /* With non-scalale fonts, Freetype2 likes to fill many of the
          * font metrics with the value of 0.  The size of the
          * non-scalable fonts must be determined differently
          * or sometimes cannot be determined.
          * */
-        font->ascent = face->available_sizes[ptsize].height;
+        font->ascent = face->available_sizes[font->font_size_family].height;
         font->descent = 0;
-        font->height = face->available_sizes[ptsize].height;
+        font->height = face->available_sizes[font->font_size_family].height;
         font->lineskip = FT_CEIL(font->ascent);
         font->underline_offset = FT_FLOOR(face->underline_position);
         font->underline_height = FT_FLOOR(face->underline_thickness);
@@ -547,17 +1273,13 @@ TTF_Font* TTF_OpenFontIndexRW( FILE *src, int freesrc, int ptsize, long index )
         font->underline_height = 1;
     }
 
-#ifdef DEBUG_FONTS
-    printf("Font metrics:\n");
-    printf("\tascent = %d, descent = %d\n",
-        font->ascent, font->descent);
-    printf("\theight = %d, lineskip = %d\n",
-        font->height, font->lineskip);
-    printf("\tunderline_offset = %d, underline_height = %d\n",
-        font->underline_offset, font->underline_height);
-    printf("\tunderline_top_row = %d, strikethrough_top_row = %d\n",
+    TTF_Log(TTF_LOG_DEBUG, "Font metrics: ascent = %d, descent = %d, "
+        "height = %d, lineskip = %d, underline_offset = %d, "
+        "underline_height = %d, underline_top_row = %d, "
+        "strikethrough_top_row = %d",
+        font->ascent, font->descent, font->height, font->lineskip,
+        font->underline_offset, font->underline_height,
         TTF_underline_top_row(font), TTF_strikethrough_top_row(font));
-#endif
 
     /* Initialize the font face style */
     font->face_style = TTF_STYLE_NORMAL;
@@ -576,10 +1298,177 @@ TTF_Font* TTF_OpenFontIndexRW( FILE *src, int freesrc, int ptsize, long index )
     /* x offset = cos(((90.0-12)/360)*2*M_PI), or 12 degree angle */
     font->glyph_italics = 0.207f;
     font->glyph_italics *= font->height;
+}
+
+/* Find the characters of the basic plane a face has glyphs for, once
+   per file, so font stacks resolve characters without asking the face.
+ */
+static int TTF_initCoverage( TTF_Font *font, FT_Face face )
+{
+    FT_ULong ch;
+    FT_UInt index;
+
+    font->coverage = (Uint32 *)calloc( 0x10000 / 32, sizeof(*font->coverage) );
+    if ( font->coverage == NULL ) {
+        TTF_OutOfMemory();
+        return -1;
+    }
+    ch = FT_Get_First_Char( face, &index );
+    while ( index != 0 && ch < 0x10000 ) {
+        font->coverage[ch / 32] |= 1U << (ch % 32);
+        ch = FT_Get_Next_Char( face, ch, &index );
+    }
+    return 0;
+}
+
+/* Open the face described by font->args and set the font up around it.
+   The font is closed if this fails.
+ */
+static TTF_Font *TTF_LoadFont( TTF_Font *font, int ptsize, long index )
+{
+    FT_Error error;
+    FT_Face face;
+
+    pthread_mutex_lock( &TTF_library_lock );
+    error = FT_Open_Face( library, &font->args, index, &font->face );
+    pthread_mutex_unlock( &TTF_library_lock );
+    if ( error ) {
+        TTF_SetFTError( "Couldn't load font file", error );
+        TTF_CloseFont( font );
+        return NULL;
+    }
+    face = font->face;
+
+    TTF_chooseSize( font, face, (FT_F26Dot6)ptsize * 64 );
+    error = TTF_initFace( font, face );
+    if ( error ) {
+        TTF_SetFTError( "Couldn't set font size", error );
+        TTF_CloseFont( font );
+        return NULL;
+    }
+
+    /* The opening thread renders through the face just opened */
+    if ( TTF_NewContext( font, face ) == NULL ) {
+        TTF_CloseFont( font );
+        return NULL;
+    }
 
+    if ( TTF_initCoverage( font, face ) < 0 ) {
+        TTF_CloseFont( font );
+        return NULL;
+    }
+
+    TTF_initMetrics( font, face );
     return font;
 }
 
+/* Make a file the source of a font's face: mapped into memory when
+   possible, read into memory for shared fonts, or read through a stream.
+   The font takes the file over first, so closing it cleans up on error.
+ */
+static int TTF_AttachSource( TTF_Font *font, FILE *src, int freesrc )
+{
+    TTF_FileStream *stream;
+    Sint64 position;
+    Sint64 fsize;
+    int fd;
+
+    font->src = src;
+    font->freesrc = freesrc;
+
+    /* Check to make sure we can seek in this stream */
+    position = ftello(src);
+    if ( position < 0 ) {
+        TTF_SetError( "Can't seek in stream" );
+        return -1;
+    }
+    fseeko(src, 0, SEEK_END);
+    fsize = ftello(src);
+    fseeko(src, (off_t)position, SEEK_SET);
+    if ( fsize - position > LONG_MAX ) {
+        TTF_SetError( "Font file too large" );
+        return -1;
+    }
+
+    fflush( src );
+    fd = fileno( src );
+    if ( fd >= 0 && TTF_MapFile( font, fd, position ) == 0 ) {
+        /* The mapping outlives the file */
+        if ( freesrc ) {
+            fclose( src );
+            font->src = NULL;
+            font->freesrc = 0;
+        }
+    } else if ( font->shared ) {
+        /* Read the font once, so every thread can open a face over it */
+        font->datasize = (size_t)(fsize - position);
+        font->data = (Uint8 *)malloc( font->datasize );
+        if ( font->data == NULL ) {
+            TTF_OutOfMemory();
+            return -1;
+        }
+        font->freedata = 1;
+        if ( fread( font->data, 1, font->datasize, src ) != font->datasize ) {
+            TTF_SetError( "Couldn't read font file" );
+            return -1;
+        }
+    } else {
+        stream = (TTF_FileStream *)malloc(sizeof(*stream));
+        if ( stream == NULL ) {
+            TTF_OutOfMemory();
+            return -1;
+        }
+        memset(stream, 0, sizeof(*stream));
+        stream->src = src;
+        stream->fd = (fd >= 0 && lseek( fd, 0, SEEK_CUR ) >= 0) ? fd : -1;
+        stream->base = position;
+
+        stream->stream.read = RWread;
+        stream->stream.size = (unsigned long)(fsize - position);
+
+        font->args.flags = FT_OPEN_STREAM;
+        font->args.stream = &stream->stream;
+    }
+
+    if ( font->data ) {
+        font->args.flags = FT_OPEN_MEMORY;
+        font->args.memory_base = font->data;
+        font->args.memory_size = (FT_Long)font->datasize;
+    }
+    return 0;
+}
+
+TTF_Font* TTF_OpenFontIndexRW( FILE *src, int freesrc, int ptsize, long index )
+{
+    TTF_Font* font;
+
+    if ( ! TTF_INITIALIZED() ) {
+        TTF_SetError( "Library not initialized" );
+        if ( src && freesrc ) {
+            fclose( src );
+        }
+        return NULL;
+    }
+
+    if ( ! src ) {
+        TTF_SetError( "Passed a NULL font source" );
+        return NULL;
+    }
+
+    font = TTF_NewFont( index );
+    if ( font == NULL ) {
+        if ( freesrc ) {
+            fclose( src );
+        }
+        return NULL;
+    }
+    if ( TTF_AttachSource( font, src, freesrc ) < 0 ) {
+        TTF_CloseFont( font );
+        return NULL;
+    }
+    return TTF_LoadFont( font, ptsize, index );
+}
+
 TTF_Font* TTF_OpenFontRW( FILE *src, int freesrc, int ptsize )
 {
     return TTF_OpenFontIndexRW(src, freesrc, ptsize, 0);
@@ -589,9 +1478,7 @@ TTF_Font* TTF_OpenFontIndex( const char *file, int ptsize, long index )
 {
     FILE *rw = fopen(file, "rb");
     if ( rw == NULL ) {
-	char s[1024];
-	sprintf(s, "Cannot open file '%s'", file);
-        TTF_SetError(s);
+        TTF_SetError("Cannot open file '%s'", file);
         return NULL;
     }
     return TTF_OpenFontIndexRW(rw, 1, ptsize, index);
@@ -602,6 +1489,140 @@ TTF_Font* TTF_OpenFont( const char *file, int ptsize )
     return TTF_OpenFontIndex(file, ptsize, 0);
 }
 
+TTF_Font* TTF_OpenFontIndexMem( const void *data, size_t size, int freedata, int ptsize, long index )
+{
+    TTF_Font* font;
+
+    if ( ! TTF_INITIALIZED() ) {
+        TTF_SetError( "Library not initialized" );
+        if ( data && freedata ) {
+            free( (void *)data );
+        }
+        return NULL;
+    }
+
+    if ( ! data ) {
+        TTF_SetError( "Passed a NULL font source" );
+        return NULL;
+    }
+
+    if ( size > LONG_MAX ) {
+        TTF_SetError( "Font file too large" );
+        if ( freedata ) {
+            free( (void *)data );
+        }
+        return NULL;
+    }
+
+    font = TTF_NewFont( index );
+    if ( font == NULL ) {
+        if ( freedata ) {
+            free( (void *)data );
+        }
+        return NULL;
+    }
+    font->data = (Uint8 *)data;
+    font->datasize = size;
+    font->freedata = freedata;
+
+    font->args.flags = FT_OPEN_MEMORY;
+    font->args.memory_base = font->data;
+    font->args.memory_size = (FT_Long)size;
+    return TTF_LoadFont( font, ptsize, index );
+}
+
+TTF_Font* TTF_OpenFontMem( const void *data, size_t size, int freedata, int ptsize )
+{
+    return TTF_OpenFontIndexMem(data, size, freedata, ptsize, 0);
+}
+
+TTF_Font* TTF_OpenFontSizeFixed( TTF_Font *font, long ptsize )
+{
+    TTF_Font *base;
+    TTF_Font *sized;
+    TTF_Context *ctx;
+
+    TTF_CHECKPOINTER(font, NULL);
+
+    base = font->base ? font->base : font;
+    sized = TTF_NewFont( base->face_index );
+    if ( sized == NULL ) {
+        return NULL;
+    }
+    sized->shared = base->shared;
+    sized->base = base;
+    __atomic_add_fetch( &base->sizes, 1, __ATOMIC_RELAXED );
+    sized->face = base->face;
+    TTF_chooseSize( sized, sized->face, (FT_F26Dot6)ptsize );
+
+    pthread_mutex_lock( &sized->lock );
+    ctx = TTF_NewContext( sized, NULL );
+    pthread_mutex_unlock( &sized->lock );
+    if ( ctx == NULL ) {
+        TTF_CloseFont( sized );
+        return NULL;
+    }
+    TTF_initMetrics( sized, ctx->face );
+    return sized;
+}
+
+TTF_Font* TTF_OpenFontSize( TTF_Font *font, int ptsize )
+{
+    return TTF_OpenFontSizeFixed(font, (long)ptsize * 64);
+}
+
+/* Style variants.  Text mixing styles of one font draws the bold and
+   italic parts with sizes of the font set to those styles, so each style
+   keeps its glyphs in a cache of its own instead of the font flushing its
+   cache at every change.  The variants are made when first asked for and
+   closed with the font, or when its outline, hinting or kerning changes.
+*/
+static pthread_mutex_t TTF_variants_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TTF_GLYPH_STYLES (TTF_STYLE_BOLD | TTF_STYLE_ITALIC)
+
+static TTF_Font *TTF_StyleVariant( TTF_Font *font, int style )
+{
+    int variant = (style | font->face_style) & TTF_GLYPH_STYLES;
+    TTF_Font *sized;
+
+    if ( variant == (font->style & TTF_GLYPH_STYLES) ) {
+        return font;
+    }
+    sized = __atomic_load_n( &font->variants[variant], __ATOMIC_ACQUIRE );
+    if ( sized ) {
+        return sized;
+    }
+
+    pthread_mutex_lock( &TTF_variants_lock );
+    sized = font->variants[variant];
+    if ( sized == NULL ) {
+        sized = TTF_OpenFontSizeFixed( font, TTF_sizeKey( font ) );
+        if ( sized ) {
+            sized->style = variant | sized->face_style;
+            sized->outline = font->outline;
+            sized->hinting = font->hinting;
+            sized->kerning = font->kerning;
+            __atomic_store_n( &font->variants[variant], sized, __ATOMIC_RELEASE );
+        }
+    }
+    pthread_mutex_unlock( &TTF_variants_lock );
+    return sized;
+}
+
+/* No other thread may be using the font */
+static void TTF_CloseVariants( TTF_Font *font )
+{
+    int i;
+
+    for ( i = 0; i < 4; ++i ) {
+        if ( font->variants[i] ) {
+            TTF_CloseFont( font->variants[i] );
+            font->variants[i] = NULL;
+        }
+    }
+}
+
 static void Flush_Glyph( c_glyph* glyph )
 {
     glyph->stored = 0;
@@ -614,40 +1635,201 @@ static void Flush_Glyph( c_glyph* glyph )
         free( glyph->pixmap.buffer );
         glyph->pixmap.buffer = 0;
     }
+    if ( glyph->packed.buffer ) {
+        free( glyph->packed.buffer );
+        glyph->packed.buffer = 0;
+    }
     glyph->cached = 0;
 }
 
-static void Flush_Cache( TTF_Font* font )
+static void Flush_Glyphs( c_glyph **cache )
 {
     int i;
-    int size = sizeof( font->cache ) / sizeof( font->cache[0] );
 
-    for ( i = 0; i < size; ++i ) {
-        if ( font->cache[i].cached ) {
-            Flush_Glyph( &font->cache[i] );
-        }
+    for ( i = 0; i < CACHE_BUCKETS; ++i ) {
+        while ( cache[i] ) {
+            c_glyph *glyph = cache[i];
 
+            cache[i] = glyph->next;
+            Flush_Glyph( glyph );
+            free( glyph );
+        }
     }
 }
 
-static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want )
+/* Free every cached glyph.  No other thread may be using the font. */
+static void Flush_Cache( TTF_Font* font )
 {
-    FT_Face face;
-    FT_Error error;
-    FT_GlyphSlot glyph;
-    FT_Glyph_Metrics* metrics;
-    FT_Outline* outline;
+    TTF_Context *ctx;
 
-    if ( !font || !font->face ) {
-        return FT_Err_Invalid_Handle;
+    Flush_Glyphs( font->cache );
+    font->cache_count = 0;
+    for ( ctx = font->contexts; ctx; ctx = ctx->next ) {
+        Flush_Glyphs( ctx->cache );
+        ctx->cache_count = 0;
     }
+}
 
-    face = font->face;
-
-    /* Load the glyph */
-    if ( ! cached->index ) {
-        cached->index = FT_Get_Char_Index( face, ch );
-    }
+/* Unpack one row of a FreeType bitmap to a byte per pixel, 0/1 for the
+   mono cache or gray levels for the pixmap cache.  Rows are expanded a
+   source byte at a time through the tables, and the mono flags are taken
+   from the top bit of eight gray levels at once.  As before, the
+   destination must have room for the source pitch times 8/4/2 pixels.
+*/
+static void Unpack_Row( const FT_Bitmap* src, int mono, const Uint8 *srcp, Uint8 *dstp )
+{
+    const Uint64 high_bits = 0x8080808080808080ULL;
+    int j;
+
+    if ( src->pixel_mode == FT_PIXEL_MODE_MONO ) {
+        for ( j = 0; j < src->width; j += 8 ) {
+            Uint64 pixels;
+            memcpy( &pixels, TTF_unpack_mono[*srcp++], 8 );
+            if ( !mono ) {
+                pixels *= NUM_GRAYS - 1;
+            }
+            memcpy( dstp, &pixels, 8 );
+            dstp += 8;
+        }
+    } else if ( src->pixel_mode == FT_PIXEL_MODE_GRAY2 ) {
+        for ( j = 0; j < src->width; j += 4 ) {
+            Uint32 pixels;
+            memcpy( &pixels, TTF_unpack_gray2[*srcp++], 4 );
+            if ( mono ) {
+                pixels = (pixels & (Uint32)high_bits) >> 7;
+            }
+            memcpy( dstp, &pixels, 4 );
+            dstp += 4;
+        }
+    } else if ( src->pixel_mode == FT_PIXEL_MODE_GRAY4 ) {
+        for ( j = 0; j < src->width; j += 2 ) {
+            *dstp++ = mono ? TTF_unpack_gray4[*srcp][0] >> 7 : TTF_unpack_gray4[*srcp][0];
+            *dstp++ = mono ? TTF_unpack_gray4[*srcp][1] >> 7 : TTF_unpack_gray4[*srcp][1];
+            ++srcp;
+        }
+    } else if ( mono ) {
+        for ( j = 0; j + 8 <= src->width; j += 8 ) {
+            Uint64 pixels;
+            memcpy( &pixels, srcp + j, 8 );
+            pixels = (pixels & high_bits) >> 7;
+            memcpy( dstp + j, &pixels, 8 );
+        }
+        for ( ; j < src->width; ++j ) {
+            dstp[j] = srcp[j] >> 7;
+        }
+    } else {
+        memcpy( dstp, srcp, src->pitch );
+    }
+}
+
+/* Synthetic bold for bitmap strikes: every pixel becomes the saturated
+   sum (OR for mono) of itself and the overhang pixels to its left.  One
+   pass from the right with a running window sum, in place.
+*/
+static void Bold_Row( Uint8 *row, int width, int overhang, int mono )
+{
+    int sum = 0;
+    int col;
+
+    for ( col = width - 1; col >= 0 && col >= width - 1 - overhang; --col ) {
+        sum += row[col];
+    }
+    for ( col = width - 1; col >= 0; --col ) {
+        Uint8 pixel = row[col];
+        if ( mono ) {
+            row[col] = (sum != 0);
+        } else {
+            row[col] = (sum > NUM_GRAYS - 1) ? NUM_GRAYS - 1 : (Uint8)sum;
+        }
+        sum -= pixel;
+        if ( col - overhang - 1 >= 0 ) {
+            sum += row[col - overhang - 1];
+        }
+    }
+}
+
+/* Copy a rendered glyph into the packed 1-bpp cache format.  Mono
+   bitmaps are kept as FreeType made them, embedded graymaps are
+   thresholded at half coverage.
+*/
+static FT_Error Pack_Bitmap( TTF_Font* font, const FT_Bitmap* src, FT_Bitmap* dst, int bold )
+{
+    Uint8 *unpacked = NULL;
+    int row;
+    int col;
+
+    memcpy( dst, src, sizeof( *dst ) );
+    dst->pixel_mode = FT_PIXEL_MODE_MONO;
+    dst->buffer = NULL;
+
+    /* Adjust for bold and italic text */
+    if ( bold ) {
+        dst->width += font->glyph_overhang;
+    }
+    if ( TTF_HANDLE_STYLE_ITALIC(font) ) {
+        dst->width += (int)ceil(font->glyph_italics);
+    }
+    dst->pitch = (dst->width + 7) / 8;
+
+    if ( dst->rows == 0 || dst->pitch == 0 ) {
+        return 0;
+    }
+    dst->buffer = (unsigned char *)calloc( dst->rows, dst->pitch );
+    if ( !dst->buffer ) {
+        return FT_Err_Out_Of_Memory;
+    }
+    if ( src->pixel_mode != FT_PIXEL_MODE_MONO ) {
+        unpacked = (Uint8 *)malloc( src->pitch * 8 + 8 );
+        if ( !unpacked ) {
+            free( dst->buffer );
+            dst->buffer = NULL;
+            return FT_Err_Out_Of_Memory;
+        }
+    }
+
+    for ( row = 0; row < src->rows; ++row ) {
+        const Uint8 *srcp = src->buffer + row * src->pitch;
+        Uint8 *dstp = dst->buffer + row * dst->pitch;
+
+        if ( src->pixel_mode == FT_PIXEL_MODE_MONO ) {
+            memcpy( dstp, srcp, (src->width + 7) / 8 );
+            if ( src->width % 8 ) {
+                dstp[src->width / 8] &= (Uint8)(0xFF00 >> (src->width % 8));
+            }
+        } else {
+            /* Threshold through the byte unpacker, then repack */
+            Unpack_Row( src, 1, srcp, unpacked );
+            for ( col = 0; col < src->width; ++col ) {
+                dstp[col / 8] |= (Uint8)(unpacked[col] << (7 - col % 8));
+            }
+        }
+
+        /* Handle the bold style of bitmap strikes */
+        if ( bold ) {
+            TTF_boldBits( dstp, dst->pitch, font->glyph_overhang );
+        }
+    }
+    free( unpacked );
+    return 0;
+}
+
+static FT_Error Load_Glyph( TTF_Context* ctx, c_glyph* cached, int want )
+{
+    TTF_Font* font;
+    FT_Face face;
+    FT_Error error;
+    FT_GlyphSlot glyph;
+    FT_Glyph_Metrics* metrics;
+    FT_Outline* outline;
+
+    if ( !ctx || !ctx->face ) {
+        return FT_Err_Invalid_Handle;
+    }
+
+    font = ctx->font;
+    face = ctx->face;
+
+    /* Load the glyph */
     error = FT_Load_Glyph( face, cached->index, FT_LOAD_DEFAULT | font->hinting);
     if ( error ) {
         return error;
@@ -690,12 +1872,15 @@ static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want
         if ( TTF_HANDLE_STYLE_ITALIC(font) ) {
             cached->maxx += (int)ceil(font->glyph_italics);
         }
-        cached->stored |= CACHED_METRICS;
+        __atomic_or_fetch( &cached->stored, CACHED_METRICS, __ATOMIC_RELEASE );
     }
 
     if ( ((want & CACHED_BITMAP) && !(cached->stored & CACHED_BITMAP)) ||
-         ((want & CACHED_PIXMAP) && !(cached->stored & CACHED_PIXMAP)) ) {
-        int mono = (want & CACHED_BITMAP);
+         ((want & CACHED_PIXMAP) && !(cached->stored & CACHED_PIXMAP)) ||
+         ((want & CACHED_PACKED) && !(cached->stored & CACHED_PACKED)) ) {
+        int packed = (want & CACHED_PACKED) && !(cached->stored & CACHED_PACKED);
+        int mono = (want & CACHED_BITMAP) || packed;
+        int bold_bitmap;
         int i;
         FT_Bitmap* src;
         FT_Bitmap* dst;
@@ -713,6 +1898,18 @@ static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want
             FT_Outline_Transform( outline, &shear );
         }
 
+        /* Handle the bold style by emboldening the outline itself,
+         * only to the right so the bitmap still starts at minx.
+         * Bitmap strikes are emboldened after unpacking instead. */
+        bold_bitmap = TTF_HANDLE_STYLE_BOLD(font);
+        if ( bold_bitmap && glyph->format == FT_GLYPH_FORMAT_OUTLINE ) {
+            FT_Pos strength = font->glyph_overhang * 64;
+
+            FT_Outline_EmboldenXY( outline, strength, 0 );
+            FT_Outline_Translate( outline, strength / 2, 0 );
+            bold_bitmap = 0;
+        }
+
         /* Render as outline */
         if ( (font->outline > 0) && glyph->format != FT_GLYPH_FORMAT_BITMAP ) {
             FT_Stroker stroker;
@@ -739,6 +1936,19 @@ static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want
             }
             src = &glyph->bitmap;
         }
+
+        if ( packed ) {
+            error = Pack_Bitmap( font, src, &cached->packed, bold_bitmap );
+            if ( bitmap_glyph ) {
+                FT_Done_Glyph( bitmap_glyph );
+            }
+            if ( error ) {
+                return error;
+            }
+            __atomic_or_fetch( &cached->stored, CACHED_PACKED, __ATOMIC_RELEASE );
+            return 0;
+        }
+
         /* Copy over information to cache */
         if ( mono ) {
             dst = &cached->bitmap;
@@ -766,7 +1976,7 @@ static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want
         }
 
         /* Adjust for bold and italic text */
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+        if ( bold_bitmap ) {
             int bump = font->glyph_overhang;
             dst->pitch += bump;
             dst->width += bump;
@@ -780,156 +1990,30 @@ static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want
         if (dst->rows != 0) {
             dst->buffer = (unsigned char *)malloc( dst->pitch * dst->rows );
             if ( !dst->buffer ) {
+                if ( bitmap_glyph ) {
+                    FT_Done_Glyph( bitmap_glyph );
+                }
                 return FT_Err_Out_Of_Memory;
             }
             memset( dst->buffer, 0, dst->pitch * dst->rows );
 
             for ( i = 0; i < src->rows; i++ ) {
-                int soffset = i * src->pitch;
-                int doffset = i * dst->pitch;
-                if ( mono ) {
-                    unsigned char *srcp = src->buffer + soffset;
-                    unsigned char *dstp = dst->buffer + doffset;
-                    int j;
-                    if ( src->pixel_mode == FT_PIXEL_MODE_MONO ) {
-                        for ( j = 0; j < src->width; j += 8 ) {
-                            unsigned char c = *srcp++;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                            c <<= 1;
-                            *dstp++ = (c&0x80) >> 7;
-                        }
-                    }  else if ( src->pixel_mode == FT_PIXEL_MODE_GRAY2 ) {
-                        for ( j = 0; j < src->width; j += 4 ) {
-                            unsigned char c = *srcp++;
-                            *dstp++ = (((c&0xA0) >> 6) >= 0x2) ? 1 : 0;
-                            c <<= 2;
-                            *dstp++ = (((c&0xA0) >> 6) >= 0x2) ? 1 : 0;
-                            c <<= 2;
-                            *dstp++ = (((c&0xA0) >> 6) >= 0x2) ? 1 : 0;
-                            c <<= 2;
-                            *dstp++ = (((c&0xA0) >> 6) >= 0x2) ? 1 : 0;
-                        }
-                    } else if ( src->pixel_mode == FT_PIXEL_MODE_GRAY4 ) {
-                        for ( j = 0; j < src->width; j += 2 ) {
-                            unsigned char c = *srcp++;
-                            *dstp++ = (((c&0xF0) >> 4) >= 0x8) ? 1 : 0;
-                            c <<= 4;
-                            *dstp++ = (((c&0xF0) >> 4) >= 0x8) ? 1 : 0;
-                        }
-                    } else {
-                        for ( j = 0; j < src->width; j++ ) {
-                            unsigned char c = *srcp++;
-                            *dstp++ = (c >= 0x80) ? 1 : 0;
-                        }
-                    }
-                } else if ( src->pixel_mode == FT_PIXEL_MODE_MONO ) {
-                    /* This special case wouldn't
-                     * be here if the FT_Render_Glyph()
-                     * function wasn't buggy when it tried
-                     * to render a .fon font with 256
-                     * shades of gray.  Instead, it
-                     * returns a black and white surface
-                     * and we have to translate it back
-                     * to a 256 gray shaded surface.
-                     * */
-                    unsigned char *srcp = src->buffer + soffset;
-                    unsigned char *dstp = dst->buffer + doffset;
-                    unsigned char c;
-                    int j, k;
-                    for ( j = 0; j < src->width; j += 8) {
-                        c = *srcp++;
-                        for (k = 0; k < 8; ++k) {
-                            if ((c&0x80) >> 7) {
-                                *dstp++ = NUM_GRAYS - 1;
-                            } else {
-                                *dstp++ = 0x00;
-                            }
-                            c <<= 1;
-                        }
-                    }
-                } else if ( src->pixel_mode == FT_PIXEL_MODE_GRAY2 ) {
-                    unsigned char *srcp = src->buffer + soffset;
-                    unsigned char *dstp = dst->buffer + doffset;
-                    unsigned char c;
-                    int j, k;
-                    for ( j = 0; j < src->width; j += 4 ) {
-                        c = *srcp++;
-                        for ( k = 0; k < 4; ++k ) {
-                            if ((c&0xA0) >> 6) {
-                                *dstp++ = NUM_GRAYS * ((c&0xA0) >> 6) / 3 - 1;
-                            } else {
-                                *dstp++ = 0x00;
-                            }
-                            c <<= 2;
-                        }
-                    }
-                } else if ( src->pixel_mode == FT_PIXEL_MODE_GRAY4 ) {
-                    unsigned char *srcp = src->buffer + soffset;
-                    unsigned char *dstp = dst->buffer + doffset;
-                    unsigned char c;
-                    int j, k;
-                    for ( j = 0; j < src->width; j += 2 ) {
-                        c = *srcp++;
-                        for ( k = 0; k < 2; ++k ) {
-                            if ((c&0xF0) >> 4) {
-                                *dstp++ = NUM_GRAYS * ((c&0xF0) >> 4) / 15 - 1;
-                            } else {
-                                *dstp++ = 0x00;
-                            }
-                            c <<= 4;
-                        }
-                    }
-                } else {
-                    memcpy(dst->buffer+doffset,
-                           src->buffer+soffset, src->pitch);
-                }
-            }
-        }
+                Uint8 *dstp = dst->buffer + i * dst->pitch;
 
-        /* Handle the bold style */
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            int row;
-            int col;
-            int offset;
-            int pixel;
-            Uint8* pixmap;
-
-            /* The pixmap is a little hard, we have to add and clamp */
-            for ( row = dst->rows - 1; row >= 0; --row ) {
-                pixmap = (Uint8*) dst->buffer + row * dst->pitch;
-                for ( offset=1; offset <= font->glyph_overhang; ++offset ) {
-                    for ( col = dst->width - 1; col > 0; --col ) {
-                        if ( mono ) {
-                            pixmap[col] |= pixmap[col-1];
-                        } else {
-                            pixel = (pixmap[col] + pixmap[col-1]);
-                            if ( pixel > NUM_GRAYS - 1 ) {
-                                pixel = NUM_GRAYS - 1;
-                            }
-                            pixmap[col] = (Uint8) pixel;
-                        }
-                    }
+                Unpack_Row( src, mono, src->buffer + i * src->pitch, dstp );
+
+                /* Handle the bold style of bitmap strikes */
+                if ( bold_bitmap ) {
+                    Bold_Row( dstp, dst->width, font->glyph_overhang, mono );
                 }
             }
         }
 
         /* Mark that we rendered this format */
         if ( mono ) {
-            cached->stored |= CACHED_BITMAP;
+            __atomic_or_fetch( &cached->stored, CACHED_BITMAP, __ATOMIC_RELEASE );
         } else {
-            cached->stored |= CACHED_PIXMAP;
+            __atomic_or_fetch( &cached->stored, CACHED_PIXMAP, __ATOMIC_RELEASE );
         }
 
         /* Free outlined glyph */
@@ -938,41 +2022,289 @@ static FT_Error Load_Glyph( TTF_Font* font, Uint16 ch, c_glyph* cached, int want
         }
     }
 
-    /* We're done, mark this glyph cached */
-    cached->cached = ch;
+    return 0;
+}
+
+static c_glyph *Lookup_Glyph( TTF_Font* font, int h, Uint32 key )
+{
+    c_glyph *cached;
+
+    for ( cached = __atomic_load_n( &font->cache[h], __ATOMIC_ACQUIRE );
+          cached; cached = cached->next ) {
+        if ( cached->cached == key ) {
+            break;
+        }
+    }
+    return cached;
+}
+
+/* Find a glyph in the cache of the calling thread, for shared fonts whose
+   own cache is full.  Only this thread uses it, so it needs no lock. */
+static FT_Error Find_ThreadGlyph( TTF_Context* ctx, Uint32 key, int want, c_glyph** glyph )
+{
+    int h = key % CACHE_BUCKETS;
+    c_glyph *cached;
+
+    for ( cached = ctx->cache[h]; cached; cached = cached->next ) {
+        if ( cached->cached == key ) {
+            break;
+        }
+    }
+    if ( !cached ) {
+        if ( !ctx->cache_pins && ctx->cache_count >= CACHE_MAX_GLYPHS ) {
+            Flush_Glyphs( ctx->cache );
+            ctx->cache_count = 0;
+        }
+        cached = (c_glyph *)calloc( 1, sizeof( *cached ) );
+        if ( !cached ) {
+            return FT_Err_Out_Of_Memory;
+        }
+        cached->cached = key;
+        if ( key >= CACHE_INDEX_KEY ) {
+            cached->index = key - CACHE_INDEX_KEY;
+        } else {
+            cached->index = FT_Get_Char_Index( ctx->face, key );
+        }
+        cached->next = ctx->cache[h];
+        ctx->cache[h] = cached;
+        ++ctx->cache_count;
+    }
 
+    *glyph = cached;
+    if ( (cached->stored & want) != want ) {
+        return Load_Glyph( ctx, cached, want );
+    }
     return 0;
 }
 
-static FT_Error Find_Glyph( TTF_Font* font, Uint16 ch, int want )
+static FT_Error Find_CachedGlyph( TTF_Context* ctx, Uint32 key, int want, c_glyph** glyph )
 {
+    TTF_Font *font = ctx->font;
     int retval = 0;
-    int hsize = sizeof( font->cache ) / sizeof( font->cache[0] );
-
-    int h = ch % hsize;
-    font->current = &font->cache[h];
+    int h = key % CACHE_BUCKETS;
+    int stripe = h % CACHE_STRIPES;
+    c_glyph *cached;
+
+    /* Entries are published complete and never unlinked while the font
+     * is in use, so a hit is just a walk down the bucket. */
+    cached = Lookup_Glyph( font, h, key );
+    if ( cached && (__atomic_load_n( &cached->stored, __ATOMIC_ACQUIRE ) & want) == want ) {
+        *glyph = cached;
+        return 0;
+    }
+    if ( !cached && font->shared &&
+         __atomic_load_n( &font->cache_count, __ATOMIC_RELAXED ) >= CACHE_MAX_GLYPHS ) {
+        return Find_ThreadGlyph( ctx, key, want, glyph );
+    }
 
-    if (font->current->cached != ch)
-        Flush_Glyph( font->current );
+    pthread_mutex_lock( &font->cache_locks[stripe] );
+    if ( !cached ) {
+        cached = Lookup_Glyph( font, h, key );
+    }
+    if ( !cached ) {
+        if ( !font->shared && !ctx->cache_pins && font->cache_count >= CACHE_MAX_GLYPHS ) {
+            Flush_Cache( font );
+        }
+        cached = (c_glyph *)calloc( 1, sizeof( *cached ) );
+        if ( !cached ) {
+            pthread_mutex_unlock( &font->cache_locks[stripe] );
+            return FT_Err_Out_Of_Memory;
+        }
+        cached->cached = key;
+        if ( key >= CACHE_INDEX_KEY ) {
+            cached->index = key - CACHE_INDEX_KEY;
+        } else {
+            cached->index = FT_Get_Char_Index( ctx->face, key );
+        }
+        cached->next = font->cache[h];
+        __atomic_store_n( &font->cache[h], cached, __ATOMIC_RELEASE );
+        __atomic_add_fetch( &font->cache_count, 1, __ATOMIC_RELAXED );
+    }
 
-    if ( (font->current->stored & want) != want ) {
-        retval = Load_Glyph( font, ch, font->current, want );
+    /* Only one thread renders a glyph, the others wait for its result */
+    while ( cached->loading ) {
+        pthread_cond_wait( &font->cache_loaded[stripe], &font->cache_locks[stripe] );
     }
+    if ( (cached->stored & want) != want ) {
+        cached->loading = 1;
+        pthread_mutex_unlock( &font->cache_locks[stripe] );
+        retval = Load_Glyph( ctx, cached, want );
+        pthread_mutex_lock( &font->cache_locks[stripe] );
+        cached->loading = 0;
+        pthread_cond_broadcast( &font->cache_loaded[stripe] );
+    }
+    pthread_mutex_unlock( &font->cache_locks[stripe] );
+
+    *glyph = cached;
     return retval;
 }
 
+static FT_Error Find_Glyph( TTF_Context* ctx, Uint16 ch, int want, c_glyph** glyph )
+{
+    return Find_CachedGlyph( ctx, ch, want, glyph );
+}
+
+/* Find a glyph by its index in the face, for text shaped elsewhere */
+static FT_Error Find_GlyphIndex( TTF_Context* ctx, FT_UInt index, int want, c_glyph** glyph )
+{
+    if ( index > 0xFFFF ) {
+        return FT_Err_Invalid_Glyph_Index;
+    }
+    return Find_CachedGlyph( ctx, CACHE_INDEX_KEY + index, want, glyph );
+}
+
+/* Get the shaded ramp for a color pair, building it only on a miss */
+static const TTF_PixelLUT *Find_ShadedLUT( TTF_Context* ctx, Uint32 fg, Uint32 bg, int format )
+{
+    c_lut *cached;
+    int i;
+
+    for ( i = 0; i < CACHED_LUTS; ++i ) {
+        cached = &ctx->luts[i];
+        if ( cached->stored && cached->format == format &&
+             cached->fg == fg && cached->bg == bg ) {
+            return &cached->lut;
+        }
+    }
+
+    cached = &ctx->luts[ctx->next_lut];
+    ctx->next_lut = (ctx->next_lut + 1) % CACHED_LUTS;
+    cached->stored = 0;
+    if ( TTF_initShadedLUT( &cached->lut, format, fg, bg ) < 0 ) {
+        return NULL;
+    }
+    cached->format = format;
+    cached->fg = fg;
+    cached->bg = bg;
+    cached->stored = 1;
+    return &cached->lut;
+}
+
+/* Slots remembering the context this thread uses for recent fonts */
+#define CACHED_CONTEXTS 16
+
+typedef struct cached_context {
+    const TTF_Font *font;
+    Uint32 serial;
+    TTF_Context *ctx;
+} c_context;
+
+static TTF_THREAD_LOCAL c_context TTF_contexts[CACHED_CONTEXTS];
+
+/* Make the size of a context the one its face renders at, since the
+   sizes of a font share the face */
+static __inline__ TTF_Context *TTF_UseContext( TTF_Context *ctx )
+{
+    if ( ctx && ctx->face->size != ctx->size ) {
+        FT_Activate_Size( ctx->size );
+    }
+    return ctx;
+}
+
+/* Get the rasterizer context of the calling thread for a font, creating
+   it the first time a thread uses a shared font.  Contexts live until the
+   font is closed; a thread started later may take over the context of
+   one that has exited.
+*/
+static TTF_Context *TTF_GetContext( const TTF_Font* cfont )
+{
+    TTF_Font *font = (TTF_Font *)cfont;
+    c_context *slot;
+    TTF_Context *ctx;
+    pthread_t self;
+
+    if ( !font->shared ) {
+        return TTF_UseContext( font->contexts );
+    }
+
+    slot = &TTF_contexts[font->serial % CACHED_CONTEXTS];
+    if ( slot->font == font && slot->serial == font->serial ) {
+        return TTF_UseContext( slot->ctx );
+    }
+
+    self = pthread_self();
+    pthread_mutex_lock( &font->lock );
+    for ( ctx = font->contexts; ctx; ctx = ctx->next ) {
+        if ( pthread_equal( ctx->owner, self ) ) {
+            break;
+        }
+    }
+    if ( ctx == NULL ) {
+        ctx = TTF_NewContext( font, NULL );
+    }
+    pthread_mutex_unlock( &font->lock );
+
+    if ( ctx ) {
+        slot->font = font;
+        slot->serial = font->serial;
+        slot->ctx = ctx;
+    }
+    return TTF_UseContext( ctx );
+}
+
+/* Close the faces and the file of a font, leaving its glyph cache and
+   metrics.  A new serial keeps the thread slots of the old contexts from
+   matching the font again.
+*/
+static void TTF_ReleaseFace( TTF_Font* font )
+{
+    TTF_CloseVariants( font );
+    while ( font->contexts ) {
+        TTF_Context *ctx = font->contexts;
+
+        font->contexts = ctx->next;
+        if ( ctx->owns_size ) {
+            FT_Done_Size( ctx->size );
+        }
+        if ( ctx->owns_face ) {
+            pthread_mutex_lock( &TTF_library_lock );
+            FT_Done_Face( ctx->face );
+            pthread_mutex_unlock( &TTF_library_lock );
+        }
+        Flush_Glyphs( ctx->cache );
+        free( ctx );
+    }
+    if ( font->face && !font->base ) {
+        pthread_mutex_lock( &TTF_library_lock );
+        FT_Done_Face( font->face );
+        pthread_mutex_unlock( &TTF_library_lock );
+    }
+    font->face = NULL;
+    if ( font->args.stream ) {
+        free( font->args.stream );
+    }
+    memset( &font->args, 0, sizeof(font->args) );
+    if ( font->freesrc ) {
+        fclose( font->src );
+    }
+    font->src = NULL;
+    font->freesrc = 0;
+    if ( font->map ) {
+        munmap( font->map, font->mapsize );
+    } else if ( font->freedata ) {
+        free( font->data );
+    }
+    font->map = NULL;
+    font->data = NULL;
+    font->freedata = 0;
+    font->serial = __atomic_add_fetch( &TTF_font_serial, 1, __ATOMIC_RELAXED );
+}
+
 void TTF_CloseFont( TTF_Font* font )
 {
+    int i;
+
     if ( font ) {
         Flush_Cache( font );
-        if ( font->face ) {
-            FT_Done_Face( font->face );
-        }
-        if ( font->args.stream ) {
-            free( font->args.stream );
+        TTF_ReleaseFace( font );
+        if ( font->base ) {
+            __atomic_sub_fetch( &font->base->sizes, 1, __ATOMIC_RELAXED );
         }
-        if ( font->freesrc ) {
-            fclose( font->src );
+        free( font->coverage );
+        pthread_mutex_destroy( &font->lock );
+        for ( i = 0; i < CACHE_STRIPES; ++i ) {
+            pthread_mutex_destroy( &font->cache_locks[i] );
+            pthread_cond_destroy( &font->cache_loaded[i] );
         }
         free( font );
     }
@@ -1125,1060 +2457,6736 @@ static Uint32 UTF8_getch(const char **src, size_t *srclen)
     return ch;
 }
 
-int TTF_FontHeight(const TTF_Font *font)
+static char *TTF_strdup( const char *str )
 {
-    return(font->height);
+    char *copy;
+
+    if ( str == NULL ) {
+        return NULL;
+    }
+    copy = (char *)malloc( strlen(str) + 1 );
+    if ( copy ) {
+        strcpy( copy, str );
+    }
+    return copy;
 }
 
-int TTF_FontAscent(const TTF_Font *font)
+/* A pool of worker threads for rendering off the calling thread.  It runs
+   two kinds of work.  Tasks split a render in progress, such as the
+   rasterization of its missing glyphs; they live on the stack of the
+   thread that queued them, which waits for its group to finish and runs
+   queued tasks itself meanwhile.  Jobs are whole renders submitted with
+   TTF_SubmitRender(); each worker queues the jobs of some fonts, so one
+   font's jobs run together on warm caches, and idle workers steal from
+   the others. */
+typedef struct _TTF_TaskGroup {
+    int pending;
+} TTF_TaskGroup;
+
+typedef struct _TTF_Task {
+    void (*run)( void *data );
+    void *data;
+    TTF_TaskGroup *group;
+    struct _TTF_Task *next;
+} TTF_Task;
+
+struct _TTF_RenderJob {
+    TTF_Font *font;
+    char *text;
+    TTF_RenderParams params;
+    int status;
+    int refcount;
+    Uint8 *surface;
+    char error[TTF_ERROR_SIZE];
+    struct _TTF_RenderJob *next;
+};
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    TTF_RenderJob *jobs;        /* by priority, highest first */
+    const TTF_Font *last_font;
+} TTF_Worker;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    TTF_Task *head;
+    TTF_Task *tail;
+    int queued;                 /* jobs in all worker queues */
+    TTF_Worker *workers;
+    int nworkers;
+    int quit;
+} TTF_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* The pool must be locked */
+static void TTF_RunTask( TTF_Task *task )
 {
-    return(font->ascent);
+    TTF_pool.head = task->next;
+    if ( TTF_pool.head == NULL ) {
+        TTF_pool.tail = NULL;
+    }
+    pthread_mutex_unlock( &TTF_pool.lock );
+    task->run( task->data );
+    pthread_mutex_lock( &TTF_pool.lock );
+    if ( --task->group->pending == 0 ) {
+        pthread_cond_broadcast( &TTF_pool.done );
+    }
 }
 
-int TTF_FontDescent(const TTF_Font *font)
+static void TTF_ReleaseJob( TTF_RenderJob *job )
 {
-    return(font->descent);
+    if ( __atomic_sub_fetch( &job->refcount, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+        free( job->surface );
+        free( job->text );
+        free( job );
+    }
 }
 
-int TTF_FontLineSkip(const TTF_Font *font)
+static Uint8 *Render_Text( TTF_Font *font, const char *text, const TTF_RenderParams *params )
 {
-    return(font->lineskip);
+    switch ( params->mode ) {
+    case TTF_RENDER_SOLID:
+        return TTF_RenderUTF8_Solid_Format( font, text, params->fg, params->format );
+    case TTF_RENDER_SHADED:
+        return TTF_RenderUTF8_Shaded_Format( font, text, params->fg, params->bg, params->format );
+    case TTF_RENDER_BLENDED:
+        return TTF_RenderUTF8_Blended_Format( font, text, params->fg, params->format );
+    case TTF_RENDER_BLENDED_WRAPPED:
+        return TTF_RenderUTF8_Blended_Wrapped_Format( font, text, params->fg, params->wrapLength, params->format );
+    }
+    TTF_SetError( "Unknown render mode" );
+    return NULL;
 }
 
-int TTF_GetFontKerning(const TTF_Font *font)
+static Uint8 *Render_Job( TTF_RenderJob *job )
 {
-    return(font->kerning);
+    return Render_Text( job->font, job->text, &job->params );
 }
 
-void TTF_SetFontKerning(TTF_Font *font, int allowed)
+/* Run a job taken off a queue, unless it was cancelled meanwhile, and
+   drop the queue's reference to it */
+static void TTF_RunJob( TTF_RenderJob *job )
 {
-    font->kerning = allowed;
+    int status = TTF_JOB_PENDING;
+
+    if ( __atomic_compare_exchange_n( &job->status, &status, TTF_JOB_RUNNING, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+        job->surface = Render_Job( job );
+        if ( job->surface ) {
+            status = TTF_JOB_DONE;
+        } else {
+            status = TTF_JOB_FAILED;
+            snprintf( job->error, sizeof( job->error ), "%s", TTF_GetError() );
+        }
+        if ( job->params.callback ) {
+            job->params.callback( job->params.userdata, job, status );
+        }
+        pthread_mutex_lock( &TTF_pool.lock );
+        __atomic_store_n( &job->status, status, __ATOMIC_RELEASE );
+        pthread_cond_broadcast( &TTF_pool.done );
+        pthread_mutex_unlock( &TTF_pool.lock );
+    }
+    TTF_ReleaseJob( job );
 }
 
-long TTF_FontFaces(const TTF_Font *font)
+/* Take the next job of a worker's queue: the most urgent one, preferring
+   the font the worker rendered last among jobs of equal priority. */
+static TTF_RenderJob *TTF_PopJob( TTF_Worker *worker, const TTF_Font *last_font )
 {
-    return(font->face->num_faces);
+    TTF_RenderJob **link;
+    TTF_RenderJob **best;
+    TTF_RenderJob *job;
+
+    pthread_mutex_lock( &worker->lock );
+    best = &worker->jobs;
+    for ( link = &worker->jobs; *link; link = &(*link)->next ) {
+        if ( (*link)->params.priority != worker->jobs->params.priority ) {
+            break;
+        }
+        if ( (*link)->font == last_font ) {
+            best = link;
+            break;
+        }
+    }
+    job = *best;
+    if ( job ) {
+        *best = job->next;
+        __atomic_sub_fetch( &TTF_pool.queued, 1, __ATOMIC_RELAXED );
+    }
+    pthread_mutex_unlock( &worker->lock );
+    return job;
 }
 
-int TTF_FontFaceIsFixedWidth(const TTF_Font *font)
+/* Take a job from worker 'self' or steal one from another worker;
+   threads outside the pool pass -1 and steal only */
+static TTF_RenderJob *TTF_NextJob( int self )
 {
-    return(FT_IS_FIXED_WIDTH(font->face));
+    TTF_RenderJob *job = NULL;
+    int i;
+
+    if ( self >= 0 ) {
+        TTF_Worker *worker = &TTF_pool.workers[self];
+
+        job = TTF_PopJob( worker, worker->last_font );
+    }
+    for ( i = 1; job == NULL && i <= TTF_pool.nworkers; ++i ) {
+        int victim = (self + i) % TTF_pool.nworkers;
+
+        if ( victim != self ) {
+            job = TTF_PopJob( &TTF_pool.workers[victim], NULL );
+        }
+    }
+    if ( job && self >= 0 ) {
+        TTF_pool.workers[self].last_font = job->font;
+    }
+    return job;
 }
 
-char *TTF_FontFaceFamilyName(const TTF_Font *font)
+static void *TTF_PoolWorker( void *data )
 {
-    return(font->face->family_name);
+    int self = (int)(intptr_t)data;
+
+    pthread_mutex_lock( &TTF_pool.lock );
+    while ( !TTF_pool.quit ) {
+        /* Tasks have a render waiting on them, so they come first */
+        if ( TTF_pool.head ) {
+            TTF_RunTask( TTF_pool.head );
+        } else if ( __atomic_load_n( &TTF_pool.queued, __ATOMIC_RELAXED ) > 0 ) {
+            TTF_RenderJob *job;
+
+            pthread_mutex_unlock( &TTF_pool.lock );
+            job = TTF_NextJob( self );
+            if ( job ) {
+                TTF_RunJob( job );
+            }
+            pthread_mutex_lock( &TTF_pool.lock );
+        } else {
+            pthread_cond_wait( &TTF_pool.work, &TTF_pool.lock );
+        }
+    }
+    pthread_mutex_unlock( &TTF_pool.lock );
+    return NULL;
 }
 
-char *TTF_FontFaceStyleName(const TTF_Font *font)
+static void TTF_SubmitTasks( TTF_Task *tasks, int ntasks, TTF_TaskGroup *group )
 {
-    return(font->face->style_name);
+    int i;
+
+    pthread_mutex_lock( &TTF_pool.lock );
+    group->pending += ntasks;
+    for ( i = 0; i < ntasks; ++i ) {
+        tasks[i].group = group;
+        tasks[i].next = NULL;
+        if ( TTF_pool.tail ) {
+            TTF_pool.tail->next = &tasks[i];
+        } else {
+            TTF_pool.head = &tasks[i];
+        }
+        TTF_pool.tail = &tasks[i];
+    }
+    pthread_cond_broadcast( &TTF_pool.work );
+    pthread_mutex_unlock( &TTF_pool.lock );
 }
 
-int TTF_GlyphIsProvided(const TTF_Font *font, Uint16 ch)
+static void TTF_WaitTasks( TTF_TaskGroup *group )
 {
-  return(FT_Get_Char_Index(font->face, ch));
+    pthread_mutex_lock( &TTF_pool.lock );
+    while ( group->pending > 0 ) {
+        if ( TTF_pool.head ) {
+            TTF_RunTask( TTF_pool.head );
+        } else {
+            pthread_cond_wait( &TTF_pool.done, &TTF_pool.lock );
+        }
+    }
+    pthread_mutex_unlock( &TTF_pool.lock );
 }
 
-int TTF_GlyphMetrics(TTF_Font *font, Uint16 ch,
-                     int* minx, int* maxx, int* miny, int* maxy, int* advance)
+/* Stop the workers and cancel the jobs they had not started */
+static void TTF_StopPool( void )
 {
-    FT_Error error;
+    int i;
 
-    error = Find_Glyph(font, ch, CACHED_METRICS);
-    if ( error ) {
-        TTF_SetFTError("Couldn't find glyph", error);
-        return -1;
+    pthread_mutex_lock( &TTF_pool.lock );
+    TTF_pool.quit = 1;
+    pthread_cond_broadcast( &TTF_pool.work );
+    pthread_mutex_unlock( &TTF_pool.lock );
+    for ( i = 0; i < TTF_pool.nworkers; ++i ) {
+        pthread_join( TTF_pool.workers[i].thread, NULL );
     }
 
-    if ( minx ) {
-        *minx = font->current->minx;
-    }
-    if ( maxx ) {
-        *maxx = font->current->maxx;
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            *maxx += font->glyph_overhang;
-        }
-    }
-    if ( miny ) {
-        *miny = font->current->miny;
-    }
-    if ( maxy ) {
-        *maxy = font->current->maxy;
-    }
-    if ( advance ) {
-        *advance = font->current->advance;
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            *advance += font->glyph_overhang;
+    pthread_mutex_lock( &TTF_pool.lock );
+    for ( i = 0; i < TTF_pool.nworkers; ++i ) {
+        TTF_Worker *worker = &TTF_pool.workers[i];
+
+        while ( worker->jobs ) {
+            TTF_RenderJob *job = worker->jobs;
+            int status = TTF_JOB_PENDING;
+
+            worker->jobs = job->next;
+            __atomic_compare_exchange_n( &job->status, &status, TTF_JOB_CANCELLED, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+            TTF_ReleaseJob( job );
         }
+        pthread_mutex_destroy( &worker->lock );
     }
-    return 0;
+    pthread_cond_broadcast( &TTF_pool.done );
+    free( TTF_pool.workers );
+    TTF_pool.workers = NULL;
+    TTF_pool.nworkers = 0;
+    TTF_pool.queued = 0;
+    TTF_pool.quit = 0;
+    pthread_mutex_unlock( &TTF_pool.lock );
 }
 
-int TTF_SizeText(TTF_Font *font, const char *text, int *w, int *h)
+int TTF_SetRenderThreads( int threads )
 {
-    int status = -1;
-    Uint8 *utf8;
-
-    TTF_CHECKPOINTER(text, -1);
+    int i;
 
-    utf8 = (Uint8*)malloc(strlen(text)*2+1);
-    if ( utf8 ) {
-        LATIN1_to_UTF8(text, utf8);
-        status = TTF_SizeUTF8(font, (char *)utf8, w, h);
-        free(utf8);
-    } else {
+    TTF_StopPool();
+    if ( threads <= 0 ) {
+        return 0;
+    }
+    TTF_pool.workers = (TTF_Worker *)calloc( threads, sizeof( TTF_Worker ) );
+    if ( TTF_pool.workers == NULL ) {
         TTF_OutOfMemory();
+        return -1;
     }
-    return status;
+    for ( i = 0; i < threads; ++i ) {
+        pthread_mutex_init( &TTF_pool.workers[i].lock, NULL );
+    }
+
+    /* Workers see the final count, they take the lock before any work */
+    pthread_mutex_lock( &TTF_pool.lock );
+    for ( i = 0; i < threads; ++i ) {
+        if ( pthread_create( &TTF_pool.workers[i].thread, NULL, TTF_PoolWorker, (void *)(intptr_t)i ) != 0 ) {
+            break;
+        }
+    }
+    TTF_pool.nworkers = i;
+    for ( ; i < threads; ++i ) {
+        pthread_mutex_destroy( &TTF_pool.workers[i].lock );
+    }
+    pthread_mutex_unlock( &TTF_pool.lock );
+
+    if ( TTF_pool.nworkers == 0 ) {
+        TTF_SetError( "Couldn't create render threads" );
+        TTF_StopPool();
+        return -1;
+    }
+    return 0;
 }
 
-int TTF_SizeUTF8(TTF_Font *font, const char *text, int *w, int *h)
+/* Every task takes every ntasks'th of the missing glyphs */
+typedef struct {
+    TTF_Font *font;
+    const Uint16 *chars;
+    int nchars;
+    int first;
+    int step;
+    int want;
+} TTF_PrefetchTask;
+
+static void TTF_RunPrefetch( void *data )
 {
-    int status;
-    int x, z;
-    int minx, maxx;
-    int miny, maxy;
+    TTF_PrefetchTask *task = (TTF_PrefetchTask *)data;
+    TTF_Context *ctx = TTF_GetContext( task->font );
     c_glyph *glyph;
-    FT_Error error;
-    FT_Long use_kerning;
-    FT_UInt prev_index = 0;
-    int outline_delta = 0;
-    size_t textlen;
+    int i;
 
-    TTF_CHECKPOINTER(text, -1);
+    if ( ctx == NULL ) {
+        return;
+    }
+    /* Failures are left for the render itself to report */
+    for ( i = task->first; i < task->nchars; i += task->step ) {
+        Find_Glyph( ctx, task->chars[i], task->want, &glyph );
+    }
+}
 
-    /* Initialize everything to 0 */
-    status = 0;
-    minx = maxx = 0;
-    miny = maxy = 0;
+/* Fewer missing glyphs than this are quicker to render in place */
+#define PREFETCH_MIN_GLYPHS 4
 
-    /* check kerning */
-    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+/* Rasterize the glyphs of a string that are not cached yet in parallel,
+   so the render that follows only has cache hits.  This is done for
+   thread-safe fonts while render threads are running and the cache of
+   the font has room. */
+static void Prefetch_Glyphs( TTF_Font *font, const char *text, int want )
+{
+    size_t textlen = strlen( text );
+    Uint16 *chars = NULL;
+    Uint8 *seen = NULL;
+    int nchars = 0;
+    int ntasks;
+    int i;
+    TTF_Task *tasks;
+    TTF_PrefetchTask *prefetch;
+    TTF_TaskGroup group = { 0 };
 
-    /* Init outline handling */
-    if ( font->outline  > 0 ) {
-        outline_delta = font->outline * 2;
+    if ( !font->shared || __atomic_load_n( &TTF_pool.nworkers, __ATOMIC_RELAXED ) == 0 ||
+         __atomic_load_n( &font->cache_count, __ATOMIC_RELAXED ) >= CACHE_MAX_GLYPHS ) {
+        return;
     }
 
-    /* Load each character and sum it's bounding box */
-    textlen = strlen(text);
-    x= 0;
     while ( textlen > 0 ) {
-        Uint16 c = UTF8_getch(&text, &textlen);
-        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+        Uint16 c = UTF8_getch( &text, &textlen );
+        c_glyph *cached = Lookup_Glyph( font, c % CACHE_BUCKETS, c );
+
+        if ( cached && (__atomic_load_n( &cached->stored, __ATOMIC_ACQUIRE ) & want) == want ) {
             continue;
         }
-
-        error = Find_Glyph(font, c, CACHED_METRICS);
-        if ( error ) {
-            TTF_SetFTError("Couldn't find glyph", error);
-            return -1;
+        if ( seen == NULL ) {
+            seen = (Uint8 *)calloc( 0x10000 / 8, 1 );
+            chars = (Uint16 *)malloc( (textlen + 1) * sizeof( *chars ) );
+            if ( seen == NULL || chars == NULL ) {
+                break;
+            }
         }
-        glyph = font->current;
-
-        /* handle kerning */
-        if ( use_kerning && prev_index && glyph->index ) {
-            FT_Vector delta;
-            FT_Get_Kerning( font->face, prev_index, glyph->index, ft_kerning_default, &delta );
-            x += delta.x >> 6;
+        if ( !(seen[c / 8] & (1 << (c % 8))) ) {
+            seen[c / 8] |= (Uint8)(1 << (c % 8));
+            chars[nchars++] = c;
         }
+    }
+    free( seen );
 
-#if 0
-        if ( (ch == text) && (glyph->minx < 0) ) {
-        /* Fixes the texture wrapping bug when the first letter
-         * has a negative minx value or horibearing value.  The entire
-         * bounding box must be adjusted to be bigger so the entire
-         * letter can fit without any texture corruption or wrapping.
-         *
-         * Effects: First enlarges bounding box.
-         * Second, xstart has to start ahead of its normal spot in the
-         * negative direction of the negative minx value.
-         * (pushes everything to the right).
-         *
-         * This will make the memory copy of the glyph bitmap data
-         * work out correctly.
-         * */
-            z -= glyph->minx;
-        }
-#endif
+    ntasks = nchars / PREFETCH_MIN_GLYPHS;
+    if ( ntasks > TTF_pool.nworkers + 1 ) {
+        ntasks = TTF_pool.nworkers + 1;
+    }
+    if ( ntasks < 2 ) {
+        free( chars );
+        return;
+    }
 
-        z = x + glyph->minx;
-        if ( minx > z ) {
-            minx = z;
-        }
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            x += font->glyph_overhang;
-        }
-        if ( glyph->advance > glyph->maxx ) {
-            z = x + glyph->advance;
-        } else {
-            z = x + glyph->maxx;
-        }
-        if ( maxx < z ) {
-            maxx = z;
-        }
-        x += glyph->advance;
+    tasks = (TTF_Task *)malloc( ntasks * (sizeof( *tasks ) + sizeof( *prefetch )) );
+    if ( tasks == NULL ) {
+        free( chars );
+        return;
+    }
+    prefetch = (TTF_PrefetchTask *)(tasks + ntasks);
+    for ( i = 0; i < ntasks; ++i ) {
+        prefetch[i].font = font;
+        prefetch[i].chars = chars;
+        prefetch[i].nchars = nchars;
+        prefetch[i].first = i;
+        prefetch[i].step = ntasks;
+        prefetch[i].want = want;
+        tasks[i].run = TTF_RunPrefetch;
+        tasks[i].data = &prefetch[i];
+    }
 
-        if ( glyph->miny < miny ) {
-            miny = glyph->miny;
-        }
-        if ( glyph->maxy > maxy ) {
-            maxy = glyph->maxy;
-        }
-        prev_index = glyph->index;
+    /* The calling thread takes the first share itself */
+    TTF_SubmitTasks( tasks + 1, ntasks - 1, &group );
+    TTF_RunPrefetch( &prefetch[0] );
+    TTF_WaitTasks( &group );
+
+    free( tasks );
+    free( chars );
+}
+
+TTF_RenderJob *TTF_SubmitRender( TTF_Font *font, const char *text, const TTF_RenderParams *params )
+{
+    TTF_RenderJob *job;
+    TTF_RenderJob **link;
+    TTF_Worker *worker;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    if ( !font || !params ) {
+        TTF_SetError( "Passed a NULL pointer" );
+        return NULL;
+    }
+    if ( !font->shared ) {
+        TTF_SetError( "Font is not thread-safe, see TTF_SetThreadSafe()" );
+        return NULL;
     }
 
-    /* Fill the bounds rectangle */
-    if ( w ) {
-        /* Add outline extra width */
-        *w = (maxx - minx) + outline_delta;
+    job = (TTF_RenderJob *)calloc( 1, sizeof( *job ) );
+    if ( job ) {
+        job->text = strdup( text );
     }
-    if ( h ) {
-        /* Some fonts descend below font height (FletcherGothicFLF) */
-        /* Add outline extra height */
-        *h = (font->ascent - miny) + outline_delta;
-        if ( *h < font->height ) {
-            *h = font->height;
+    if ( !job || !job->text ) {
+        free( job );
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    job->font = font;
+    job->params = *params;
+    job->status = TTF_JOB_PENDING;
+    job->refcount = 2;      /* the caller's handle and the queue */
+
+    pthread_mutex_lock( &TTF_pool.lock );
+    if ( TTF_pool.nworkers == 0 ) {
+        /* Without render threads the job is done right away */
+        pthread_mutex_unlock( &TTF_pool.lock );
+        TTF_RunJob( job );
+        return job;
+    }
+
+    /* Queue it behind the jobs of the same or higher priority */
+    worker = &TTF_pool.workers[font->serial % TTF_pool.nworkers];
+    pthread_mutex_lock( &worker->lock );
+    for ( link = &worker->jobs; *link; link = &(*link)->next ) {
+        if ( (*link)->params.priority < params->priority ) {
+            break;
         }
-        /* Update height according to the needs of the underline style */
-        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
-            int bottom_row = TTF_underline_bottom_row(font);
-            if ( *h < bottom_row ) {
-                *h = bottom_row;
+    }
+    job->next = *link;
+    *link = job;
+    __atomic_add_fetch( &TTF_pool.queued, 1, __ATOMIC_RELAXED );
+    pthread_mutex_unlock( &worker->lock );
+
+    pthread_cond_broadcast( &TTF_pool.work );
+    pthread_mutex_unlock( &TTF_pool.lock );
+    return job;
+}
+
+int TTF_PollRender( TTF_RenderJob *job )
+{
+    return __atomic_load_n( &job->status, __ATOMIC_ACQUIRE );
+}
+
+int TTF_WaitRender( TTF_RenderJob *job )
+{
+    int status;
+
+    pthread_mutex_lock( &TTF_pool.lock );
+    while ( (status = job->status) < TTF_JOB_DONE ) {
+        /* Help out rather than sleep, this may be a pool thread itself */
+        if ( TTF_pool.head ) {
+            TTF_RunTask( TTF_pool.head );
+        } else if ( status == TTF_JOB_PENDING &&
+                    __atomic_load_n( &TTF_pool.queued, __ATOMIC_RELAXED ) > 0 ) {
+            TTF_RenderJob *next;
+
+            pthread_mutex_unlock( &TTF_pool.lock );
+            next = TTF_NextJob( -1 );
+            if ( next ) {
+                TTF_RunJob( next );
             }
+            pthread_mutex_lock( &TTF_pool.lock );
+        } else {
+            pthread_cond_wait( &TTF_pool.done, &TTF_pool.lock );
         }
     }
+    pthread_mutex_unlock( &TTF_pool.lock );
+
+    if ( status == TTF_JOB_FAILED ) {
+        TTF_SetError( "%s", job->error );
+    }
     return status;
 }
 
-int TTF_SizeUNICODE(TTF_Font *font, const Uint16 *text, int *w, int *h)
+Uint8 *TTF_TakeRenderSurface( TTF_RenderJob *job )
 {
-    int status = -1;
-    Uint8 *utf8;
+    return __atomic_exchange_n( &job->surface, NULL, __ATOMIC_ACQ_REL );
+}
 
-    TTF_CHECKPOINTER(text, -1);
+int TTF_CancelRender( TTF_RenderJob *job )
+{
+    int status = TTF_JOB_PENDING;
 
-    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
-    if ( utf8 ) {
-        UCS2_to_UTF8(text, utf8);
-        status = TTF_SizeUTF8(font, (char *)utf8, w, h);
-        free(utf8);
-    } else {
-        TTF_OutOfMemory();
+    if ( !__atomic_compare_exchange_n( &job->status, &status, TTF_JOB_CANCELLED, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+        return -1;
     }
-    return status;
+    /* The queue lets go of the job when a worker comes across it */
+    pthread_mutex_lock( &TTF_pool.lock );
+    pthread_cond_broadcast( &TTF_pool.done );
+    pthread_mutex_unlock( &TTF_pool.lock );
+    return 0;
 }
 
-Uint8 *TTF_RenderText_Solid(TTF_Font *font,
-                const char *text, Uint32 fg)
+void TTF_FreeRenderJob( TTF_RenderJob *job )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+    if ( job ) {
+        TTF_ReleaseJob( job );
+    }
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+/* Rendered surface cache.  Entries are found by their key and text, and
+   again by their surface when released; those in the cache but not held
+   form an LRU list that is trimmed to the byte budget.  An entry being
+   rendered is in the table already, so the same request from another
+   thread waits for it rather than rendering it twice.
+*/
+#define SURFACE_RENDERING   0
+#define SURFACE_READY       1
+#define SURFACE_FAILED      2
 
-    utf8 = (Uint8*)malloc(strlen(text)*2+1);
-    if ( utf8 ) {
-        LATIN1_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Solid(font, (char *)utf8, fg);
-        free(utf8);
-    } else {
-        TTF_OutOfMemory();
+typedef struct {
+    const TTF_Font *font;
+    Uint32 serial;
+    int style;
+    int outline;
+    int hinting;
+    int kerning;
+    int mode;
+    int format;
+    Uint32 fg;
+    Uint32 bg;
+    Uint32 wrapLength;
+} TTF_SurfaceKey;
+
+typedef struct _TTF_CachedSurface {
+    TTF_SurfaceKey key;
+    Uint32 hash;
+    char *text;
+    Uint8 *surface;
+    size_t bytes;
+    int refcount;
+    int state;
+    struct _TTF_CachedSurface *next;        /* by key */
+    struct _TTF_CachedSurface *next_surface; /* by surface */
+    struct _TTF_CachedSurface *prev_lru;    /* unheld, most recent first */
+    struct _TTF_CachedSurface *next_lru;
+} TTF_CachedSurface;
+
+struct _TTF_SurfaceCache {
+    pthread_mutex_t lock;
+    pthread_cond_t rendered;
+    size_t budget;
+    size_t bytes;
+    TTF_CachedSurface **table;
+    TTF_CachedSurface **surfaces;
+    int numbuckets;
+    int count;
+    TTF_CachedSurface *head;
+    TTF_CachedSurface *tail;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static Uint32 TTF_HashSurface( const TTF_SurfaceKey *key, const char *text )
+{
+    const Uint8 *p = (const Uint8 *)key;
+    Uint32 hash = 2166136261U;
+    size_t i;
+
+    for ( i = 0; i < sizeof(*key); ++i ) {
+        hash = (hash ^ p[i]) * 16777619U;
     }
-    return surface;
+    for ( p = (const Uint8 *)text; *p; ++p ) {
+        hash = (hash ^ *p) * 16777619U;
+    }
+    return hash;
 }
 
-Uint8 *TTF_RenderUTF8_Solid(TTF_Font *font,
-                const char *text, Uint32 fg)
+static __inline__ int TTF_SurfaceBucket( const TTF_SurfaceCache *cache, const Uint8 *surface )
 {
-    int first;
-    int xstart;
-    int width;
-    int height;
-    Uint8* textbuf;
-    //SDL_Palette* palette;
-    Uint8* src;
-    Uint8* dst;
-    Uint8 *dst_check;
-    int row, col;
-    c_glyph *glyph;
-
-    FT_Bitmap *current;
-    FT_Error error;
-    FT_Long use_kerning;
-    FT_UInt prev_index = 0;
-    size_t textlen;
+    return (int)(((uintptr_t)surface >> 4) % (uintptr_t)cache->numbuckets);
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+/* Double both tables once they hold more entries than buckets */
+static void TTF_GrowSurfaceCache( TTF_SurfaceCache *cache )
+{
+    int numbuckets = cache->numbuckets * 2;
+    TTF_CachedSurface **table;
+    TTF_CachedSurface **surfaces;
+    int i;
 
-    /* Get the dimensions of the text surface */
-    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
-        TTF_SetError( "Text has zero width" );
-        return NULL;
+    table = (TTF_CachedSurface **)calloc( numbuckets, sizeof(*table) );
+    surfaces = (TTF_CachedSurface **)calloc( numbuckets, sizeof(*surfaces) );
+    if ( table == NULL || surfaces == NULL ) {
+        /* Longer chains will do */
+        free( table );
+        free( surfaces );
+        return;
     }
+    for ( i = 0; i < cache->numbuckets; ++i ) {
+        while ( cache->table[i] ) {
+            TTF_CachedSurface *entry = cache->table[i];
 
-    /* Create the target surface */
-    textbuf = TTF_CreateRGBSurface(width, height, 8, 0, 0, 0, 0);
-    if ( textbuf == NULL ) {
-        return NULL;
+            cache->table[i] = entry->next;
+            entry->next = table[entry->hash % numbuckets];
+            table[entry->hash % numbuckets] = entry;
+        }
     }
+    free( cache->table );
+    free( cache->surfaces );
+    cache->table = table;
+    cache->surfaces = surfaces;
+    cache->numbuckets = numbuckets;
 
-    /* Adding bound checking to avoid all kinds of memory corruption errors
-       that may occur. */
-    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+    for ( i = 0; i < numbuckets; ++i ) {
+        TTF_CachedSurface *entry;
 
-    printf("here was palette! %s\n", __func__);
-    /* Fill the palette with the foreground color */
-    //palette = textbuf->format->palette;
-    //palette->colors[0].r = 255 - cl_r(fg);
-    //palette->colors[0].g = 255 - cl_g(fg);
-    //palette->colors[0].b = 255 - cl_b(fg);
-    //palette->colors[1].r = cl_r(fg);
-    //palette->colors[1].g = cl_g(fg);
-    //palette->colors[1].b = cl_b(fg);
-    //SDL_SetColorKey( textbuf, SDL_TRUE, 0 );
+        for ( entry = table[i]; entry; entry = entry->next ) {
+            if ( entry->surface ) {
+                int bucket = TTF_SurfaceBucket( cache, entry->surface );
+
+                entry->next_surface = surfaces[bucket];
+                surfaces[bucket] = entry;
+            }
+        }
+    }
+}
+
+static void TTF_UnlinkLRU( TTF_SurfaceCache *cache, TTF_CachedSurface *entry )
+{
+    if ( entry->prev_lru ) {
+        entry->prev_lru->next_lru = entry->next_lru;
+    } else {
+        cache->head = entry->next_lru;
+    }
+    if ( entry->next_lru ) {
+        entry->next_lru->prev_lru = entry->prev_lru;
+    } else {
+        cache->tail = entry->prev_lru;
+    }
+    entry->prev_lru = entry->next_lru = NULL;
+}
+
+/* Take an entry out of the tables and free it.  It must not be held. */
+static void TTF_RemoveSurface( TTF_SurfaceCache *cache, TTF_CachedSurface *entry )
+{
+    TTF_CachedSurface **link;
+
+    for ( link = &cache->table[entry->hash % cache->numbuckets]; *link; link = &(*link)->next ) {
+        if ( *link == entry ) {
+            *link = entry->next;
+            break;
+        }
+    }
+    if ( entry->surface ) {
+        for ( link = &cache->surfaces[TTF_SurfaceBucket( cache, entry->surface )]; *link; link = &(*link)->next_surface ) {
+            if ( *link == entry ) {
+                *link = entry->next_surface;
+                break;
+            }
+        }
+    }
+    cache->bytes -= entry->bytes;
+    --cache->count;
+    free( entry->surface );
+    free( entry->text );
+    free( entry );
+}
+
+/* Drop the least recently used surfaces nobody holds while over budget */
+static void TTF_TrimSurfaceCache( TTF_SurfaceCache *cache )
+{
+    while ( cache->bytes > cache->budget && cache->tail ) {
+        TTF_CachedSurface *entry = cache->tail;
+
+        TTF_UnlinkLRU( cache, entry );
+        TTF_RemoveSurface( cache, entry );
+    }
+}
+
+TTF_SurfaceCache *TTF_CreateSurfaceCache( size_t budget )
+{
+    TTF_SurfaceCache *cache;
+
+    cache = (TTF_SurfaceCache *)calloc( 1, sizeof(*cache) );
+    if ( cache == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    cache->numbuckets = 256;
+    cache->table = (TTF_CachedSurface **)calloc( cache->numbuckets, sizeof(*cache->table) );
+    cache->surfaces = (TTF_CachedSurface **)calloc( cache->numbuckets, sizeof(*cache->surfaces) );
+    if ( cache->table == NULL || cache->surfaces == NULL ) {
+        TTF_OutOfMemory();
+        free( cache->table );
+        free( cache->surfaces );
+        free( cache );
+        return NULL;
+    }
+    pthread_mutex_init( &cache->lock, NULL );
+    pthread_cond_init( &cache->rendered, NULL );
+    cache->budget = budget;
+    return cache;
+}
+
+const Uint8 *TTF_CacheRender( TTF_SurfaceCache *cache, TTF_Font *font,
+                const char *text, const TTF_RenderParams *params )
+{
+    TTF_SurfaceKey key;
+    TTF_CachedSurface *entry;
+    Uint8 *surface;
+    Uint32 hash;
+
+    TTF_CHECKPOINTER(cache, NULL);
+    TTF_CHECKPOINTER(font, NULL);
+    TTF_CHECKPOINTER(text, NULL);
+    TTF_CHECKPOINTER(params, NULL);
+
+    /* Zeroed first, so padding doesn't spoil hashing and comparing */
+    memset( &key, 0, sizeof(key) );
+    key.font = font;
+    key.serial = font->serial;
+    key.style = font->style;
+    key.outline = font->outline;
+    key.hinting = font->hinting;
+    key.kerning = font->kerning;
+    key.mode = params->mode;
+    key.format = params->format;
+    key.fg = params->fg;
+    key.bg = (params->mode == TTF_RENDER_SHADED) ? params->bg : 0;
+    key.wrapLength = (params->mode == TTF_RENDER_BLENDED_WRAPPED) ? params->wrapLength : 0;
+    hash = TTF_HashSurface( &key, text );
+
+    pthread_mutex_lock( &cache->lock );
+    for ( entry = cache->table[hash % cache->numbuckets]; entry; entry = entry->next ) {
+        if ( entry->hash == hash && memcmp( &entry->key, &key, sizeof(key) ) == 0 &&
+             strcmp( entry->text, text ) == 0 ) {
+            break;
+        }
+    }
+    if ( entry ) {
+        if ( entry->refcount++ == 0 ) {
+            TTF_UnlinkLRU( cache, entry );
+        }
+        ++cache->hits;
+        while ( entry->state == SURFACE_RENDERING ) {
+            pthread_cond_wait( &cache->rendered, &cache->lock );
+        }
+        surface = entry->surface;
+        if ( entry->state == SURFACE_FAILED && --entry->refcount == 0 ) {
+            TTF_RemoveSurface( cache, entry );
+        }
+        pthread_mutex_unlock( &cache->lock );
+        if ( surface == NULL ) {
+            TTF_SetError( "Couldn't render text" );
+        }
+        return surface;
+    }
+
+    entry = (TTF_CachedSurface *)calloc( 1, sizeof(*entry) );
+    if ( entry == NULL || (entry->text = TTF_strdup( text )) == NULL ) {
+        pthread_mutex_unlock( &cache->lock );
+        free( entry );
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    entry->key = key;
+    entry->hash = hash;
+    entry->refcount = 1;
+    entry->state = SURFACE_RENDERING;
+    entry->next = cache->table[hash % cache->numbuckets];
+    cache->table[hash % cache->numbuckets] = entry;
+    ++cache->count;
+    ++cache->misses;
+    pthread_mutex_unlock( &cache->lock );
+
+    surface = Render_Text( font, text, params );
+
+    pthread_mutex_lock( &cache->lock );
+    if ( surface ) {
+        int bucket = TTF_SurfaceBucket( cache, surface );
+
+        entry->surface = surface;
+        entry->bytes = 8 + (size_t)fn_p(surface) * fn_h(surface);
+        entry->state = SURFACE_READY;
+        entry->next_surface = cache->surfaces[bucket];
+        cache->surfaces[bucket] = entry;
+        cache->bytes += entry->bytes;
+        if ( cache->count > cache->numbuckets ) {
+            TTF_GrowSurfaceCache( cache );
+        }
+        TTF_TrimSurfaceCache( cache );
+    } else {
+        entry->state = SURFACE_FAILED;
+        if ( --entry->refcount == 0 ) {
+            TTF_RemoveSurface( cache, entry );
+        }
+    }
+    pthread_cond_broadcast( &cache->rendered );
+    pthread_mutex_unlock( &cache->lock );
+    return surface;
+}
+
+void TTF_ReleaseCachedSurface( TTF_SurfaceCache *cache, const Uint8 *surface )
+{
+    TTF_CachedSurface *entry;
+
+    if ( cache == NULL || surface == NULL ) {
+        return;
+    }
+    pthread_mutex_lock( &cache->lock );
+    for ( entry = cache->surfaces[TTF_SurfaceBucket( cache, surface )]; entry; entry = entry->next_surface ) {
+        if ( entry->surface == surface ) {
+            break;
+        }
+    }
+    if ( entry && entry->refcount > 0 && --entry->refcount == 0 ) {
+        entry->next_lru = cache->head;
+        if ( cache->head ) {
+            cache->head->prev_lru = entry;
+        } else {
+            cache->tail = entry;
+        }
+        cache->head = entry;
+        TTF_TrimSurfaceCache( cache );
+    }
+    pthread_mutex_unlock( &cache->lock );
+}
+
+void TTF_FlushSurfaceCache( TTF_SurfaceCache *cache )
+{
+    size_t budget;
+
+    if ( cache == NULL ) {
+        return;
+    }
+    pthread_mutex_lock( &cache->lock );
+    budget = cache->budget;
+    cache->budget = 0;
+    TTF_TrimSurfaceCache( cache );
+    cache->budget = budget;
+    pthread_mutex_unlock( &cache->lock );
+}
+
+void TTF_GetSurfaceCacheStats( TTF_SurfaceCache *cache, size_t *bytes, unsigned long *hits, unsigned long *misses )
+{
+    if ( cache == NULL ) {
+        return;
+    }
+    pthread_mutex_lock( &cache->lock );
+    if ( bytes ) {
+        *bytes = cache->bytes;
+    }
+    if ( hits ) {
+        *hits = cache->hits;
+    }
+    if ( misses ) {
+        *misses = cache->misses;
+    }
+    pthread_mutex_unlock( &cache->lock );
+}
+
+void TTF_FreeSurfaceCache( TTF_SurfaceCache *cache )
+{
+    int i;
+
+    if ( cache ) {
+        for ( i = 0; i < cache->numbuckets; ++i ) {
+            while ( cache->table[i] ) {
+                TTF_RemoveSurface( cache, cache->table[i] );
+            }
+        }
+        free( cache->table );
+        free( cache->surfaces );
+        pthread_cond_destroy( &cache->rendered );
+        pthread_mutex_destroy( &cache->lock );
+        free( cache );
+    }
+}
+
+int TTF_FontHeight(const TTF_Font *font)
+{
+    return(font->height);
+}
+
+int TTF_FontAscent(const TTF_Font *font)
+{
+    return(font->ascent);
+}
+
+int TTF_FontDescent(const TTF_Font *font)
+{
+    return(font->descent);
+}
+
+int TTF_FontLineSkip(const TTF_Font *font)
+{
+    return(font->lineskip);
+}
+
+int TTF_GetFontKerning(const TTF_Font *font)
+{
+    return(font->kerning);
+}
+
+void TTF_SetFontKerning(TTF_Font *font, int allowed)
+{
+    font->kerning = allowed;
+    TTF_CloseVariants( font );
+}
+
+long TTF_FontFaces(const TTF_Font *font)
+{
+    return(font->face->num_faces);
+}
+
+int TTF_FontFaceIsFixedWidth(const TTF_Font *font)
+{
+    return(FT_IS_FIXED_WIDTH(font->face));
+}
+
+char *TTF_FontFaceFamilyName(const TTF_Font *font)
+{
+    return(font->face->family_name);
+}
+
+char *TTF_FontFaceStyleName(const TTF_Font *font)
+{
+    return(font->face->style_name);
+}
+
+int TTF_GlyphIsProvided(const TTF_Font *font, Uint16 ch)
+{
+  TTF_Context *ctx = TTF_GetContext(font);
+
+  if ( ctx == NULL ) {
+      return 0;
+  }
+  return(FT_Get_Char_Index(ctx->face, ch));
+}
+
+int TTF_GlyphMetrics(TTF_Font *font, Uint16 ch,
+                     int* minx, int* maxx, int* miny, int* maxy, int* advance)
+{
+    TTF_Context *ctx;
+    c_glyph *glyph;
+    FT_Error error;
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return -1;
+    }
+    error = Find_Glyph(ctx, ch, CACHED_METRICS, &glyph);
+    if ( error ) {
+        TTF_SetFTError("Couldn't find glyph", error);
+        return -1;
+    }
+
+    if ( minx ) {
+        *minx = glyph->minx;
+    }
+    if ( maxx ) {
+        *maxx = glyph->maxx;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            *maxx += font->glyph_overhang;
+        }
+    }
+    if ( miny ) {
+        *miny = glyph->miny;
+    }
+    if ( maxy ) {
+        *maxy = glyph->maxy;
+    }
+    if ( advance ) {
+        *advance = glyph->advance;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            *advance += font->glyph_overhang;
+        }
+    }
+    return 0;
+}
+
+int TTF_SizeText(TTF_Font *font, const char *text, int *w, int *h)
+{
+    int status = -1;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, -1);
+
+    utf8 = (Uint8*)malloc(strlen(text)*2+1);
+    if ( utf8 ) {
+        LATIN1_to_UTF8(text, utf8);
+        status = TTF_SizeUTF8(font, (char *)utf8, w, h);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return status;
+}
+
+int TTF_SizeUTF8(TTF_Font *font, const char *text, int *w, int *h)
+{
+    int status;
+    int x, z;
+    int minx, maxx;
+    int miny, maxy;
+    TTF_Context *ctx;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_Long use_kerning;
+    FT_UInt prev_index = 0;
+    int outline_delta = 0;
+    size_t textlen;
+
+    TTF_CHECKPOINTER(text, -1);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return -1;
+    }
+
+    /* Initialize everything to 0 */
+    status = 0;
+    minx = maxx = 0;
+    miny = maxy = 0;
 
     /* check kerning */
     use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
 
-    /* Load and render each character */
+    /* Init outline handling */
+    if ( font->outline  > 0 ) {
+        outline_delta = font->outline * 2;
+    }
+
+    /* Load each character and sum it's bounding box */
     textlen = strlen(text);
-    first = 1;
-    xstart = 0;
+    x= 0;
     while ( textlen > 0 ) {
         Uint16 c = UTF8_getch(&text, &textlen);
         if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
             continue;
         }
 
-        error = Find_Glyph(font, c, CACHED_METRICS|CACHED_BITMAP);
+        error = Find_Glyph(ctx, c, CACHED_METRICS, &glyph);
         if ( error ) {
             TTF_SetFTError("Couldn't find glyph", error);
-            free( textbuf );
-            return NULL;
-        }
-        glyph = font->current;
-        current = &glyph->bitmap;
-        /* Ensure the width of the pixmap is correct. On some cases,
-         * freetype may report a larger pixmap than possible.*/
-        width = current->width;
-        if (font->outline <= 0 && width > glyph->maxx - glyph->minx) {
-            width = glyph->maxx - glyph->minx;
+            return -1;
         }
-        /* do kerning, if possible AC-Patch */
+
+        /* handle kerning */
         if ( use_kerning && prev_index && glyph->index ) {
             FT_Vector delta;
-            FT_Get_Kerning( font->face, prev_index, glyph->index, ft_kerning_default, &delta );
-            xstart += delta.x >> 6;
-        }
-        /* Compensate for wrap around bug with negative minx's */
-        if ( first && (glyph->minx < 0) ) {
-            xstart -= glyph->minx;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            x += delta.x >> 6;
         }
-        first = 0;
 
-        for ( row = 0; row < current->rows; ++row ) {
-            /* Make sure we don't go either over, or under the
-             * limit */
-            if ( row+glyph->yoffset < 0 ) {
-                continue;
-            }
-            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
-                continue;
+#if 0
+        if ( (ch == text) && (glyph->minx < 0) ) {
+        /* Fixes the texture wrapping bug when the first letter
+         * has a negative minx value or horibearing value.  The entire
+         * bounding box must be adjusted to be bigger so the entire
+         * letter can fit without any texture corruption or wrapping.
+         *
+         * Effects: First enlarges bounding box.
+         * Second, xstart has to start ahead of its normal spot in the
+         * negative direction of the negative minx value.
+         * (pushes everything to the right).
+         *
+         * This will make the memory copy of the glyph bitmap data
+         * work out correctly.
+         * */
+            z -= glyph->minx;
+        }
+#endif
+
+        z = x + glyph->minx;
+        if ( minx > z ) {
+            minx = z;
+        }
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            x += font->glyph_overhang;
+        }
+        if ( glyph->advance > glyph->maxx ) {
+            z = x + glyph->advance;
+        } else {
+            z = x + glyph->maxx;
+        }
+        if ( maxx < z ) {
+            maxx = z;
+        }
+        x += glyph->advance;
+
+        if ( glyph->miny < miny ) {
+            miny = glyph->miny;
+        }
+        if ( glyph->maxy > maxy ) {
+            maxy = glyph->maxy;
+        }
+        prev_index = glyph->index;
+    }
+
+    /* Fill the bounds rectangle */
+    if ( w ) {
+        /* Add outline extra width */
+        *w = (maxx - minx) + outline_delta;
+    }
+    if ( h ) {
+        /* Some fonts descend below font height (FletcherGothicFLF) */
+        /* Add outline extra height */
+        *h = (font->ascent - miny) + outline_delta;
+        if ( *h < font->height ) {
+            *h = font->height;
+        }
+        /* Update height according to the needs of the underline style */
+        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+            int bottom_row = TTF_underline_bottom_row(font);
+            if ( *h < bottom_row ) {
+                *h = bottom_row;
+            }
+        }
+    }
+    return status;
+}
+
+int TTF_SizeUNICODE(TTF_Font *font, const Uint16 *text, int *w, int *h)
+{
+    int status = -1;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, -1);
+
+    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
+    if ( utf8 ) {
+        UCS2_to_UTF8(text, utf8);
+        status = TTF_SizeUTF8(font, (char *)utf8, w, h);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return status;
+}
+
+/* Lay out text the way TTF_RenderUTF8_Blended() does, keeping where each
+   glyph goes instead of drawing it.  Bounds come from the glyph metrics,
+   so no glyph is rasterized.
+*/
+int TTF_ShapeUTF8(TTF_Font *font, const char *text, size_t len, TTF_GlyphRun *run)
+{
+    int x, z;
+    int i;
+    int minx, maxx;
+    int miny;
+    int shift;
+    TTF_Context *ctx;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_Long use_kerning;
+    FT_UInt prev_index = 0;
+    int outline_delta = 0;
+    size_t textlen;
+
+    TTF_CHECKPOINTER(text, -1);
+    TTF_CHECKPOINTER(run, -1);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return -1;
+    }
+
+    minx = maxx = 0;
+    miny = 0;
+    run->numglyphs = 0;
+
+    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+
+    if ( font->outline  > 0 ) {
+        outline_delta = font->outline * 2;
+    }
+
+    /* The text ends at len bytes or at a NUL, whichever comes first */
+    for ( textlen = 0; textlen < len && text[textlen]; ++textlen ) {
+        continue;
+    }
+    x = 0;
+    while ( textlen > 0 ) {
+        TTF_ShapedGlyph *shaped;
+        Uint16 c = UTF8_getch(&text, &textlen);
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        error = Find_Glyph(ctx, c, CACHED_METRICS, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            return -1;
+        }
+        if ( run->numglyphs == run->maxglyphs ) {
+            int maxglyphs = run->maxglyphs ? run->maxglyphs * 2 : 64;
+            TTF_ShapedGlyph *glyphs;
+
+            glyphs = (TTF_ShapedGlyph *)realloc(run->glyphs, maxglyphs * sizeof(*glyphs));
+            if ( glyphs == NULL ) {
+                TTF_OutOfMemory();
+                return -1;
+            }
+            run->glyphs = glyphs;
+            run->maxglyphs = maxglyphs;
+        }
+
+        /* handle kerning */
+        if ( use_kerning && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            x += delta.x >> 6;
+        }
+
+        shaped = &run->glyphs[run->numglyphs++];
+        shaped->index = glyph->index;
+        shaped->ch = c;
+        shaped->x = x;
+        shaped->y = font->ascent;
+        shaped->bounds.x = x + glyph->minx;
+        shaped->bounds.y = glyph->yoffset;
+        shaped->bounds.w = (glyph->maxx - glyph->minx) + outline_delta;
+        shaped->bounds.h = (glyph->maxy - glyph->miny) + outline_delta;
+
+        /* Sum the bounding box as TTF_SizeUTF8() does */
+        z = x + glyph->minx;
+        if ( minx > z ) {
+            minx = z;
+        }
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            x += font->glyph_overhang;
+        }
+        if ( glyph->advance > glyph->maxx ) {
+            z = x + glyph->advance;
+        } else {
+            z = x + glyph->maxx;
+        }
+        if ( maxx < z ) {
+            maxx = z;
+        }
+        x += glyph->advance;
+
+        if ( glyph->miny < miny ) {
+            miny = glyph->miny;
+        }
+        prev_index = glyph->index;
+    }
+
+    /* Move everything right for a first glyph with a negative minx */
+    shift = 0;
+    if ( run->numglyphs > 0 && run->glyphs[0].bounds.x < 0 ) {
+        shift = -run->glyphs[0].bounds.x;
+    }
+    for ( i = 0; i < run->numglyphs; ++i ) {
+        run->glyphs[i].x += shift;
+        run->glyphs[i].bounds.x += shift;
+    }
+
+    run->w = (maxx - minx) + outline_delta;
+    run->h = (font->ascent - miny) + outline_delta;
+    if ( run->h < font->height ) {
+        run->h = font->height;
+    }
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        int bottom_row = TTF_underline_bottom_row(font);
+        if ( run->h < bottom_row ) {
+            run->h = bottom_row;
+        }
+    }
+    return 0;
+}
+
+void TTF_FreeGlyphRun(TTF_GlyphRun *run)
+{
+    if ( run ) {
+        free( run->glyphs );
+        run->glyphs = NULL;
+        run->numglyphs = 0;
+        run->maxglyphs = 0;
+    }
+}
+
+Uint8 *TTF_RenderText_Solid(TTF_Font *font,
+                const char *text, Uint32 fg)
+{
+    return TTF_RenderText_Solid_Format(font, text, fg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderText_Solid_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(strlen(text)*2+1);
+    if ( utf8 ) {
+        LATIN1_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Solid_Format(font, (char *)utf8, fg, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+Uint8 *TTF_RenderUTF8_Solid(TTF_Font *font,
+                const char *text, Uint32 fg)
+{
+    return TTF_RenderUTF8_Solid_Format(font, text, fg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderUTF8_Solid_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format)
+{
+    int first;
+    int xstart;
+    int width;
+    int height;
+    Uint8* textbuf;
+    //SDL_Palette* palette;
+    Uint8* src;
+    Uint8* dst;
+    Uint8 *dst_check;
+    int row, col;
+    int depth;
+    int want;
+    TTF_Context *ctx;
+    c_glyph *glyph;
+
+    FT_Bitmap *current;
+    FT_Error error;
+    FT_Long use_kerning;
+    FT_UInt prev_index = 0;
+    size_t textlen;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+
+    if ( format == TTF_PIXELFORMAT_INDEX1MSB ) {
+        depth = 1;
+        want = CACHED_METRICS|CACHED_PACKED;
+    } else if ( format == TTF_PIXELFORMAT_INDEX8 ) {
+        depth = 8;
+        want = CACHED_METRICS|CACHED_BITMAP;
+    } else {
+        TTF_SetError( "Solid text needs an indexed pixel format" );
+        return NULL;
+    }
+
+    Prefetch_Glyphs(font, text, want);
+
+    /* Get the dimensions of the text surface */
+    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
+        TTF_SetError( "Text has zero width" );
+        return NULL;
+    }
+
+    /* Create the target surface */
+    textbuf = TTF_CreateRGBSurface(width, height, depth, 0, 0, 0, 0);
+    if ( textbuf == NULL ) {
+        return NULL;
+    }
+
+    /* Adding bound checking to avoid all kinds of memory corruption errors
+       that may occur. */
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+
+    /* Fill the palette with the foreground color */
+    //palette = textbuf->format->palette;
+    //palette->colors[0].r = 255 - cl_r(fg);
+    //palette->colors[0].g = 255 - cl_g(fg);
+    //palette->colors[0].b = 255 - cl_b(fg);
+    //palette->colors[1].r = cl_r(fg);
+    //palette->colors[1].g = cl_g(fg);
+    //palette->colors[1].b = cl_b(fg);
+    //SDL_SetColorKey( textbuf, SDL_TRUE, 0 );
+
+    /* check kerning */
+    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+
+    /* Load and render each character */
+    textlen = strlen(text);
+    first = 1;
+    xstart = 0;
+    while ( textlen > 0 ) {
+        Uint16 c = UTF8_getch(&text, &textlen);
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        error = Find_Glyph(ctx, c, want, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            free( textbuf );
+            return NULL;
+        }
+        current = (depth == 1) ? &glyph->packed : &glyph->bitmap;
+        /* Ensure the width of the pixmap is correct. On some cases,
+         * freetype may report a larger pixmap than possible.*/
+        width = current->width;
+        if (font->outline <= 0 && width > glyph->maxx - glyph->minx) {
+            width = glyph->maxx - glyph->minx;
+        }
+        /* do kerning, if possible AC-Patch */
+        if ( use_kerning && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            xstart += delta.x >> 6;
+        }
+        /* Compensate for wrap around bug with negative minx's */
+        if ( first && (glyph->minx < 0) ) {
+            xstart -= glyph->minx;
+        }
+        first = 0;
+
+        for ( row = 0; row < current->rows; ++row ) {
+            /* Make sure we don't go either over, or under the
+             * limit */
+            if ( row+glyph->yoffset < 0 ) {
+                continue;
+            }
+            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
+                continue;
+            }
+            dst = (Uint8*) (textbuf + 8) +
+                (row+glyph->yoffset) * fn_p(textbuf);
+            src = current->buffer + row * current->pitch;
+
+            if ( depth == 1 ) {
+                TTF_orBits(dst, dst_check, xstart + glyph->minx, src, width);
+                continue;
+            }
+            dst += xstart + glyph->minx;
+            for ( col=width; col>0 && dst < dst_check; --col ) {
+                *dst++ |= *src++;
+            }
+        }
+
+        xstart += glyph->advance;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            xstart += font->glyph_overhang;
+        }
+        prev_index = glyph->index;
+    }
+
+    /* Handle the underline style */
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        row = TTF_underline_top_row(font);
+        TTF_drawLine_Solid(font, textbuf, row);
+    }
+
+    /* Handle the strikethrough style */
+    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+        row = TTF_strikethrough_top_row(font);
+        TTF_drawLine_Solid(font, textbuf, row);
+    }
+    return textbuf;
+}
+
+Uint8 *TTF_RenderUNICODE_Solid(TTF_Font *font,
+                const Uint16 *text, Uint32 fg)
+{
+    return TTF_RenderUNICODE_Solid_Format(font, text, fg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderUNICODE_Solid_Format(TTF_Font *font,
+                const Uint16 *text, Uint32 fg, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
+    if ( utf8 ) {
+        UCS2_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Solid_Format(font, (char *)utf8, fg, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+Uint8 *TTF_RenderGlyph_Solid(TTF_Font *font, Uint16 ch, Uint32 fg)
+{
+    return TTF_RenderGlyph_Solid_Format(font, ch, fg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderGlyph_Solid_Format(TTF_Font *font, Uint16 ch, Uint32 fg, int format)
+{
+    Uint16 ucs2[2] = { ch, 0 };
+    Uint8 utf8[4];
+
+    UCS2_to_UTF8(ucs2, utf8);
+    return TTF_RenderUTF8_Solid_Format(font, (char *)utf8, fg, format);
+}
+
+Uint8 *TTF_RenderText_Shaded(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 bg)
+{
+    return TTF_RenderText_Shaded_Format(font, text, fg, bg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderText_Shaded_Format(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 bg, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(strlen(text)*2+1);
+    if ( utf8 ) {
+        LATIN1_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Shaded_Format(font, (char *)utf8, fg, bg, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+/* Convert the UTF-8 text to UNICODE and render it
+*/
+Uint8 *TTF_RenderUTF8_Shaded(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 bg)
+{
+    return TTF_RenderUTF8_Shaded_Format(font, text, fg, bg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderUTF8_Shaded_Format(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 bg, int format)
+{
+    int first;
+    int xstart;
+    int width;
+    int height;
+    Uint8* textbuf;
+    const TTF_PixelLUT *lut;
+    Uint8* src;
+    Uint8* dst;
+    Uint8* dst_check;
+    int row;
+    FT_Bitmap* current;
+    TTF_Context *ctx;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_Long use_kerning;
+    FT_UInt prev_index = 0;
+    size_t textlen;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+
+    Prefetch_Glyphs(font, text, CACHED_METRICS|CACHED_PIXMAP);
+
+    lut = Find_ShadedLUT(ctx, fg, bg, format);
+    if ( lut == NULL ) {
+        return NULL;
+    }
+
+    /* Get the dimensions of the text surface */
+    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
+        TTF_SetError("Text has zero width");
+        return NULL;
+    }
+
+    /* Create the target surface */
+    if ( format == TTF_PIXELFORMAT_INDEX8 ) {
+        textbuf = TTF_CreatePaletteSurface(width, height, NUM_GRAYS);
+    } else {
+        textbuf = TTF_CreateRGBSurface(width, height, lut->depth, 0, 0, 0, 0);
+    }
+    if ( textbuf == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+
+    /* Adding bound checking to avoid all kinds of memory corruption errors
+       that may occur. */
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+
+    /* Attach the NUM_GRAYS levels of shading from bg to fg, or start
+       direct color output from the background level */
+    if ( format == TTF_PIXELFORMAT_INDEX8 ) {
+        memcpy(fn_palette(textbuf), lut->palette, NUM_GRAYS * sizeof(Uint32));
+    } else if ( lut->depth != 8 ) {
+        TTF_FillRect(textbuf, lut->pixel[0]);
+    }
+
+    /* check kerning */
+    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+
+    /* Load and render each character */
+    textlen = strlen(text);
+    first = 0;
+    xstart = 0;
+    while ( textlen > 0 ) {
+        Uint16 c = UTF8_getch(&text, &textlen);
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        error = Find_Glyph(ctx, c, CACHED_METRICS|CACHED_PIXMAP, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            free( textbuf );
+            return NULL;
+        }
+        /* Ensure the width of the pixmap is correct. On some cases,
+         * freetype may report a larger pixmap than possible.*/
+        width = glyph->pixmap.width;
+        if (font->outline <= 0 && width > glyph->maxx - glyph->minx) {
+            width = glyph->maxx - glyph->minx;
+        }
+        /* do kerning, if possible AC-Patch */
+        if ( use_kerning && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            xstart += delta.x >> 6;
+        }
+        /* Compensate for the wrap around with negative minx's */
+        if ( first && (glyph->minx < 0) ) {
+            xstart -= glyph->minx;
+        }
+        first = 0;
+
+        current = &glyph->pixmap;
+        for ( row = 0; row < current->rows; ++row ) {
+            /* Make sure we don't go either over, or under the
+             * limit */
+            if ( row+glyph->yoffset < 0 ) {
+                continue;
+            }
+            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
+                continue;
+            }
+            dst = (Uint8*) (textbuf + 8) +
+                (row+glyph->yoffset) * fn_p(textbuf) +
+                (xstart + glyph->minx) * (lut->depth / 8);
+            src = current->buffer + row * current->pitch;
+            TTF_blendRow(lut, dst, dst_check, src, width);
+        }
+
+        xstart += glyph->advance;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            xstart += font->glyph_overhang;
+        }
+        prev_index = glyph->index;
+    }
+
+    /* Handle the underline style */
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        row = TTF_underline_top_row(font);
+        TTF_drawLine_LUT(font, textbuf, row, lut);
+    }
+
+    /* Handle the strikethrough style */
+    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+        row = TTF_strikethrough_top_row(font);
+        TTF_drawLine_LUT(font, textbuf, row, lut);
+    }
+    return textbuf;
+}
+
+Uint8* TTF_RenderUNICODE_Shaded( TTF_Font* font,
+                       const Uint16* text,
+                       Uint32 fg,
+                       Uint32 bg )
+{
+    return TTF_RenderUNICODE_Shaded_Format(font, text, fg, bg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8* TTF_RenderUNICODE_Shaded_Format( TTF_Font* font,
+                       const Uint16* text,
+                       Uint32 fg,
+                       Uint32 bg,
+                       int format )
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
+    if ( utf8 ) {
+        UCS2_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Shaded_Format(font, (char *)utf8, fg, bg, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+Uint8* TTF_RenderGlyph_Shaded( TTF_Font* font,
+                     Uint16 ch,
+                     Uint32 fg,
+                     Uint32 bg )
+{
+    return TTF_RenderGlyph_Shaded_Format(font, ch, fg, bg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8* TTF_RenderGlyph_Shaded_Format( TTF_Font* font,
+                     Uint16 ch,
+                     Uint32 fg,
+                     Uint32 bg,
+                     int format )
+{
+    Uint16 ucs2[2] = { ch, 0 };
+    Uint8 utf8[4];
+
+    UCS2_to_UTF8(ucs2, utf8);
+    return TTF_RenderUTF8_Shaded_Format(font, (char *)utf8, fg, bg, format);
+}
+
+Uint8 *TTF_RenderText_Blended(TTF_Font *font,
+                const char *text, Uint32 fg)
+{
+    return TTF_RenderText_Blended_Format(font, text, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderText_Blended_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(strlen(text)*2+1);
+    if ( utf8 ) {
+        LATIN1_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Blended_Format(font, (char *)utf8, fg, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+Uint8 *TTF_RenderUTF8_Blended(TTF_Font *font,
+                const char *text, Uint32 fg)
+{
+    return TTF_RenderUTF8_Blended_Format(font, text, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format)
+{
+    int first;
+    int xstart;
+    int width, height;
+    Uint8 *textbuf;
+    TTF_PixelLUT lut;
+    Uint8 *src;
+    Uint8 *dst;
+    Uint8 *dst_check;
+    int row;
+    TTF_Context *ctx;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_Long use_kerning;
+    FT_UInt prev_index = 0;
+    size_t textlen;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+
+    Prefetch_Glyphs(font, text, CACHED_METRICS|CACHED_PIXMAP);
+
+    if ( TTF_initPixelLUT(&lut, format, fg) < 0 ) {
+        return(NULL);
+    }
+
+    /* Get the dimensions of the text surface */
+    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
+        TTF_SetError("Text has zero width");
+        return(NULL);
+    }
+
+    /* Create the target surface */
+    textbuf = TTF_CreateRGBSurface(width, height, lut.depth, 0, 0, 0, 0);
+    if ( textbuf == NULL ) {
+        return(NULL);
+    }
+
+    /* Adding bound checking to avoid all kinds of memory corruption errors
+       that may occur. */
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+
+    /* check kerning */
+    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+
+    /* Load and render each character */
+    textlen = strlen(text);
+
+    first = 1;
+    xstart = 0;
+    TTF_FillRect(textbuf, lut.pixel[0]);
+    while ( textlen > 0 ) {
+        Uint16 c = UTF8_getch(&text, &textlen);
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        error = Find_Glyph(ctx, c, CACHED_METRICS|CACHED_PIXMAP, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            free( textbuf );
+            return NULL;
+        }
+        /* Ensure the width of the pixmap is correct. On some cases,
+         * freetype may report a larger pixmap than possible.*/
+        width = glyph->pixmap.width;
+        if (font->outline <= 0 && width > glyph->maxx - glyph->minx) {
+            width = glyph->maxx - glyph->minx;
+        }
+        /* do kerning, if possible AC-Patch */
+        if ( use_kerning && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            xstart += delta.x >> 6;
+        }
+
+        /* Compensate for the wrap around bug with negative minx's */
+        if ( first && (glyph->minx < 0) ) {
+            xstart -= glyph->minx;
+        }
+        first = 0;
+
+        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+            /* Make sure we don't go either over, or under the
+             * limit */
+            if ( row+glyph->yoffset < 0 ) {
+                continue;
+            }
+            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
+                continue;
+            }
+            dst = (Uint8*) (textbuf + 8) +
+                (row+glyph->yoffset) * fn_p(textbuf) +
+                (xstart + glyph->minx) * (lut.depth / 8);
+
+            /* Added code to adjust src pointer for pixmaps to
+             * account for pitch.
+             * */
+            src = (Uint8*) (glyph->pixmap.buffer + glyph->pixmap.pitch * row);
+            TTF_blendRow(&lut, dst, dst_check, src, width);
+        }
+
+        xstart += glyph->advance;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            xstart += font->glyph_overhang;
+        }
+        prev_index = glyph->index;
+    }
+
+    /* Handle the underline style */
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        row = TTF_underline_top_row(font);
+        TTF_drawLine_LUT(font, textbuf, row, &lut);
+    }
+
+    /* Handle the strikethrough style */
+    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+        row = TTF_strikethrough_top_row(font);
+        TTF_drawLine_LUT(font, textbuf, row, &lut);
+    }
+    return(textbuf);
+}
+
+Uint8 *TTF_RenderUNICODE_Blended(TTF_Font *font,
+                const Uint16 *text, Uint32 fg)
+{
+    return TTF_RenderUNICODE_Blended_Format(font, text, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderUNICODE_Blended_Format(TTF_Font *font,
+                const Uint16 *text, Uint32 fg, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
+    if ( utf8 ) {
+        UCS2_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Blended_Format(font, (char *)utf8, fg, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+
+Uint8 *TTF_RenderText_Blended_Wrapped(TTF_Font *font, const char *text, Uint32 fg, Uint32 wrapLength)
+{
+    return TTF_RenderText_Blended_Wrapped_Format(font, text, fg, wrapLength, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderText_Blended_Wrapped_Format(TTF_Font *font, const char *text, Uint32 fg, Uint32 wrapLength, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(strlen(text)*2+1);
+    if ( utf8 ) {
+        LATIN1_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Blended_Wrapped_Format(font, (char *)utf8, fg, wrapLength, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+/* A glyph placed by a layout pass, for the compositing pass after it */
+typedef struct {
+    c_glyph *glyph;
+    int x;              /* left edge of the pixmap */
+    int width;          /* pixmap columns to draw */
+} TTF_PlacedGlyph;
+
+/* Wrapped text laid out line by line.  Each line knows the range of
+   surface bytes its glyphs may touch, overhangs included. */
+typedef struct {
+    Uint8 *textbuf;
+    const TTF_PixelLUT *lut;
+    TTF_PlacedGlyph *glyphs;
+    int *line_first;        /* first glyph of each line, and the end */
+    long *line_lo;
+    long *line_hi;
+    int numLines;
+    int rowSize;
+} TTF_WrappedLayout;
+
+/* A band of surface bytes, composited by one thread */
+typedef struct {
+    const TTF_WrappedLayout *layout;
+    long lo;
+    long hi;
+} TTF_LineBand;
+
+/* Composite every glyph row that falls into a band, clipped to it, in
+   the same order as a single pass over all lines would.  Bands do not
+   overlap, so they can be composited at the same time and still give
+   the same pixels as one pass. */
+static void Composite_Band( void *data )
+{
+    const TTF_LineBand *band = (const TTF_LineBand *)data;
+    const TTF_WrappedLayout *layout = band->layout;
+    const TTF_PixelLUT *lut = layout->lut;
+    const int bpp = lut->depth / 8;
+    Uint8 *pixels = layout->textbuf + 8;
+    const Uint8 *dst_check = pixels + band->hi;
+    int line;
+    int i;
+    int row;
+
+    for ( line = 0; line < layout->numLines; ++line ) {
+        if ( layout->line_hi[line] <= band->lo || layout->line_lo[line] >= band->hi ) {
+            continue;
+        }
+        for ( i = layout->line_first[line]; i < layout->line_first[line+1]; ++i ) {
+            const TTF_PlacedGlyph *placed = &layout->glyphs[i];
+            const c_glyph *glyph = placed->glyph;
+
+            for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+                long offset;
+                int skip = 0;
+
+                /* Make sure we don't go either over, or under the
+                 * limit */
+                if ( row+glyph->yoffset < 0 ) {
+                    continue;
+                }
+                if ( row+glyph->yoffset >= fn_h(layout->textbuf) ) {
+                    continue;
+                }
+                offset = (long)layout->rowSize * line +
+                         (row+glyph->yoffset) * fn_p(layout->textbuf) + placed->x * bpp;
+                if ( offset >= band->hi || offset + placed->width * bpp <= band->lo ) {
+                    continue;
+                }
+                if ( offset < band->lo ) {
+                    skip = (int)((band->lo - offset) / bpp);
+                }
+                TTF_blendRow(lut, pixels + offset + skip * bpp, dst_check,
+                             glyph->pixmap.buffer + glyph->pixmap.pitch * row + skip,
+                             placed->width - skip);
+            }
+        }
+    }
+}
+
+/* Composite wrapped lines, in bands of whole lines spread over the render
+   threads when there are any */
+static void Composite_Lines( const TTF_WrappedLayout *layout )
+{
+    long size = (long)fn_p(layout->textbuf) * fn_h(layout->textbuf);
+    int nbands = layout->numLines;
+    TTF_LineBand *bands;
+    TTF_Task *tasks;
+    TTF_TaskGroup group = { 0 };
+    int i;
+
+    if ( nbands > TTF_pool.nworkers + 1 ) {
+        nbands = TTF_pool.nworkers + 1;
+    }
+    if ( nbands < 2 ||
+         (bands = (TTF_LineBand *)malloc( nbands * (sizeof( *bands ) + sizeof( *tasks ) ) )) == NULL ) {
+        TTF_LineBand all = { layout, 0, size };
+
+        Composite_Band( &all );
+        return;
+    }
+    tasks = (TTF_Task *)(bands + nbands);
+
+    for ( i = 0; i < nbands; ++i ) {
+        int first_line = layout->numLines * i / nbands;
+        int end_line = layout->numLines * (i + 1) / nbands;
+
+        bands[i].layout = layout;
+        bands[i].lo = (i == 0) ? 0 : (long)layout->rowSize * first_line;
+        bands[i].hi = (i == nbands - 1) ? size : (long)layout->rowSize * end_line;
+        tasks[i].run = Composite_Band;
+        tasks[i].data = &bands[i];
+    }
+
+    /* The calling thread takes the first band itself */
+    TTF_SubmitTasks( tasks + 1, nbands - 1, &group );
+    Composite_Band( &bands[0] );
+    TTF_WaitTasks( &group );
+    free( bands );
+}
+
+static int CharacterIsDelimiter(char c, const char *delimiters)
+{
+    while (*delimiters) {
+        if (c == *delimiters) {
+            return 1;
+        }
+        ++delimiters;
+    }
+    return 0;
+}
+
+/* Break text into the lines TTF_RenderUTF8_Blended_Wrapped() draws.
+   Without wrapping the text is a single line and *pstr and *plines are
+   set to NULL; otherwise the lines point into *pstr, a copy of the text,
+   and the caller frees both.
+*/
+static int TTF_WrapLines(TTF_Font *font, const char *text, Uint32 wrapLength,
+                         char **pstr, char ***plines, int *pnumLines)
+{
+    int numLines = 1;
+    char *str = NULL;
+    char **strLines = NULL;
+
+    if ( wrapLength > 0 && *text ) {
+        const char *wrapDelims = " \t\r\n";
+        int w, h;
+        char *spot, *tok, *next_tok, *end;
+        char delim;
+        size_t str_len = strlen(text);
+
+        numLines = 0;
+
+        str = (char*)malloc(str_len+1);
+        if ( str == NULL ) {
+            TTF_SetError("Out of memory");
+            return -1;
+        }
+
+        strncpy(str, text, str_len+1);
+        tok = str;
+        end = str + str_len;
+        do {
+            char **lines = (char **)realloc(strLines, (numLines+1)*sizeof(*strLines));
+            if (!lines) {
+                TTF_SetError("Out of memory");
+                free(strLines);
+                free(str);
+                return -1;
+            }
+            strLines = lines;
+            strLines[numLines++] = tok;
+
+            /* Look for the end of the line */
+            if ((spot = strchr(tok, '\r')) != NULL ||
+                (spot = strchr(tok, '\n')) != NULL) {
+                if (*spot == '\r') {
+                    ++spot;
+                }
+                if (*spot == '\n') {
+                    ++spot;
+                }
+            } else {
+                spot = end;
+            }
+            next_tok = spot;
+
+            /* Get the longest string that will fit in the desired space */
+            for ( ; ; ) {
+                /* Strip trailing whitespace */
+                while ( spot > tok &&
+                        CharacterIsDelimiter(spot[-1], wrapDelims) ) {
+                    --spot;
+                }
+                if ( spot == tok ) {
+                    if (CharacterIsDelimiter(*spot, wrapDelims)) {
+                        *spot = '\0';
+                    }
+                    break;
+                }
+                delim = *spot;
+                *spot = '\0';
+
+                TTF_SizeUTF8(font, tok, &w, &h);
+                if ((Uint32)w <= wrapLength) {
+                    break;
+                } else {
+                    /* Back up and try again... */
+                    *spot = delim;
+                }
+
+                while ( spot > tok &&
+                        !CharacterIsDelimiter(spot[-1], wrapDelims) ) {
+                    --spot;
+                }
+                if ( spot > tok ) {
+                    next_tok = spot;
+                }
+            }
+            tok = next_tok;
+        } while (tok < end);
+    }
+
+    *pstr = str;
+    *plines = strLines;
+    *pnumLines = numLines;
+    return 0;
+}
+
+/* Place the glyphs of one line of wrapped text, with their left edge as
+   drawn.  Kerning goes on from *prev_index, the last glyph placed before,
+   even on the line above, as it always has.  Returns the number of
+   glyphs, or -1 on error.
+*/
+static int Layout_WrappedLine(TTF_Context *ctx, const char *text,
+                              FT_UInt *prev_index, TTF_PlacedGlyph *glyphs)
+{
+    TTF_Font *font = ctx->font;
+    int first = 1;
+    int xstart = 0;
+    int width;
+    int count = 0;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_Long use_kerning;
+    size_t textlen;
+
+    /* check kerning */
+    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+
+    textlen = strlen(text);
+    while ( textlen > 0 ) {
+        TTF_PlacedGlyph *placed;
+        Uint16 c = UTF8_getch(&text, &textlen);
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        error = Find_Glyph(ctx, c, CACHED_METRICS|CACHED_PIXMAP, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            return -1;
+        }
+        /* Ensure the width of the pixmap is correct. On some cases,
+         * freetype may report a larger pixmap than possible.*/
+        width = glyph->pixmap.width;
+        if ( font->outline <= 0 && width > glyph->maxx - glyph->minx ) {
+            width = glyph->maxx - glyph->minx;
+        }
+        /* do kerning, if possible AC-Patch */
+        if ( use_kerning && *prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, *prev_index, glyph->index, ft_kerning_default, &delta );
+            xstart += delta.x >> 6;
+        }
+
+        /* Compensate for the wrap around bug with negative minx's */
+        if ( first && (glyph->minx < 0) ) {
+            xstart -= glyph->minx;
+        }
+        first = 0;
+
+        placed = &glyphs[count++];
+        placed->glyph = glyph;
+        placed->x = xstart + glyph->minx;
+        placed->width = width;
+
+        xstart += glyph->advance;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            xstart += font->glyph_overhang;
+        }
+        *prev_index = glyph->index;
+    }
+    return count;
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Wrapped(TTF_Font *font,
+                                    const char *text, Uint32 fg, Uint32 wrapLength)
+{
+    return TTF_RenderUTF8_Blended_Wrapped_Format(font, text, fg, wrapLength, TTF_PIXELFORMAT_ARGB8888);
+}
+
+/* Lay out and composite lines of text, one below the other, into a new
+   surface of the given width */
+static Uint8 *Render_WrappedLines(TTF_Context *ctx, char **lines, int numLines,
+                                  int width, int height, const TTF_PixelLUT *lut)
+{
+    Uint8 *textbuf;
+    int row;
+    c_glyph *glyph;
+    FT_UInt prev_index = 0;
+    const int lineSpace = 2;
+    int line, rowSize;
+    size_t textlen;
+    TTF_WrappedLayout layout;
+    int nglyphs, count, i;
+
+    /* Create the target surface */
+    textbuf = TTF_CreateRGBSurface(width,
+            height * numLines + (lineSpace * (numLines - 1)),
+            lut->depth, 0, 0, 0, 0);
+    if ( textbuf == NULL ) {
+        return(NULL);
+    }
+    layout.glyphs = NULL;
+
+    rowSize = fn_p(textbuf) * height;
+
+    /* Lay out every line before compositing any of them.  Lines of words
+     * too long to wrap run on into the next, so count them all. */
+    textlen = 0;
+    for ( line = 0; line < numLines; line++ ) {
+        textlen += strlen(lines[line]);
+    }
+    layout.glyphs = (TTF_PlacedGlyph *)malloc(
+            (textlen + 1) * sizeof(*layout.glyphs) +
+            numLines * 2 * sizeof(*layout.line_lo) +
+            (numLines + 1) * sizeof(*layout.line_first) );
+    if ( layout.glyphs == NULL ) {
+        TTF_OutOfMemory();
+        free( textbuf );
+        textbuf = NULL;
+        goto done;
+    }
+    layout.line_lo = (long *)(layout.glyphs + textlen + 1);
+    layout.line_hi = layout.line_lo + numLines;
+    layout.line_first = (int *)(layout.line_hi + numLines);
+    layout.textbuf = textbuf;
+    layout.lut = lut;
+    layout.numLines = numLines;
+    layout.rowSize = rowSize;
+
+    /* Glyphs found now must stay cached until composited */
+    ++ctx->cache_pins;
+    nglyphs = 0;
+    for ( line = 0; line < numLines; line++ ) {
+        long lo = rowSize * fn_h(textbuf);
+        long hi = 0;
+
+        layout.line_first[line] = nglyphs;
+        count = Layout_WrappedLine(ctx, lines[line],
+                                   &prev_index, layout.glyphs + nglyphs);
+        if ( count < 0 ) {
+            free( textbuf );
+            textbuf = NULL;
+            goto done;
+        }
+
+        /* Track the bytes this line may touch */
+        for ( i = nglyphs; i < nglyphs + count; ++i ) {
+            const TTF_PlacedGlyph *placed = &layout.glyphs[i];
+
+            glyph = placed->glyph;
+            for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+                long offset;
+
+                if ( row+glyph->yoffset < 0 || row+glyph->yoffset >= fn_h(textbuf) ) {
+                    continue;
+                }
+                offset = (long)rowSize * line + (row+glyph->yoffset) * fn_p(textbuf) +
+                         placed->x * (lut->depth / 8);
+                if ( offset < lo ) {
+                    lo = offset;
+                }
+                if ( offset + placed->width * (lut->depth / 8) > hi ) {
+                    hi = offset + placed->width * (lut->depth / 8);
+                }
+            }
+        }
+        nglyphs += count;
+        layout.line_lo[line] = lo;
+        layout.line_hi[line] = hi;
+
+        /* Handle the underline style *
+        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+            row = TTF_underline_top_row(font);
+            TTF_drawLine_LUT(font, textbuf, row, &lut);
+        }
+        */
+
+        /* Handle the strikethrough style *
+        if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+            row = TTF_strikethrough_top_row(font);
+            TTF_drawLine_LUT(font, textbuf, row, &lut);
+        }
+        */
+    }
+    layout.line_first[numLines] = nglyphs;
+
+    /* Load and render each character */
+    TTF_FillRect(textbuf, lut->pixel[0]); /* Initialize with fg and 0 alpha */
+    Composite_Lines(&layout);
+
+done:
+    if ( layout.glyphs ) {
+        --ctx->cache_pins;
+        free( layout.glyphs );
+    }
+    return(textbuf);
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Wrapped_Format(TTF_Font *font,
+                                    const char *text, Uint32 fg, Uint32 wrapLength, int format)
+{
+    int width, height;
+    Uint8 *textbuf;
+    TTF_PixelLUT lut;
+    TTF_Context *ctx;
+    int numLines;
+    char *str, **strLines;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+
+    Prefetch_Glyphs(font, text, CACHED_METRICS|CACHED_PIXMAP);
+
+    if ( TTF_initPixelLUT(&lut, format, fg) < 0 ) {
+        return(NULL);
+    }
+
+    /* Get the dimensions of the text surface */
+    if ( (TTF_SizeUTF8(font, text, &width, &height) < 0) || !width ) {
+        TTF_SetError("Text has zero width");
+        return(NULL);
+    }
+
+    if ( TTF_WrapLines(font, text, wrapLength, &str, &strLines, &numLines) < 0 ) {
+        return(NULL);
+    }
+
+    if ( strLines ) {
+        textbuf = Render_WrappedLines(ctx, strLines, numLines,
+                                      (numLines > 1) ? (int)wrapLength : width, height, &lut);
+        free(strLines);
+        free(str);
+    } else {
+        textbuf = Render_WrappedLines(ctx, (char **)&text, 1, width, height, &lut);
+    }
+    return(textbuf);
+}
+
+Uint8 *TTF_RenderUNICODE_Blended_Wrapped(TTF_Font *font, const Uint16* text,
+                                               Uint32 fg, Uint32 wrapLength)
+{
+    return TTF_RenderUNICODE_Blended_Wrapped_Format(font, text, fg, wrapLength, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderUNICODE_Blended_Wrapped_Format(TTF_Font *font, const Uint16* text,
+                                               Uint32 fg, Uint32 wrapLength, int format)
+{
+    Uint8 *surface = NULL;
+    Uint8 *utf8;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
+    if ( utf8 ) {
+        UCS2_to_UTF8(text, utf8);
+        surface = TTF_RenderUTF8_Blended_Wrapped_Format(font, (char *)utf8, fg, wrapLength, format);
+        free(utf8);
+    } else {
+        TTF_OutOfMemory();
+    }
+    return surface;
+}
+
+/* Streaming wrapped text.  The text is wrapped and placed exactly as
+   TTF_RenderUTF8_Blended_Wrapped() does, but never drawn into one
+   surface: tiles of a fixed grid are composited one at a time into a
+   single reused buffer, laying out only the lines that reach each row of
+   tiles.  Memory stays at one tile and a few lines of glyphs however
+   long the text is, and the size is not bound to the 16-bit surface
+   header.  Glyphs are clipped at the edges instead of running on into
+   the next row of pixels. */
+
+static void TTF_WrappedSize(int width, int height, Uint32 wrapLength, int numLines,
+                            int *w, int *h)
+{
+    const int lineSpace = 2;
+
+    *w = (numLines > 1) ? (int)wrapLength : width;
+    *h = height * numLines + (lineSpace * (numLines - 1));
+}
+
+int TTF_SizeUTF8_Wrapped(TTF_Font *font, const char *text, Uint32 wrapLength,
+                         int *w, int *h)
+{
+    int width, height;
+    int numLines;
+    char *str, **strLines;
+
+    TTF_CHECKPOINTER(text, -1);
+
+    if ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) {
+        return -1;
+    }
+    if ( TTF_WrapLines(font, text, wrapLength, &str, &strLines, &numLines) < 0 ) {
+        return -1;
+    }
+    if ( strLines ) {
+        free(strLines);
+        free(str);
+    }
+    TTF_WrappedSize(width, height, wrapLength, numLines, &width, &height);
+    if ( w ) {
+        *w = width;
+    }
+    if ( h ) {
+        *h = height;
+    }
+    return 0;
+}
+
+/* The glyph index kerning starts from at the beginning of a line: that
+   of the last character of the lines above */
+static FT_UInt Wrapped_PrevIndex(TTF_Context *ctx, const char *text,
+                                 char **strLines, int line)
+{
+    c_glyph *glyph;
+    FT_Error error;
+
+    if ( !FT_HAS_KERNING( ctx->font->face ) || !ctx->font->kerning ) {
+        return 0;
+    }
+    while ( --line >= 0 ) {
+        const char *str = strLines ? strLines[line] : text;
+        size_t textlen = strlen(str);
+        Uint16 last = 0;
+        int found = 0;
+
+        while ( textlen > 0 ) {
+            Uint16 c = UTF8_getch(&str, &textlen);
+            if ( c != UNICODE_BOM_NATIVE && c != UNICODE_BOM_SWAPPED ) {
+                last = c;
+                found = 1;
+            }
+        }
+        if ( found ) {
+            error = Find_Glyph(ctx, last, CACHED_METRICS, &glyph);
+            return error ? 0 : glyph->index;
+        }
+    }
+    return 0;
+}
+
+int TTF_RenderUTF8_Blended_Wrapped_Tiles(TTF_Font *font, const char *text,
+                                         Uint32 fg, Uint32 wrapLength, int format,
+                                         int tile_w, int tile_h, const TTF_Rect *area,
+                                         TTF_TileCallback callback, void *userdata)
+{
+    int width, height;
+    int surface_w, surface_h;
+    int numLines;
+    char *str, **strLines;
+    TTF_PixelLUT lut;
+    TTF_Context *ctx;
+    TTF_PlacedGlyph *glyphs = NULL;
+    size_t maxglyphs = 0;
+    Uint8 *tile = NULL;
+    int pitch, bpp;
+    int x0, y0, x1, y1;
+    int col0, col1, tile_row, tile_col;
+    int status = 0;
+
+    TTF_CHECKPOINTER(text, -1);
+    TTF_CHECKPOINTER(callback, -1);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return -1;
+    }
+    if ( TTF_initPixelLUT(&lut, format, fg) < 0 ) {
+        return -1;
+    }
+    bpp = lut.depth / 8;
+
+    /* Get the dimensions of the whole text */
+    if ( (TTF_SizeUTF8(font, text, &width, &height) < 0) || !width ) {
+        TTF_SetError("Text has zero width");
+        return -1;
+    }
+    if ( TTF_WrapLines(font, text, wrapLength, &str, &strLines, &numLines) < 0 ) {
+        return -1;
+    }
+    TTF_WrappedSize(width, height, wrapLength, numLines, &surface_w, &surface_h);
+
+    if ( tile_w <= 0 ) {
+        tile_w = surface_w;
+    }
+    if ( tile_h <= 0 ) {
+        tile_h = height;
+    }
+    pitch = ((tile_w + 3) & ~3) * bpp;
+    if ( tile_w > 0xFFFF || tile_h > 0xFFFF || pitch > 0xFFFF ) {
+        TTF_SetError("Tile is too large");
+        status = -1;
+        goto done;
+    }
+
+    /* Only the tiles meeting the requested area */
+    x0 = 0;
+    y0 = 0;
+    x1 = surface_w;
+    y1 = surface_h;
+    if ( area ) {
+        if ( area->x > x0 ) {
+            x0 = area->x;
+        }
+        if ( area->y > y0 ) {
+            y0 = area->y;
+        }
+        if ( area->x + area->w < x1 ) {
+            x1 = area->x + area->w;
+        }
+        if ( area->y + area->h < y1 ) {
+            y1 = area->y + area->h;
+        }
+    }
+    if ( x0 >= x1 || y0 >= y1 ) {
+        goto done;
+    }
+    col0 = x0 / tile_w;
+    col1 = (x1 - 1) / tile_w;
+
+    tile = TTF_CreateRGBSurface(tile_w, tile_h, lut.depth, 0, 0, 0, 0);
+    if ( tile == NULL ) {
+        TTF_OutOfMemory();
+        status = -1;
+        goto done;
+    }
+
+    Prefetch_Glyphs(font, text, CACHED_METRICS|CACHED_PIXMAP);
+
+    for ( tile_row = y0 / tile_h; tile_row <= (y1 - 1) / tile_h && !status; ++tile_row ) {
+        int ty = tile_row * tile_h;
+        int th = (ty + tile_h > surface_h) ? surface_h - ty : tile_h;
+        int first_line, last_line, line;
+        int *line_first;
+        int nglyphs = 0;
+        size_t textlen = 0;
+        FT_UInt prev_index;
+
+        /* Lines are height apart and never draw above their top, but a
+           line may hang into the one below it */
+        first_line = ty / height - 1;
+        if ( first_line < 0 ) {
+            first_line = 0;
+        }
+        last_line = (ty + th - 1) / height;
+        if ( last_line >= numLines ) {
+            last_line = numLines - 1;
+        }
+        if ( first_line > last_line ) {
+            first_line = last_line;
+        }
+
+        for ( line = first_line; line <= last_line; ++line ) {
+            textlen += strlen(strLines ? strLines[line] : text);
+        }
+        if ( textlen + 1 + (last_line - first_line + 2) > maxglyphs ) {
+            TTF_PlacedGlyph *more;
+
+            maxglyphs = textlen + 1 + (last_line - first_line + 2);
+            more = (TTF_PlacedGlyph *)realloc(glyphs, maxglyphs * sizeof(*glyphs) +
+                                              maxglyphs * sizeof(*line_first));
+            if ( more == NULL ) {
+                TTF_OutOfMemory();
+                status = -1;
+                break;
+            }
+            glyphs = more;
+        }
+        line_first = (int *)(glyphs + maxglyphs);
+
+        /* Glyphs found now must stay cached until this row is done */
+        ++ctx->cache_pins;
+        prev_index = Wrapped_PrevIndex(ctx, text, strLines, first_line);
+        for ( line = first_line; line <= last_line; ++line ) {
+            int count = Layout_WrappedLine(ctx, strLines ? strLines[line] : text,
+                                           &prev_index, glyphs + nglyphs);
+            if ( count < 0 ) {
+                status = -1;
+                break;
+            }
+            line_first[line - first_line] = nglyphs;
+            nglyphs += count;
+        }
+        line_first[last_line - first_line + 1] = nglyphs;
+
+        for ( tile_col = col0; tile_col <= col1 && !status; ++tile_col ) {
+            int tx = tile_col * tile_w;
+            int tw = (tx + tile_w > surface_w) ? surface_w - tx : tile_w;
+            Uint8 *pixels = tile + 8;
+            const Uint8 *dst_check = pixels + pitch * th;
+            int i;
+
+            fn_set_w(tile, tw);
+            fn_set_h(tile, th);
+            TTF_FillRect(tile, lut.pixel[0]); /* Initialize with fg and 0 alpha */
+
+            for ( line = first_line; line <= last_line; ++line ) {
+                for ( i = line_first[line - first_line]; i < line_first[line - first_line + 1]; ++i ) {
+                    const TTF_PlacedGlyph *placed = &glyphs[i];
+                    const c_glyph *glyph = placed->glyph;
+                    int left = placed->x;
+                    int right = placed->x + placed->width;
+                    int row;
+
+                    if ( left < tx ) {
+                        left = tx;
+                    }
+                    if ( right > tx + tw ) {
+                        right = tx + tw;
+                    }
+                    if ( left >= right ) {
+                        continue;
+                    }
+                    for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+                        int y = line * height + row + glyph->yoffset;
+
+                        if ( row+glyph->yoffset < 0 || y < ty ) {
+                            continue;
+                        }
+                        if ( y >= ty + th ) {
+                            break;
+                        }
+                        TTF_blendRow(&lut, pixels + (y - ty) * pitch + (left - tx) * bpp,
+                                     dst_check,
+                                     glyph->pixmap.buffer + glyph->pixmap.pitch * row +
+                                         (left - placed->x),
+                                     right - left);
+                    }
+                }
+            }
+
+            status = callback(userdata, tile, tx, ty);
+        }
+
+        --ctx->cache_pins;
+    }
+
+done:
+    free(tile);
+    free(glyphs);
+    if ( strLines ) {
+        free(strLines);
+        free(str);
+    }
+    return status;
+}
+
+/* Tight rendering.  Glyphs are placed as TTF_RenderUTF8_Blended() places
+   them, but the surface only spans the pixmaps and lines that are
+   drawn, clipped to the box of the normal surface, and the offset of
+   that span from the top left corner of the box is returned alongside.
+*/
+Uint8 *TTF_RenderUTF8_Blended_Tight(TTF_Font *font,
+                const char *text, Uint32 fg, int *x, int *y)
+{
+    return TTF_RenderUTF8_Blended_Tight_Format(font, text, fg, TTF_PIXELFORMAT_ARGB8888, x, y);
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Tight_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format, int *x, int *y)
+{
+    int width, height;
+    int x0, y0, x1, y1;
+    Uint8 *textbuf = NULL;
+    TTF_PixelLUT lut;
+    TTF_PlacedGlyph *placed;
+    Uint8 *dst_check;
+    TTF_Context *ctx;
+    FT_UInt prev_index = 0;
+    int count, i, row, top;
+    int lines[2], numlines = 0;
+    int line_height;
+
+    TTF_CHECKPOINTER(text, NULL);
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+
+    Prefetch_Glyphs(font, text, CACHED_METRICS|CACHED_PIXMAP);
+
+    if ( TTF_initPixelLUT(&lut, format, fg) < 0 ) {
+        return(NULL);
+    }
+
+    /* Get the dimensions of the full surface */
+    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
+        TTF_SetError("Text has zero width");
+        return(NULL);
+    }
+
+    placed = (TTF_PlacedGlyph *)malloc((strlen(text) + 1) * sizeof(*placed));
+    if ( placed == NULL ) {
+        TTF_OutOfMemory();
+        return(NULL);
+    }
+
+    /* Glyphs found now must stay cached until composited */
+    ++ctx->cache_pins;
+    count = Layout_WrappedLine(ctx, text, &prev_index, placed);
+    if ( count < 0 ) {
+        goto done;
+    }
+
+    /* Find the ink */
+    x0 = width;
+    y0 = height;
+    x1 = 0;
+    y1 = 0;
+    for ( i = 0; i < count; ++i ) {
+        const c_glyph *glyph = placed[i].glyph;
+
+        if ( placed[i].width <= 0 || glyph->pixmap.rows <= 0 ) {
+            continue;
+        }
+        if ( placed[i].x < x0 ) {
+            x0 = placed[i].x;
+        }
+        if ( placed[i].x + placed[i].width > x1 ) {
+            x1 = placed[i].x + placed[i].width;
+        }
+        if ( glyph->yoffset < y0 ) {
+            y0 = glyph->yoffset;
+        }
+        if ( glyph->yoffset + glyph->pixmap.rows > y1 ) {
+            y1 = glyph->yoffset + glyph->pixmap.rows;
+        }
+    }
+    line_height = font->underline_height;
+    if ( font->outline > 0 ) {
+        line_height += font->outline * 2;
+    }
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        lines[numlines++] = TTF_underline_top_row(font);
+    }
+    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+        lines[numlines++] = TTF_strikethrough_top_row(font);
+    }
+    for ( i = 0; i < numlines; ++i ) {
+        top = (lines[i] > 0) ? lines[i] : 0;
+        x0 = 0;
+        x1 = width;
+        if ( top < y0 ) {
+            y0 = top;
+        }
+        if ( top + line_height > y1 ) {
+            y1 = top + line_height;
+        }
+    }
+    if ( x0 < 0 ) {
+        x0 = 0;
+    }
+    if ( y0 < 0 ) {
+        y0 = 0;
+    }
+    if ( x1 > width ) {
+        x1 = width;
+    }
+    if ( y1 > height ) {
+        y1 = height;
+    }
+    if ( x0 >= x1 || y0 >= y1 ) {
+        TTF_SetError("Text has no ink");
+        goto done;
+    }
+
+    /* Create the target surface */
+    textbuf = TTF_CreateRGBSurface(x1 - x0, y1 - y0, lut.depth, 0, 0, 0, 0);
+    if ( textbuf == NULL ) {
+        goto done;
+    }
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+    TTF_FillRect(textbuf, lut.pixel[0]);
+
+    for ( i = 0; i < count; ++i ) {
+        const c_glyph *glyph = placed[i].glyph;
+        int left = placed[i].x;
+        int right = placed[i].x + placed[i].width;
+
+        if ( right > x1 ) {
+            right = x1;
+        }
+        if ( left >= right ) {
+            continue;
+        }
+        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+            int dst_row = row + glyph->yoffset;
+
+            if ( dst_row < y0 ) {
+                continue;
+            }
+            if ( dst_row >= y1 ) {
+                break;
+            }
+            TTF_blendRow(&lut,
+                         textbuf + 8 + (dst_row - y0) * fn_p(textbuf) + (left - x0) * (lut.depth / 8),
+                         dst_check,
+                         glyph->pixmap.buffer + glyph->pixmap.pitch * row,
+                         right - left);
+        }
+    }
+    for ( i = 0; i < numlines; ++i ) {
+        top = (lines[i] > 0) ? lines[i] : 0;
+        TTF_drawLineSpan_LUT(font, textbuf, top - y0, 0, x1 - x0, &lut);
+    }
+
+    if ( x ) {
+        *x = x0;
+    }
+    if ( y ) {
+        *y = y0;
+    }
+
+done:
+    --ctx->cache_pins;
+    free(placed);
+    return(textbuf);
+}
+
+Uint8 *TTF_RenderGlyph_Blended(TTF_Font *font, Uint16 ch, Uint32 fg)
+{
+    return TTF_RenderGlyph_Blended_Format(font, ch, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderGlyph_Blended_Format(TTF_Font *font, Uint16 ch, Uint32 fg, int format)
+{
+    Uint16 ucs2[2] = { ch, 0 };
+    Uint8 utf8[4];
+
+    UCS2_to_UTF8(ucs2, utf8);
+    return TTF_RenderUTF8_Blended_Format(font, (char *)utf8, fg, format);
+}
+
+/* Draw glyphs given by index at the pen positions given, through the LUT
+   of the Shaded or Blended mode.  The text is already shaped, so there is
+   no decoding, character map or kerning; the glyphs come from the cache
+   by index.
+*/
+static Uint8 *Render_GlyphRun(TTF_Font *font, TTF_Context *ctx,
+                const Uint32 *indices, const int *x, const int *y, int count,
+                const TTF_PixelLUT *lut, int format, int shaded)
+{
+    int i, z;
+    int width, height;
+    int glyph_height;
+    int col, skip;
+    int span;
+    Uint8 *textbuf;
+    Uint8 *dst_check;
+    int row;
+    c_glyph *glyph;
+    FT_Error error;
+    int outline_delta = 0;
+
+    TTF_CHECKPOINTER(indices, NULL);
+    TTF_CHECKPOINTER(x, NULL);
+    TTF_CHECKPOINTER(y, NULL);
+
+    if ( font->outline > 0 ) {
+        outline_delta = font->outline * 2;
+    }
+
+    /* Make room for every glyph as TTF_SizeUTF8() would */
+    width = 0;
+    height = 0;
+    glyph_height = 0;
+    for ( i = 0; i < count; ++i ) {
+        error = Find_GlyphIndex(ctx, indices[i], CACHED_METRICS, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            return NULL;
+        }
+        z = x[i];
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            z += font->glyph_overhang;
+        }
+        z += (glyph->advance > glyph->maxx) ? glyph->advance : glyph->maxx;
+        if ( width < z ) {
+            width = z;
+        }
+        z = y[i] - glyph->miny;
+        if ( glyph_height < z ) {
+            glyph_height = z;
+        }
+        z = y[i] - font->ascent + font->height;
+        if ( height < z ) {
+            height = z;
+        }
+    }
+    width += outline_delta;
+    if ( height < glyph_height + outline_delta ) {
+        height = glyph_height + outline_delta;
+    }
+    if ( count <= 0 || width <= 0 || height <= 0 ) {
+        TTF_SetError("Text has zero width");
+        return NULL;
+    }
+
+    /* Create the target surface */
+    if ( shaded && format == TTF_PIXELFORMAT_INDEX8 ) {
+        textbuf = TTF_CreatePaletteSurface(width, height, NUM_GRAYS);
+    } else {
+        textbuf = TTF_CreateRGBSurface(width, height, lut->depth, 0, 0, 0, 0);
+    }
+    if ( textbuf == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+
+    if ( shaded && format == TTF_PIXELFORMAT_INDEX8 ) {
+        memcpy(fn_palette(textbuf), lut->palette, NUM_GRAYS * sizeof(Uint32));
+    } else if ( !shaded || lut->depth != 8 ) {
+        TTF_FillRect(textbuf, lut->pixel[0]);
+    }
+
+    for ( i = 0; i < count; ++i ) {
+        int top;
+
+        error = Find_GlyphIndex(ctx, indices[i], CACHED_METRICS|CACHED_PIXMAP, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            free( textbuf );
+            return NULL;
+        }
+        span = glyph->pixmap.width;
+        if (font->outline <= 0 && span > glyph->maxx - glyph->minx) {
+            span = glyph->maxx - glyph->minx;
+        }
+
+        /* Clip the glyph to the left and right edges */
+        col = x[i] + glyph->minx;
+        skip = 0;
+        if ( col < 0 ) {
+            skip = -col;
+            col = 0;
+        }
+        if ( span > width - col + skip ) {
+            span = width - col + skip;
+        }
+        if ( span <= skip ) {
+            continue;
+        }
+
+        top = y[i] - font->ascent + glyph->yoffset;
+        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+            if ( row+top < 0 ) {
+                continue;
+            }
+            if ( row+top >= fn_h(textbuf) ) {
+                continue;
+            }
+            TTF_blendRow(lut,
+                (Uint8*)(textbuf + 8) + (row+top) * fn_p(textbuf) + col * (lut->depth / 8),
+                dst_check,
+                glyph->pixmap.buffer + glyph->pixmap.pitch * row + skip,
+                span - skip);
+        }
+    }
+    return textbuf;
+}
+
+Uint8 *TTF_RenderGlyphRun_Shaded(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg, Uint32 bg)
+{
+    return TTF_RenderGlyphRun_Shaded_Format(font, indices, x, y, count, fg, bg, TTF_PIXELFORMAT_INDEX8);
+}
+
+Uint8 *TTF_RenderGlyphRun_Shaded_Format(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg, Uint32 bg, int format)
+{
+    const TTF_PixelLUT *lut;
+    TTF_Context *ctx;
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+    lut = Find_ShadedLUT(ctx, fg, bg, format);
+    if ( lut == NULL ) {
+        return NULL;
+    }
+    return Render_GlyphRun(font, ctx, indices, x, y, count, lut, format, 1);
+}
+
+Uint8 *TTF_RenderGlyphRun_Blended(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg)
+{
+    return TTF_RenderGlyphRun_Blended_Format(font, indices, x, y, count, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderGlyphRun_Blended_Format(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg, int format)
+{
+    TTF_PixelLUT lut;
+    TTF_Context *ctx;
+
+    ctx = TTF_GetContext(font);
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+    if ( TTF_initPixelLUT(&lut, format, fg) < 0 ) {
+        return NULL;
+    }
+    return Render_GlyphRun(font, ctx, indices, x, y, count, &lut, format, 0);
+}
+
+/* Font stacks: the font of each character is looked up in a table built
+   from the coverage of the fonts, found when they were opened, as they
+   are added.
+*/
+#define STACK_MAX_FONTS 255
+#define STACK_NO_FONT   0xFF
+
+struct _TTF_FontStack {
+    TTF_Font *fonts[STACK_MAX_FONTS];
+    int numfonts;
+
+    /* The common baseline and line height */
+    int ascent;
+    int height;
+
+    /* The index of the font drawing each character */
+    Uint8 lookup[0x10000];
+};
+
+typedef struct {
+    c_glyph *glyph;
+    int font;
+    int x;
+} TTF_StackGlyph;
+
+TTF_FontStack *TTF_CreateFontStack( void )
+{
+    TTF_FontStack *stack;
+
+    stack = (TTF_FontStack *)malloc( sizeof(*stack) );
+    if ( stack == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    memset( stack, 0, sizeof(*stack) );
+    memset( stack->lookup, STACK_NO_FONT, sizeof(stack->lookup) );
+    return stack;
+}
+
+int TTF_FontStackAdd( TTF_FontStack *stack, TTF_Font *font )
+{
+    const Uint32 *coverage;
+    Uint8 index;
+    int word;
+    int i;
+
+    TTF_CHECKPOINTER(stack, -1);
+    TTF_CHECKPOINTER(font, -1);
+
+    if ( stack->numfonts == STACK_MAX_FONTS ) {
+        TTF_SetError( "Too many fonts in stack" );
+        return -1;
+    }
+    coverage = font->base ? font->base->coverage : font->coverage;
+
+    /* Characters no earlier font provides now go to this one */
+    index = (Uint8)stack->numfonts;
+    for ( word = 0; word < 0x10000 / 32; ++word ) {
+        Uint32 bits = coverage[word];
+
+        while ( bits ) {
+            int bit = __builtin_ctz( bits );
+            Uint8 *slot = &stack->lookup[word * 32 + bit];
+
+            if ( *slot == STACK_NO_FONT ) {
+                *slot = index;
+            }
+            bits &= bits - 1;
+        }
+    }
+    stack->fonts[stack->numfonts++] = font;
+
+    /* Align every font on the highest baseline */
+    if ( font->ascent > stack->ascent ) {
+        stack->ascent = font->ascent;
+    }
+    stack->height = 0;
+    for ( i = 0; i < stack->numfonts; ++i ) {
+        TTF_Font *f = stack->fonts[i];
+        int bottom = stack->ascent - f->ascent + f->height;
+
+        if ( bottom > stack->height ) {
+            stack->height = bottom;
+        }
+    }
+    return 0;
+}
+
+TTF_Font *TTF_FontStackFont( const TTF_FontStack *stack, Uint16 ch )
+{
+    Uint8 index;
+
+    TTF_CHECKPOINTER(stack, NULL);
+
+    index = stack->lookup[ch];
+    return (index == STACK_NO_FONT) ? NULL : stack->fonts[index];
+}
+
+int TTF_FontStackHeight( const TTF_FontStack *stack )
+{
+    TTF_CHECKPOINTER(stack, 0);
+
+    return stack->height;
+}
+
+int TTF_FontStackAscent( const TTF_FontStack *stack )
+{
+    TTF_CHECKPOINTER(stack, 0);
+
+    return stack->ascent;
+}
+
+void TTF_FreeFontStack( TTF_FontStack *stack )
+{
+    free( stack );
+}
+
+/* Find the glyphs of UTF-8 text in the fonts of a stack and place them
+   on one line, filling 'glyphs' if not NULL, and get the bounding box the
+   way TTF_SizeUTF8() does.  The glyphs are placed from x = 0.
+*/
+static int TTF_LayoutStack( TTF_FontStack *stack, const char *text, int want,
+                            TTF_StackGlyph *glyphs, int *numglyphs,
+                            int *w, int *h )
+{
+    TTF_Context *ctx = NULL;
+    TTF_Font *font = NULL;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_UInt prev_index = 0;
+    int prev_font = -1;
+    int x, z;
+    int minx, maxx;
+    int bottom, outline_delta;
+    int count = 0;
+    int height;
+    size_t textlen;
+    int i;
+
+    minx = maxx = 0;
+    height = stack->height;
+    outline_delta = 0;
+
+    textlen = strlen(text);
+    x = 0;
+    while ( textlen > 0 ) {
+        Uint16 c = UTF8_getch(&text, &textlen);
+        int index;
+        int yshift;
+
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        /* Characters no font provides are drawn with the first one */
+        index = stack->lookup[c];
+        if ( index == STACK_NO_FONT ) {
+            index = 0;
+        }
+        if ( index != prev_font ) {
+            font = stack->fonts[index];
+            ctx = TTF_GetContext( font );
+            if ( ctx == NULL ) {
+                return -1;
+            }
+            prev_index = 0;
+        }
+
+        error = Find_Glyph(ctx, c, want, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            return -1;
+        }
+
+        /* Kerning applies between glyphs of the same font only */
+        if ( font->kerning && FT_HAS_KERNING( font->face ) && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            x += delta.x >> 6;
+        }
+
+        if ( glyphs ) {
+            glyphs[count].glyph = glyph;
+            glyphs[count].font = index;
+            glyphs[count].x = x;
+        }
+        ++count;
+
+        z = x + glyph->minx;
+        if ( minx > z ) {
+            minx = z;
+        }
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            x += font->glyph_overhang;
+        }
+        if ( glyph->advance > glyph->maxx ) {
+            z = x + glyph->advance;
+        } else {
+            z = x + glyph->maxx;
+        }
+        if ( maxx < z ) {
+            maxx = z;
+        }
+        x += glyph->advance;
+
+        /* Some fonts descend below font height (FletcherGothicFLF) */
+        yshift = stack->ascent - font->ascent;
+        bottom = yshift + font->ascent - glyph->miny;
+        if ( font->outline > 0 ) {
+            bottom += font->outline * 2;
+            if ( outline_delta < font->outline * 2 ) {
+                outline_delta = font->outline * 2;
+            }
+        }
+        if ( bottom > height ) {
+            height = bottom;
+        }
+        prev_index = glyph->index;
+        prev_font = index;
+    }
+
+    /* Make room for the underline of any font used */
+    for ( i = 0; i < stack->numfonts; ++i ) {
+        font = stack->fonts[i];
+        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+            bottom = stack->ascent - font->ascent + TTF_underline_bottom_row(font);
+            if ( bottom > height ) {
+                height = bottom;
+            }
+        }
+    }
+
+    if ( numglyphs ) {
+        *numglyphs = count;
+    }
+    if ( w ) {
+        *w = (maxx - minx) + outline_delta;
+    }
+    if ( h ) {
+        *h = height;
+    }
+    return 0;
+}
+
+int TTF_SizeUTF8_Stack( TTF_FontStack *stack, const char *text, int *w, int *h )
+{
+    TTF_CHECKPOINTER(stack, -1);
+    TTF_CHECKPOINTER(text, -1);
+
+    return TTF_LayoutStack( stack, text, CACHED_METRICS, NULL, NULL, w, h );
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Stack( TTF_FontStack *stack, const char *text, Uint32 fg )
+{
+    return TTF_RenderUTF8_Blended_Stack_Format(stack, text, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Stack_Format( TTF_FontStack *stack,
+                const char *text, Uint32 fg, int format )
+{
+    TTF_StackGlyph *glyphs;
+    TTF_Context **pinned;
+    int numglyphs, numpinned;
+    int xstart;
+    int width, height;
+    Uint8 *textbuf = NULL;
+    Uint8 *dst_check;
+    TTF_PixelLUT lut;
+    int i, row;
+
+    TTF_CHECKPOINTER(stack, NULL);
+    TTF_CHECKPOINTER(text, NULL);
+
+    if ( stack->numfonts == 0 ) {
+        TTF_SetError( "Font stack is empty" );
+        return NULL;
+    }
+    if ( TTF_initPixelLUT(&lut, format, fg) < 0 ) {
+        return NULL;
+    }
+
+    glyphs = (TTF_StackGlyph *)malloc( (strlen(text) + 1) * sizeof(*glyphs) +
+                                       stack->numfonts * sizeof(*pinned) );
+    if ( glyphs == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    pinned = (TTF_Context **)(glyphs + strlen(text) + 1);
+
+    /* Glyphs found now must stay cached until drawn */
+    for ( numpinned = 0; numpinned < stack->numfonts; ++numpinned ) {
+        TTF_Context *ctx = TTF_GetContext( stack->fonts[numpinned] );
+
+        if ( ctx == NULL ) {
+            goto done;
+        }
+        ++ctx->cache_pins;
+        pinned[numpinned] = ctx;
+    }
+
+    if ( TTF_LayoutStack( stack, text, CACHED_METRICS|CACHED_PIXMAP,
+                          glyphs, &numglyphs, &width, &height ) < 0 ) {
+        goto done;
+    }
+    if ( !width ) {
+        TTF_SetError("Text has zero width");
+        goto done;
+    }
+
+    /* Compensate for the wrap around bug with negative minx's, as
+       TTF_RenderUTF8_Blended() does */
+    xstart = 0;
+    if ( glyphs[0].glyph->minx < 0 ) {
+        xstart = -glyphs[0].glyph->minx;
+    }
+
+    textbuf = TTF_CreateRGBSurface(width, height, lut.depth, 0, 0, 0, 0);
+    if ( textbuf == NULL ) {
+        goto done;
+    }
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+    TTF_FillRect(textbuf, lut.pixel[0]);
+
+    for ( i = 0; i < numglyphs; ++i ) {
+        const TTF_StackGlyph *placed = &glyphs[i];
+        const TTF_Font *font = stack->fonts[placed->font];
+        const c_glyph *glyph = placed->glyph;
+        int yoffset = stack->ascent - font->ascent + glyph->yoffset;
+        int glyph_width;
+
+        /* Ensure the width of the pixmap is correct. On some cases,
+         * freetype may report a larger pixmap than possible.*/
+        glyph_width = glyph->pixmap.width;
+        if ( font->outline <= 0 && glyph_width > glyph->maxx - glyph->minx ) {
+            glyph_width = glyph->maxx - glyph->minx;
+        }
+        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+            Uint8 *dst;
+            const Uint8 *src;
+
+            if ( row + yoffset < 0 || row + yoffset >= fn_h(textbuf) ) {
+                continue;
+            }
+            dst = (Uint8*) (textbuf + 8) +
+                (row + yoffset) * fn_p(textbuf) +
+                (xstart + placed->x + glyph->minx) * (lut.depth / 8);
+            src = (Uint8*) (glyph->pixmap.buffer + glyph->pixmap.pitch * row);
+            TTF_blendRow(&lut, dst, dst_check, src, glyph_width);
+        }
+    }
+
+    /* Underline and strike through each run of one font, the first and
+       last runs reaching the edges of the surface like a single font */
+    for ( i = 0; i < numglyphs; ) {
+        TTF_Font *font = stack->fonts[glyphs[i].font];
+        int yshift = stack->ascent - font->ascent;
+        int x0 = (i == 0) ? 0 : xstart + glyphs[i].x;
+        int x1;
+        int j;
+
+        for ( j = i + 1; j < numglyphs && glyphs[j].font == glyphs[i].font; ++j ) {
+            continue;
+        }
+        x1 = (j == numglyphs) ? width : xstart + glyphs[j].x;
+
+        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+            TTF_drawLineSpan_LUT(font, textbuf, yshift + TTF_underline_top_row(font), x0, x1 - x0, &lut);
+        }
+        if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+            TTF_drawLineSpan_LUT(font, textbuf, yshift + TTF_strikethrough_top_row(font), x0, x1 - x0, &lut);
+        }
+        i = j;
+    }
+
+done:
+    for ( i = 0; i < numpinned; ++i ) {
+        --pinned[i]->cache_pins;
+    }
+    free( glyphs );
+    return textbuf;
+}
+
+/* Rich text: spans of a line with their own font, style and color, laid
+   out in one pass on the highest baseline among their fonts.  The bold
+   and italic parts are drawn with style variants of their font.
+*/
+#define RICH_LUTS 8
+
+typedef struct {
+    c_glyph *glyph;
+    TTF_Font *font;     /* the variant drawing it */
+    int span;           /* or -1 outside the spans */
+    int x;
+} TTF_RichGlyph;
+
+static TTF_Font *TTF_RootFont( TTF_Font *font )
+{
+    return font->base ? font->base : font;
+}
+
+/* Find the glyphs of the text in the fonts of its spans and place them
+   on one line, filling 'glyphs' if not NULL, and get the bounding box the
+   way TTF_SizeUTF8() does.  The glyphs are placed from x = 0, so they are
+   drawn at x - *minx.  The contexts of the fonts are pinned as they are
+   first used, and added to 'pinned' for the caller to unpin, if given.
+*/
+static int TTF_LayoutRich( TTF_Font *font, const char *text,
+                           const TTF_TextSpan *spans, int numspans, int want,
+                           TTF_RichGlyph *glyphs, int *numglyphs,
+                           TTF_Context **pinned, int *numpinned,
+                           int *pminx, int *pascent, int *w, int *h )
+{
+    const char *start = text;
+    TTF_Context *ctx = NULL;
+    TTF_Font *current = NULL;
+    TTF_Font *spanfont = NULL;
+    int spanstyle = 0;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_UInt prev_index = 0;
+    int x, z;
+    int minx, maxx;
+    int ascent, below;
+    int outline_delta;
+    int count = 0;
+    int span = 0;
+    int prev_span = -2;
+    size_t textlen;
+    int i;
+
+    minx = maxx = 0;
+    ascent = 0;
+    below = 0;
+    outline_delta = 0;
+
+    textlen = strlen(text);
+    x = 0;
+    while ( textlen > 0 ) {
+        size_t offset = (size_t)(text - start);
+        Uint16 c = UTF8_getch(&text, &textlen);
+        int index;
+        int style;
+
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        /* Find the span holding the character */
+        while ( span < numspans && offset >= spans[span].start + spans[span].length ) {
+            ++span;
+        }
+        index = (span < numspans && offset >= spans[span].start) ? span : -1;
+
+        if ( index != prev_span ) {
+            TTF_Font *next;
+
+            spanfont = font;
+            spanstyle = font->style;
+            if ( index >= 0 ) {
+                if ( spans[index].font ) {
+                    spanfont = spans[index].font;
+                }
+                spanstyle = spans[index].style;
+            }
+            next = TTF_StyleVariant( spanfont, spanstyle );
+            if ( next == NULL ) {
+                return -1;
+            }
+            if ( next != current ) {
+                ctx = TTF_GetContext( next );
+                if ( ctx == NULL ) {
+                    return -1;
+                }
+                if ( pinned ) {
+                    for ( i = 0; i < *numpinned && pinned[i] != ctx; ++i ) {
+                        continue;
+                    }
+                    if ( i == *numpinned ) {
+                        ++ctx->cache_pins;
+                        pinned[(*numpinned)++] = ctx;
+                    }
+                }
+                /* Kerning carries across spans drawn from one face at one size */
+                if ( current == NULL || TTF_RootFont( current ) != TTF_RootFont( next ) ||
+                     TTF_sizeKey( current ) != TTF_sizeKey( next ) ) {
+                    prev_index = 0;
+                }
+                current = next;
+            }
+            prev_span = index;
+        }
+
+        error = Find_Glyph(ctx, c, want, &glyph);
+        if ( error ) {
+            TTF_SetFTError("Couldn't find glyph", error);
+            return -1;
+        }
+
+        if ( spanfont->kerning && FT_HAS_KERNING( current->face ) && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            x += delta.x >> 6;
+        }
+
+        if ( glyphs ) {
+            glyphs[count].glyph = glyph;
+            glyphs[count].font = current;
+            glyphs[count].span = index;
+            glyphs[count].x = x;
+        }
+        ++count;
+
+        z = x + glyph->minx;
+        if ( minx > z ) {
+            minx = z;
+        }
+        if ( TTF_HANDLE_STYLE_BOLD(current) ) {
+            x += current->glyph_overhang;
+        }
+        if ( glyph->advance > glyph->maxx ) {
+            z = x + glyph->advance;
+        } else {
+            z = x + glyph->maxx;
+        }
+        if ( maxx < z ) {
+            maxx = z;
+        }
+        x += glyph->advance;
+
+        /* Keep what reaches lowest below the common baseline, found last */
+        if ( ascent < current->ascent ) {
+            ascent = current->ascent;
+        }
+        z = -glyph->miny;
+        if ( current->outline > 0 ) {
+            z += current->outline * 2;
+            if ( outline_delta < current->outline * 2 ) {
+                outline_delta = current->outline * 2;
+            }
+        }
+        if ( below < z ) {
+            below = z;
+        }
+        z = current->height - current->ascent;
+        if ( below < z ) {
+            below = z;
+        }
+        style = (index >= 0) ? spans[index].style : font->style;
+        if ( style & TTF_STYLE_UNDERLINE ) {
+            z = TTF_underline_bottom_row(current) - current->ascent;
+            if ( below < z ) {
+                below = z;
+            }
+        }
+        prev_index = glyph->index;
+    }
+
+    if ( numglyphs ) {
+        *numglyphs = count;
+    }
+    if ( pminx ) {
+        *pminx = minx;
+    }
+    if ( pascent ) {
+        *pascent = ascent;
+    }
+    if ( w ) {
+        *w = (maxx - minx) + outline_delta;
+    }
+    if ( h ) {
+        *h = ascent + below;
+    }
+    return 0;
+}
+
+int TTF_SizeUTF8_Rich( TTF_Font *font, const char *text,
+                       const TTF_TextSpan *spans, int numspans, int *w, int *h )
+{
+    TTF_CHECKPOINTER(font, -1);
+    TTF_CHECKPOINTER(text, -1);
+    if ( numspans > 0 ) {
+        TTF_CHECKPOINTER(spans, -1);
+    } else {
+        numspans = 0;
+    }
+
+    return TTF_LayoutRich( font, text, spans, numspans, CACHED_METRICS,
+                           NULL, NULL, NULL, NULL, NULL, NULL, w, h );
+}
+
+/* Get the table of a span color, keeping the last few built */
+static const TTF_PixelLUT *TTF_RichLUT( TTF_PixelLUT *luts, Uint32 *colors, int *numluts,
+                                        Uint32 color, int format )
+{
+    TTF_PixelLUT *lut;
+    int i;
+
+    for ( i = 0; i < *numluts && i < RICH_LUTS; ++i ) {
+        if ( colors[i] == color ) {
+            return &luts[i];
+        }
+    }
+    i = (*numluts)++ % RICH_LUTS;
+    lut = &luts[i];
+    if ( TTF_initPixelLUT( lut, format, color ) < 0 ) {
+        return NULL;
+    }
+    colors[i] = color;
+    return lut;
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Rich( TTF_Font *font, const char *text,
+                const TTF_TextSpan *spans, int numspans, Uint32 fg )
+{
+    return TTF_RenderUTF8_Blended_Rich_Format(font, text, spans, numspans, fg, TTF_PIXELFORMAT_ARGB8888);
+}
+
+Uint8 *TTF_RenderUTF8_Blended_Rich_Format( TTF_Font *font, const char *text,
+                const TTF_TextSpan *spans, int numspans, Uint32 fg, int format )
+{
+    TTF_RichGlyph *glyphs = NULL;
+    TTF_Context **pinned = NULL;
+    TTF_PixelLUT *luts = NULL;
+    Uint32 colors[RICH_LUTS];
+    int numluts = 0;
+    int numpinned = 0;
+    int numglyphs;
+    int minx, ascent;
+    int width, height;
+    Uint8 *textbuf = NULL;
+    Uint8 *dst_check;
+    const TTF_PixelLUT *lut;
+    int i, row;
+
+    TTF_CHECKPOINTER(font, NULL);
+    TTF_CHECKPOINTER(text, NULL);
+    if ( numspans > 0 ) {
+        TTF_CHECKPOINTER(spans, NULL);
+    } else {
+        numspans = 0;
+    }
+
+    glyphs = (TTF_RichGlyph *)malloc( (strlen(text) + 1) * sizeof(*glyphs) );
+    pinned = (TTF_Context **)malloc( (numspans + 1) * sizeof(*pinned) );
+    luts = (TTF_PixelLUT *)malloc( RICH_LUTS * sizeof(*luts) );
+    if ( glyphs == NULL || pinned == NULL || luts == NULL ) {
+        TTF_OutOfMemory();
+        goto done;
+    }
+    lut = TTF_RichLUT( luts, colors, &numluts, fg, format );
+    if ( lut == NULL ) {
+        goto done;
+    }
+
+    if ( TTF_LayoutRich( font, text, spans, numspans, CACHED_METRICS|CACHED_PIXMAP,
+                         glyphs, &numglyphs, pinned, &numpinned,
+                         &minx, &ascent, &width, &height ) < 0 ) {
+        goto done;
+    }
+    if ( !width ) {
+        TTF_SetError("Text has zero width");
+        goto done;
+    }
+
+    textbuf = TTF_CreateRGBSurface(width, height, lut->depth, 0, 0, 0, 0);
+    if ( textbuf == NULL ) {
+        goto done;
+    }
+    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+    TTF_FillRect(textbuf, lut->pixel[0]);
+
+    for ( i = 0; i < numglyphs; ++i ) {
+        const TTF_RichGlyph *placed = &glyphs[i];
+        const TTF_Font *drawn = placed->font;
+        const c_glyph *glyph = placed->glyph;
+        int yoffset = ascent - drawn->ascent + glyph->yoffset;
+        int glyph_width;
+
+        if ( i == 0 || placed->span != glyphs[i-1].span ) {
+            lut = TTF_RichLUT( luts, colors, &numluts,
+                               placed->span >= 0 ? spans[placed->span].color : fg, format );
+        }
+
+        /* Ensure the width of the pixmap is correct. On some cases,
+         * freetype may report a larger pixmap than possible.*/
+        glyph_width = glyph->pixmap.width;
+        if ( drawn->outline <= 0 && glyph_width > glyph->maxx - glyph->minx ) {
+            glyph_width = glyph->maxx - glyph->minx;
+        }
+        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+            Uint8 *dst;
+            const Uint8 *src;
+
+            if ( row + yoffset < 0 || row + yoffset >= fn_h(textbuf) ) {
+                continue;
+            }
+            dst = (Uint8*) (textbuf + 8) +
+                (row + yoffset) * fn_p(textbuf) +
+                (placed->x - minx + glyph->minx) * (lut->depth / 8);
+            src = (Uint8*) (glyph->pixmap.buffer + glyph->pixmap.pitch * row);
+            TTF_blendRow(lut, dst, dst_check, src, glyph_width);
+        }
+    }
+
+    /* Underline and strike through each span in its color, the first and
+       last reaching the edges of the surface like a single span */
+    for ( i = 0; i < numglyphs; ) {
+        TTF_Font *drawn = glyphs[i].font;
+        int index = glyphs[i].span;
+        int style = (index >= 0) ? spans[index].style : font->style;
+        int yshift = ascent - drawn->ascent;
+        int x0 = (i == 0) ? 0 : glyphs[i].x - minx;
+        int x1;
+        int j;
+
+        for ( j = i + 1; j < numglyphs && glyphs[j].span == index; ++j ) {
+            continue;
+        }
+        x1 = (j == numglyphs) ? width : glyphs[j].x - minx;
+
+        if ( style & (TTF_STYLE_UNDERLINE | TTF_STYLE_STRIKETHROUGH) ) {
+            lut = TTF_RichLUT( luts, colors, &numluts,
+                               index >= 0 ? spans[index].color : fg, format );
+            if ( style & TTF_STYLE_UNDERLINE ) {
+                TTF_drawLineSpan_LUT(drawn, textbuf, yshift + TTF_underline_top_row(drawn), x0, x1 - x0, lut);
+            }
+            if ( style & TTF_STYLE_STRIKETHROUGH ) {
+                TTF_drawLineSpan_LUT(drawn, textbuf, yshift + TTF_strikethrough_top_row(drawn), x0, x1 - x0, lut);
+            }
+        }
+        i = j;
+    }
+
+done:
+    for ( i = 0; i < numpinned; ++i ) {
+        --pinned[i]->cache_pins;
+    }
+    free( luts );
+    free( pinned );
+    free( glyphs );
+    return textbuf;
+}
+
+/* Font directory index.  Files are scanned by tasks on the render
+   threads, each with its own FreeType library so that faces open in
+   parallel, and only the metadata and character ranges of each face are
+   kept.  The cache file lists every file seen, fonts or not, with its
+   modification time and size.
+*/
+#define INDEX_CACHE_MAGIC   "UTTFIDX1"
+
+typedef struct {
+    Uint16 first;
+    Uint16 last;
+} TTF_CharRange;
+
+typedef struct {
+    TTF_FontInfo info;
+    int numranges;
+    TTF_CharRange *ranges;
+} TTF_IndexedFace;
+
+typedef struct {
+    char *path;
+    Sint64 mtime;
+    Sint64 size;
+    int numfaces;
+    TTF_IndexedFace *faces;
+    int scanned;                /* read from the file, not the cache */
+} TTF_IndexedFile;
+
+struct _TTF_FontIndex {
+    TTF_IndexedFile *files;
+    int numfiles;
+    TTF_IndexedFace **faces;
+    int numfaces;
+};
+
+typedef struct {
+    TTF_IndexedFile *files;
+    int numfiles;
+    int next;
+} TTF_IndexScan;
+
+static void TTF_FreeIndexedFile( TTF_IndexedFile *file )
+{
+    int i;
+
+    for ( i = 0; i < file->numfaces; ++i ) {
+        free( (char *)file->faces[i].info.family );
+        free( (char *)file->faces[i].info.style );
+        free( file->faces[i].ranges );
+    }
+    free( file->faces );
+    free( file->path );
+    file->faces = NULL;
+    file->numfaces = 0;
+}
+
+/* Read the metadata and character ranges of one face */
+static int TTF_ScanFace( FT_Face face, TTF_IndexedFace *indexed )
+{
+    TTF_CharRange *ranges = NULL;
+    int numranges = 0;
+    int maxranges = 0;
+    FT_ULong ch;
+    FT_UInt index;
+
+    TTF_selectCharmap( face );
+    ch = FT_Get_First_Char( face, &index );
+    while ( index != 0 && ch < 0x10000 ) {
+        if ( numranges > 0 && ranges[numranges - 1].last + 1 == ch ) {
+            ranges[numranges - 1].last = (Uint16)ch;
+        } else {
+            if ( numranges == maxranges ) {
+                TTF_CharRange *grown;
+
+                maxranges = maxranges ? maxranges * 2 : 64;
+                grown = (TTF_CharRange *)realloc( ranges, maxranges * sizeof(*ranges) );
+                if ( grown == NULL ) {
+                    free( ranges );
+                    return -1;
+                }
+                ranges = grown;
+            }
+            ranges[numranges].first = (Uint16)ch;
+            ranges[numranges].last = (Uint16)ch;
+            ++numranges;
+        }
+        ch = FT_Get_Next_Char( face, ch, &index );
+    }
+
+    indexed->info.faces = face->num_faces;
+    indexed->info.family = TTF_strdup( face->family_name );
+    indexed->info.style = TTF_strdup( face->style_name );
+    indexed->info.fixed_width = FT_IS_FIXED_WIDTH(face) ? 1 : 0;
+    indexed->info.scalable = FT_IS_SCALABLE(face) ? 1 : 0;
+    indexed->info.face_style = TTF_STYLE_NORMAL;
+    if ( face->style_flags & FT_STYLE_FLAG_BOLD ) {
+        indexed->info.face_style |= TTF_STYLE_BOLD;
+    }
+    if ( face->style_flags & FT_STYLE_FLAG_ITALIC ) {
+        indexed->info.face_style |= TTF_STYLE_ITALIC;
+    }
+    indexed->numranges = numranges;
+    indexed->ranges = ranges;
+    return 0;
+}
+
+/* Open every face of a file in turn; files FreeType can't read have none */
+static void TTF_ScanFile( FT_Library lib, TTF_IndexedFile *file )
+{
+    FT_Face face;
+    long i;
+
+    file->scanned = 1;
+    for ( i = 0; i == 0 || i < file->numfaces; ++i ) {
+        if ( FT_New_Face( lib, file->path, i, &face ) ) {
+            break;
+        }
+        if ( i == 0 && face->num_faces > 0 ) {
+            file->faces = (TTF_IndexedFace *)calloc( face->num_faces, sizeof(*file->faces) );
+            if ( file->faces ) {
+                file->numfaces = (int)face->num_faces;
+            }
+        }
+        if ( i < file->numfaces ) {
+            file->faces[i].info.file = file->path;
+            file->faces[i].info.index = i;
+            if ( TTF_ScanFace( face, &file->faces[i] ) < 0 ) {
+                file->numfaces = (int)i;
+            }
+        }
+        FT_Done_Face( face );
+    }
+    if ( i < file->numfaces ) {
+        file->numfaces = (int)i;
+    }
+}
+
+static void TTF_RunIndexScan( void *data )
+{
+    TTF_IndexScan *scan = (TTF_IndexScan *)data;
+    FT_Library lib;
+    int i;
+
+    if ( FT_Init_FreeType( &lib ) ) {
+        return;
+    }
+    while ( (i = __atomic_fetch_add( &scan->next, 1, __ATOMIC_RELAXED )) < scan->numfiles ) {
+        if ( !scan->files[i].scanned ) {
+            TTF_ScanFile( lib, &scan->files[i] );
+        }
+    }
+    FT_Done_FreeType( lib );
+}
+
+static void *TTF_IndexScanThread( void *data )
+{
+    TTF_RunIndexScan( data );
+    return NULL;
+}
+
+/* Threads started for a scan without render threads, at most */
+#define INDEX_SCAN_THREADS 8
+
+/* Scan the files not found in the cache, spread over the render threads,
+   or over threads started for the scan when there are none */
+static void TTF_ScanFiles( TTF_IndexedFile *files, int numfiles )
+{
+    TTF_IndexScan scan = { files, numfiles, 0 };
+    TTF_TaskGroup group = { 0 };
+    TTF_Task *tasks = NULL;
+    pthread_t threads[INDEX_SCAN_THREADS];
+    int nthreads = 0;
+    int ntasks = TTF_pool.nworkers;
+    int i;
+
+    if ( ntasks > numfiles - 1 ) {
+        ntasks = numfiles - 1;
+    }
+    if ( ntasks > 0 ) {
+        tasks = (TTF_Task *)malloc( ntasks * sizeof(*tasks) );
+    }
+    if ( tasks ) {
+        for ( i = 0; i < ntasks; ++i ) {
+            tasks[i].run = TTF_RunIndexScan;
+            tasks[i].data = &scan;
+        }
+        TTF_SubmitTasks( tasks, ntasks, &group );
+    } else if ( TTF_pool.nworkers == 0 ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+        nthreads = (cpus > 1) ? (int)cpus - 1 : 0;
+        if ( nthreads > INDEX_SCAN_THREADS ) {
+            nthreads = INDEX_SCAN_THREADS;
+        }
+        if ( nthreads > numfiles - 1 ) {
+            nthreads = numfiles - 1;
+        }
+        for ( i = 0; i < nthreads; ++i ) {
+            if ( pthread_create( &threads[i], NULL, TTF_IndexScanThread, &scan ) != 0 ) {
+                break;
+            }
+        }
+        nthreads = i;
+    }
+    TTF_RunIndexScan( &scan );
+    if ( tasks ) {
+        TTF_WaitTasks( &group );
+        free( tasks );
+    }
+    for ( i = 0; i < nthreads; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+}
+
+/* Only files named like fonts FreeType reads are opened */
+static int TTF_IsFontFile( const char *name )
+{
+    static const char *extensions[] = {
+        ".ttf", ".otf", ".ttc", ".otc", ".fon", ".fnt", ".pfa", ".pfb",
+        ".pcf", ".pcf.gz", ".bdf", ".woff", ".woff2", ".dfont"
+    };
+    size_t len = strlen( name );
+    size_t i;
+
+    for ( i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i ) {
+        size_t extlen = strlen( extensions[i] );
+
+        if ( len > extlen && strcasecmp( name + len - extlen, extensions[i] ) == 0 ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Collect the font files below a directory, without following links
+   to directories.  Subdirectories that can't be read are skipped.
+*/
+static int TTF_ListFonts( const char *dir, int top, TTF_IndexedFile **files, int *numfiles, int *maxfiles )
+{
+    DIR *d;
+    struct dirent *entry;
+    struct stat st;
+    char *path;
+    int status = 0;
+
+    d = opendir( dir );
+    if ( d == NULL ) {
+        if ( top ) {
+            TTF_SetError( "Couldn't open directory '%s'", dir );
+            return -1;
+        }
+        return 0;
+    }
+    while ( status == 0 && (entry = readdir( d )) != NULL ) {
+        if ( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) {
+            continue;
+        }
+        path = (char *)malloc( strlen(dir) + strlen(entry->d_name) + 2 );
+        if ( path == NULL ) {
+            TTF_OutOfMemory();
+            status = -1;
+            break;
+        }
+        sprintf( path, "%s/%s", dir, entry->d_name );
+        if ( lstat( path, &st ) == 0 && S_ISDIR( st.st_mode ) ) {
+            status = TTF_ListFonts( path, 0, files, numfiles, maxfiles );
+            free( path );
+            continue;
+        }
+        if ( !TTF_IsFontFile( entry->d_name ) ||
+             stat( path, &st ) < 0 || !S_ISREG( st.st_mode ) ) {
+            free( path );
+            continue;
+        }
+        if ( *numfiles == *maxfiles ) {
+            TTF_IndexedFile *grown;
+
+            *maxfiles = *maxfiles ? *maxfiles * 2 : 64;
+            grown = (TTF_IndexedFile *)realloc( *files, *maxfiles * sizeof(**files) );
+            if ( grown == NULL ) {
+                TTF_OutOfMemory();
+                free( path );
+                status = -1;
+                break;
+            }
+            *files = grown;
+        }
+        memset( &(*files)[*numfiles], 0, sizeof(**files) );
+        (*files)[*numfiles].path = path;
+        (*files)[*numfiles].mtime = (Sint64)st.st_mtime;
+        (*files)[*numfiles].size = (Sint64)st.st_size;
+        ++*numfiles;
+    }
+    closedir( d );
+    return status;
+}
+
+static int TTF_CompareFiles( const void *a, const void *b )
+{
+    return strcmp( ((const TTF_IndexedFile *)a)->path, ((const TTF_IndexedFile *)b)->path );
+}
+
+/* The cache file is little endian: the magic, the number of files, and
+   for each file its path, mtime, size and faces.  A face is its index,
+   the number of faces in the file, family and style names, a byte of
+   flags and its character ranges.  Strings are a 16-bit length and the
+   bytes, 0xFFFF for none.
+*/
+#define INDEX_FIXED_WIDTH   0x01
+#define INDEX_SCALABLE      0x02
+#define INDEX_BOLD          0x04
+#define INDEX_ITALIC        0x08
+
+static void TTF_WriteLE( FILE *fp, Uint64 value, int bytes )
+{
+    while ( bytes-- > 0 ) {
+        fputc( (int)(value & 0xFF), fp );
+        value >>= 8;
+    }
+}
+
+static void TTF_WriteString( FILE *fp, const char *str )
+{
+    size_t len = str ? strlen(str) : 0;
+
+    if ( str == NULL || len >= 0xFFFF ) {
+        TTF_WriteLE( fp, 0xFFFF, 2 );
+        return;
+    }
+    TTF_WriteLE( fp, len, 2 );
+    fwrite( str, 1, len, fp );
+}
+
+static int TTF_ReadLE( FILE *fp, Uint64 *value, int bytes )
+{
+    int shift;
+    int c;
+
+    *value = 0;
+    for ( shift = 0; shift < bytes * 8; shift += 8 ) {
+        c = fgetc( fp );
+        if ( c == EOF ) {
+            return -1;
+        }
+        *value |= (Uint64)c << shift;
+    }
+    return 0;
+}
+
+static int TTF_ReadString( FILE *fp, const char **str )
+{
+    Uint64 len;
+    char *buf;
+
+    *str = NULL;
+    if ( TTF_ReadLE( fp, &len, 2 ) < 0 ) {
+        return -1;
+    }
+    if ( len == 0xFFFF ) {
+        return 0;
+    }
+    buf = (char *)malloc( (size_t)len + 1 );
+    if ( buf == NULL ) {
+        return -1;
+    }
+    if ( fread( buf, 1, (size_t)len, fp ) != (size_t)len ) {
+        free( buf );
+        return -1;
+    }
+    buf[len] = '\0';
+    *str = buf;
+    return 0;
+}
+
+static int TTF_WriteIndexCache( const char *cachefile, const TTF_IndexedFile *files, int numfiles )
+{
+    char *temp;
+    FILE *fp;
+    int i, j, k;
+    int status;
+
+    /* Write a new file and move it in place, so readers never see half */
+    temp = (char *)malloc( strlen(cachefile) + 5 );
+    if ( temp == NULL ) {
+        TTF_OutOfMemory();
+        return -1;
+    }
+    sprintf( temp, "%s.tmp", cachefile );
+    fp = fopen( temp, "wb" );
+    if ( fp == NULL ) {
+        TTF_SetError( "Couldn't write '%s'", temp );
+        free( temp );
+        return -1;
+    }
+
+    fwrite( INDEX_CACHE_MAGIC, 1, 8, fp );
+    TTF_WriteLE( fp, (Uint64)numfiles, 4 );
+    for ( i = 0; i < numfiles; ++i ) {
+        const TTF_IndexedFile *file = &files[i];
+
+        TTF_WriteString( fp, file->path );
+        TTF_WriteLE( fp, (Uint64)file->mtime, 8 );
+        TTF_WriteLE( fp, (Uint64)file->size, 8 );
+        TTF_WriteLE( fp, (Uint64)file->numfaces, 4 );
+        for ( j = 0; j < file->numfaces; ++j ) {
+            const TTF_IndexedFace *face = &file->faces[j];
+            int flags = 0;
+
+            if ( face->info.fixed_width ) {
+                flags |= INDEX_FIXED_WIDTH;
+            }
+            if ( face->info.scalable ) {
+                flags |= INDEX_SCALABLE;
+            }
+            if ( face->info.face_style & TTF_STYLE_BOLD ) {
+                flags |= INDEX_BOLD;
+            }
+            if ( face->info.face_style & TTF_STYLE_ITALIC ) {
+                flags |= INDEX_ITALIC;
+            }
+            TTF_WriteLE( fp, (Uint64)face->info.index, 4 );
+            TTF_WriteLE( fp, (Uint64)face->info.faces, 4 );
+            TTF_WriteString( fp, face->info.family );
+            TTF_WriteString( fp, face->info.style );
+            TTF_WriteLE( fp, (Uint64)flags, 1 );
+            TTF_WriteLE( fp, (Uint64)face->numranges, 4 );
+            for ( k = 0; k < face->numranges; ++k ) {
+                TTF_WriteLE( fp, face->ranges[k].first, 2 );
+                TTF_WriteLE( fp, face->ranges[k].last, 2 );
+            }
+        }
+    }
+
+    status = ferror( fp ) ? -1 : 0;
+    if ( fclose( fp ) != 0 ) {
+        status = -1;
+    }
+    if ( status == 0 && rename( temp, cachefile ) < 0 ) {
+        status = -1;
+    }
+    if ( status < 0 ) {
+        TTF_SetError( "Couldn't write '%s'", cachefile );
+        remove( temp );
+    }
+    free( temp );
+    return status;
+}
+
+/* Read one file's entry from the cache */
+static int TTF_ReadIndexedFile( FILE *fp, TTF_IndexedFile *file )
+{
+    Uint64 value;
+    const char *path;
+    int j, k;
+
+    memset( file, 0, sizeof(*file) );
+    if ( TTF_ReadString( fp, &path ) < 0 || path == NULL ) {
+        return -1;
+    }
+    file->path = (char *)path;
+    if ( TTF_ReadLE( fp, &value, 8 ) < 0 ) {
+        return -1;
+    }
+    file->mtime = (Sint64)value;
+    if ( TTF_ReadLE( fp, &value, 8 ) < 0 ) {
+        return -1;
+    }
+    file->size = (Sint64)value;
+    if ( TTF_ReadLE( fp, &value, 4 ) < 0 || value > 0xFFFF ) {
+        return -1;
+    }
+    if ( value == 0 ) {
+        return 0;
+    }
+    file->faces = (TTF_IndexedFace *)calloc( (size_t)value, sizeof(*file->faces) );
+    if ( file->faces == NULL ) {
+        return -1;
+    }
+    for ( j = 0; j < (int)value; ++j ) {
+        TTF_IndexedFace *face = &file->faces[j];
+        Uint64 index, faces, flags, numranges;
+
+        file->numfaces = j + 1;
+        face->info.file = file->path;
+        if ( TTF_ReadLE( fp, &index, 4 ) < 0 ||
+             TTF_ReadLE( fp, &faces, 4 ) < 0 ||
+             TTF_ReadString( fp, &face->info.family ) < 0 ||
+             TTF_ReadString( fp, &face->info.style ) < 0 ||
+             TTF_ReadLE( fp, &flags, 1 ) < 0 ||
+             TTF_ReadLE( fp, &numranges, 4 ) < 0 || numranges > 0x10000 ) {
+            return -1;
+        }
+        face->info.index = (long)index;
+        face->info.faces = (long)faces;
+        face->info.fixed_width = (flags & INDEX_FIXED_WIDTH) ? 1 : 0;
+        face->info.scalable = (flags & INDEX_SCALABLE) ? 1 : 0;
+        face->info.face_style = TTF_STYLE_NORMAL;
+        if ( flags & INDEX_BOLD ) {
+            face->info.face_style |= TTF_STYLE_BOLD;
+        }
+        if ( flags & INDEX_ITALIC ) {
+            face->info.face_style |= TTF_STYLE_ITALIC;
+        }
+        if ( numranges > 0 ) {
+            face->ranges = (TTF_CharRange *)malloc( (size_t)numranges * sizeof(*face->ranges) );
+            if ( face->ranges == NULL ) {
+                return -1;
+            }
+        }
+        face->numranges = (int)numranges;
+        for ( k = 0; k < face->numranges; ++k ) {
+            Uint64 first, last;
+
+            if ( TTF_ReadLE( fp, &first, 2 ) < 0 || TTF_ReadLE( fp, &last, 2 ) < 0 ) {
+                return -1;
+            }
+            face->ranges[k].first = (Uint16)first;
+            face->ranges[k].last = (Uint16)last;
+        }
+    }
+    return 0;
+}
+
+/* Read the cache, sorted by path, or nothing if it's missing or damaged */
+static void TTF_ReadIndexCache( const char *cachefile, TTF_IndexedFile **files, int *numfiles )
+{
+    FILE *fp;
+    char magic[8];
+    Uint64 count;
+    int i;
+
+    *files = NULL;
+    *numfiles = 0;
+    fp = fopen( cachefile, "rb" );
+    if ( fp == NULL ) {
+        return;
+    }
+    if ( fread( magic, 1, 8, fp ) != 8 || memcmp( magic, INDEX_CACHE_MAGIC, 8 ) != 0 ||
+         TTF_ReadLE( fp, &count, 4 ) < 0 || count > 0x1000000 ) {
+        fclose( fp );
+        return;
+    }
+    *files = (TTF_IndexedFile *)calloc( (size_t)count + 1, sizeof(**files) );
+    if ( *files == NULL ) {
+        fclose( fp );
+        return;
+    }
+    for ( i = 0; i < (int)count; ++i ) {
+        if ( TTF_ReadIndexedFile( fp, &(*files)[i] ) < 0 ) {
+            TTF_Log( TTF_LOG_WARN, "Font index cache '%s' is damaged, rescanning", cachefile );
+            TTF_FreeIndexedFile( &(*files)[i] );
+            while ( i-- > 0 ) {
+                TTF_FreeIndexedFile( &(*files)[i] );
+            }
+            free( *files );
+            *files = NULL;
+            fclose( fp );
+            return;
+        }
+    }
+    fclose( fp );
+    *numfiles = (int)count;
+    qsort( *files, *numfiles, sizeof(**files), TTF_CompareFiles );
+}
+
+TTF_FontIndex *TTF_IndexFonts( const char *dir, const char *cachefile )
+{
+    TTF_FontIndex *index;
+    TTF_IndexedFile *files = NULL;
+    TTF_IndexedFile *cached = NULL;
+    int numfiles = 0;
+    int maxfiles = 0;
+    int numcached = 0;
+    int changed;
+    int i, j;
+
+    TTF_CHECKPOINTER(dir, NULL);
+
+    if ( TTF_ListFonts( dir, 1, &files, &numfiles, &maxfiles ) < 0 ) {
+        for ( i = 0; i < numfiles; ++i ) {
+            TTF_FreeIndexedFile( &files[i] );
+        }
+        free( files );
+        return NULL;
+    }
+    qsort( files, numfiles, sizeof(*files), TTF_CompareFiles );
+
+    /* Take what the cache has for files that are unchanged */
+    if ( cachefile ) {
+        TTF_ReadIndexCache( cachefile, &cached, &numcached );
+    }
+    changed = (numcached != numfiles);
+    for ( i = 0, j = 0; i < numfiles; ++i ) {
+        TTF_IndexedFile *file = &files[i];
+
+        while ( j < numcached && strcmp( cached[j].path, file->path ) < 0 ) {
+            ++j;
+        }
+        if ( j < numcached && strcmp( cached[j].path, file->path ) == 0 &&
+             cached[j].mtime == file->mtime && cached[j].size == file->size ) {
+            TTF_IndexedFile *hit = &cached[j];
+            int k;
+
+            file->numfaces = hit->numfaces;
+            file->faces = hit->faces;
+            for ( k = 0; k < file->numfaces; ++k ) {
+                file->faces[k].info.file = file->path;
+            }
+            hit->faces = NULL;
+            hit->numfaces = 0;
+            file->scanned = 1;
+        } else {
+            changed = 1;
+        }
+    }
+    for ( j = 0; j < numcached; ++j ) {
+        TTF_FreeIndexedFile( &cached[j] );
+    }
+    free( cached );
+
+    TTF_ScanFiles( files, numfiles );
+
+    if ( cachefile && changed ) {
+        /* The index is still good without its cache */
+        if ( TTF_WriteIndexCache( cachefile, files, numfiles ) < 0 ) {
+            TTF_Log( TTF_LOG_WARN, "%s", TTF_GetError() );
+        }
+    }
+
+    index = (TTF_FontIndex *)calloc( 1, sizeof(*index) );
+    if ( index == NULL ) {
+        TTF_OutOfMemory();
+        for ( i = 0; i < numfiles; ++i ) {
+            TTF_FreeIndexedFile( &files[i] );
+        }
+        free( files );
+        return NULL;
+    }
+    index->files = files;
+    index->numfiles = numfiles;
+    for ( i = 0; i < numfiles; ++i ) {
+        index->numfaces += files[i].numfaces;
+    }
+    index->faces = (TTF_IndexedFace **)malloc( (index->numfaces + 1) * sizeof(*index->faces) );
+    if ( index->faces == NULL ) {
+        TTF_OutOfMemory();
+        TTF_FreeFontIndex( index );
+        return NULL;
+    }
+    index->numfaces = 0;
+    for ( i = 0; i < numfiles; ++i ) {
+        for ( j = 0; j < files[i].numfaces; ++j ) {
+            index->faces[index->numfaces++] = &files[i].faces[j];
+        }
+    }
+    return index;
+}
+
+int TTF_FontIndexCount( const TTF_FontIndex *index )
+{
+    return index->numfaces;
+}
+
+const TTF_FontInfo *TTF_FontIndexInfo( const TTF_FontIndex *index, int i )
+{
+    if ( i < 0 || i >= index->numfaces ) {
+        TTF_SetError( "Font index out of range" );
+        return NULL;
+    }
+    return &index->faces[i]->info;
+}
+
+int TTF_FontIndexProvides( const TTF_FontIndex *index, int i, Uint16 ch )
+{
+    const TTF_IndexedFace *face;
+    int lo, hi;
+
+    if ( i < 0 || i >= index->numfaces ) {
+        return 0;
+    }
+    face = index->faces[i];
+    lo = 0;
+    hi = face->numranges - 1;
+    while ( lo <= hi ) {
+        int mid = (lo + hi) / 2;
+
+        if ( ch < face->ranges[mid].first ) {
+            hi = mid - 1;
+        } else if ( ch > face->ranges[mid].last ) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int TTF_FontIndexFind( const TTF_FontIndex *index, const char *family, const char *style )
+{
+    int i;
+
+    TTF_CHECKPOINTER(family, -1);
+
+    for ( i = 0; i < index->numfaces; ++i ) {
+        const TTF_FontInfo *info = &index->faces[i]->info;
+
+        if ( info->family && strcasecmp( info->family, family ) == 0 &&
+             (style == NULL || (info->style && strcasecmp( info->style, style ) == 0)) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+TTF_Font *TTF_OpenIndexedFont( const TTF_FontIndex *index, int i, int ptsize )
+{
+    const TTF_FontInfo *info = TTF_FontIndexInfo( index, i );
+
+    if ( info == NULL ) {
+        return NULL;
+    }
+    return TTF_OpenFontIndex( info->file, ptsize, info->index );
+}
+
+void TTF_FreeFontIndex( TTF_FontIndex *index )
+{
+    int i;
+
+    if ( index ) {
+        for ( i = 0; i < index->numfiles; ++i ) {
+            TTF_FreeIndexedFile( &index->files[i] );
+        }
+        free( index->files );
+        free( index->faces );
+        free( index );
+    }
+}
+
+/* Font manager.  Managed fonts stay allocated for as long as their
+   handle, with their style and glyph cache, but only the most recently
+   used ones keep a face open; the others are released and reopened from
+   their file when next acquired.
+*/
+struct _TTF_FontHandle {
+    TTF_FontManager *manager;
+    TTF_Font *font;
+    char *file;
+    int pins;
+    int open;
+    struct _TTF_FontHandle *prev;   /* open fonts, most recent first */
+    struct _TTF_FontHandle *next;
+    struct _TTF_FontHandle *next_handle;
+};
+
+struct _TTF_FontManager {
+    pthread_mutex_t lock;
+    int maxopen;
+    int numopen;
+    int evictions;
+    int reopens;
+    TTF_FontHandle *head;
+    TTF_FontHandle *tail;
+    TTF_FontHandle *handles;
+};
+
+/* Reopen the face of a font from its file after TTF_ReleaseFace() */
+static int TTF_ReopenFace( TTF_Font *font, const char *file )
+{
+    FT_Error error;
+    FILE *src;
+
+    src = fopen( file, "rb" );
+    if ( src == NULL ) {
+        TTF_SetError( "Cannot open file '%s'", file );
+        return -1;
+    }
+    if ( TTF_AttachSource( font, src, 1 ) < 0 ) {
+        TTF_ReleaseFace( font );
+        return -1;
+    }
+
+    pthread_mutex_lock( &TTF_library_lock );
+    error = FT_Open_Face( library, &font->args, font->face_index, &font->face );
+    pthread_mutex_unlock( &TTF_library_lock );
+    if ( !error ) {
+        error = TTF_initFace( font, font->face );
+    }
+    if ( error ) {
+        TTF_SetFTError( "Couldn't reopen font file", error );
+        TTF_ReleaseFace( font );
+        return -1;
+    }
+    if ( TTF_NewContext( font, font->face ) == NULL ) {
+        TTF_ReleaseFace( font );
+        return -1;
+    }
+    return 0;
+}
+
+/* The manager must be locked for the LRU helpers */
+static void TTF_UnlinkHandle( TTF_FontManager *manager, TTF_FontHandle *handle )
+{
+    if ( handle->prev ) {
+        handle->prev->next = handle->next;
+    } else {
+        manager->head = handle->next;
+    }
+    if ( handle->next ) {
+        handle->next->prev = handle->prev;
+    } else {
+        manager->tail = handle->prev;
+    }
+    handle->prev = handle->next = NULL;
+}
+
+static void TTF_PushHandle( TTF_FontManager *manager, TTF_FontHandle *handle )
+{
+    handle->prev = NULL;
+    handle->next = manager->head;
+    if ( manager->head ) {
+        manager->head->prev = handle;
+    } else {
+        manager->tail = handle;
+    }
+    manager->head = handle;
+}
+
+/* Whether sizes made of a font, other than its own style variants, still
+   use its face.  Those hold the font open like a pin. */
+static int TTF_HasSizes( TTF_Font *font )
+{
+    int sizes = __atomic_load_n( &font->sizes, __ATOMIC_RELAXED );
+    int i;
+
+    for ( i = 0; i < 4; ++i ) {
+        if ( font->variants[i] ) {
+            --sizes;
+        }
+    }
+    return sizes > 0;
+}
+
+/* Release the faces of the least recently used fonts nobody holds until
+   no more than the limit are open */
+static void TTF_EvictFonts( TTF_FontManager *manager )
+{
+    TTF_FontHandle *handle = manager->tail;
+
+    while ( handle && manager->numopen > manager->maxopen ) {
+        TTF_FontHandle *prev = handle->prev;
+
+        if ( handle->pins == 0 && !TTF_HasSizes( handle->font ) ) {
+            TTF_UnlinkHandle( manager, handle );
+            TTF_ReleaseFace( handle->font );
+            handle->open = 0;
+            --manager->numopen;
+            ++manager->evictions;
+        }
+        handle = prev;
+    }
+}
+
+TTF_FontManager *TTF_CreateFontManager( int maxopen )
+{
+    TTF_FontManager *manager;
+
+    if ( maxopen < 1 ) {
+        TTF_SetError( "A font manager needs room for an open font" );
+        return NULL;
+    }
+    manager = (TTF_FontManager *)calloc( 1, sizeof(*manager) );
+    if ( manager == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    pthread_mutex_init( &manager->lock, NULL );
+    manager->maxopen = maxopen;
+    return manager;
+}
+
+TTF_FontHandle *TTF_ManagerOpenFont( TTF_FontManager *manager, const char *file, int ptsize, long index )
+{
+    TTF_FontHandle *handle;
+
+    TTF_CHECKPOINTER(manager, NULL);
+    TTF_CHECKPOINTER(file, NULL);
+
+    handle = (TTF_FontHandle *)calloc( 1, sizeof(*handle) );
+    if ( handle == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    handle->file = TTF_strdup( file );
+    if ( handle->file == NULL ) {
+        TTF_OutOfMemory();
+        free( handle );
+        return NULL;
+    }
+    handle->font = TTF_OpenFontIndex( file, ptsize, index );
+    if ( handle->font == NULL ) {
+        free( handle->file );
+        free( handle );
+        return NULL;
+    }
+    handle->manager = manager;
+    handle->open = 1;
+
+    pthread_mutex_lock( &manager->lock );
+    handle->next_handle = manager->handles;
+    manager->handles = handle;
+    TTF_PushHandle( manager, handle );
+    ++manager->numopen;
+    TTF_EvictFonts( manager );
+    pthread_mutex_unlock( &manager->lock );
+    return handle;
+}
+
+TTF_Font *TTF_AcquireFont( TTF_FontHandle *handle )
+{
+    TTF_FontManager *manager;
+    TTF_Font *font = NULL;
+
+    TTF_CHECKPOINTER(handle, NULL);
+
+    manager = handle->manager;
+    pthread_mutex_lock( &manager->lock );
+    if ( handle->open ) {
+        TTF_UnlinkHandle( manager, handle );
+    } else if ( TTF_ReopenFace( handle->font, handle->file ) == 0 ) {
+        handle->open = 1;
+        ++manager->numopen;
+        ++manager->reopens;
+    }
+    if ( handle->open ) {
+        TTF_PushHandle( manager, handle );
+        ++handle->pins;
+        TTF_EvictFonts( manager );
+        font = handle->font;
+    }
+    pthread_mutex_unlock( &manager->lock );
+    return font;
+}
+
+void TTF_ReleaseFont( TTF_FontHandle *handle )
+{
+    TTF_FontManager *manager;
+
+    if ( handle == NULL ) {
+        return;
+    }
+    manager = handle->manager;
+    pthread_mutex_lock( &manager->lock );
+    if ( handle->pins > 0 && --handle->pins == 0 ) {
+        TTF_EvictFonts( manager );
+    }
+    pthread_mutex_unlock( &manager->lock );
+}
+
+void TTF_ManagerCloseFont( TTF_FontHandle *handle )
+{
+    TTF_FontManager *manager;
+    TTF_FontHandle **link;
+
+    if ( handle == NULL ) {
+        return;
+    }
+    manager = handle->manager;
+    pthread_mutex_lock( &manager->lock );
+    if ( handle->open ) {
+        TTF_UnlinkHandle( manager, handle );
+        --manager->numopen;
+    }
+    for ( link = &manager->handles; *link; link = &(*link)->next_handle ) {
+        if ( *link == handle ) {
+            *link = handle->next_handle;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &manager->lock );
+
+    TTF_CloseFont( handle->font );
+    free( handle->file );
+    free( handle );
+}
+
+void TTF_GetFontManagerStats( TTF_FontManager *manager, int *open, int *evictions, int *reopens )
+{
+    pthread_mutex_lock( &manager->lock );
+    if ( open ) {
+        *open = manager->numopen;
+    }
+    if ( evictions ) {
+        *evictions = manager->evictions;
+    }
+    if ( reopens ) {
+        *reopens = manager->reopens;
+    }
+    pthread_mutex_unlock( &manager->lock );
+}
+
+void TTF_FreeFontManager( TTF_FontManager *manager )
+{
+    if ( manager ) {
+        while ( manager->handles ) {
+            TTF_ManagerCloseFont( manager->handles );
+        }
+        pthread_mutex_destroy( &manager->lock );
+        free( manager );
+    }
+}
+
+/* Editable text.  The layout of the last text is kept, with the pen
+   position of every glyph, so that an edit only lays out the glyphs from
+   the first changed character on; the ones before keep their place, only
+   the kerning with the changed glyph is done again.  The surface is made
+   wider than the text, so that typing seldom needs a new one, and only
+   the columns from the first changed glyph to the end are cleared and
+   composited again.  Coverage is merged with OR, so drawing every glyph
+   that reaches into those columns, clipped to them, gives the pixels of
+   a full render.
+*/
+typedef struct {
+    Uint16 ch;
+    FT_UInt index;
+    int left;       /* first column of the pixmap, before the shift */
+    int right;      /* extent as counted by TTF_SizeUTF8() */
+    int next;       /* pen position of the next glyph, before kerning */
+    int miny;
+} TTF_EditGlyph;
+
+struct _TTF_EditText {
+    TTF_Font *font;
+    TTF_PixelLUT lut;
+    TTF_EditGlyph *glyphs;
+    int numglyphs;
+    int maxglyphs;
+    int shift;      /* for a first glyph with a negative minx */
+    int capacity;   /* columns allocated, fn_w() being the text width */
+    Uint8 *surface;
+    /* Font settings the layout was made with */
+    Uint32 serial;
+    int style;
+    int outline;
+    int hinting;
+    int kerning;
+};
+
+TTF_EditText *TTF_CreateEditText( TTF_Font *font, Uint32 fg, int format )
+{
+    TTF_EditText *edit;
+
+    TTF_CHECKPOINTER( font, NULL );
+
+    edit = (TTF_EditText *)calloc( 1, sizeof(*edit) );
+    if ( edit == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    if ( TTF_initPixelLUT( &edit->lut, format, fg ) < 0 ) {
+        free( edit );
+        return NULL;
+    }
+    edit->font = font;
+    return edit;
+}
+
+/* Composite the glyphs of the text, and the lines of its style, into the
+   columns from x0 to the text width, which must have been cleared. */
+static int TTF_DrawEditText( TTF_EditText *edit, TTF_Context *ctx, int x0 )
+{
+    TTF_Font *font = edit->font;
+    Uint8 *textbuf = edit->surface;
+    Uint8 *dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
+    const int bpp = edit->lut.depth / 8;
+    int i, row;
+
+    for ( i = 0; i < edit->numglyphs; ++i ) {
+        const TTF_EditGlyph *g = &edit->glyphs[i];
+        c_glyph *glyph;
+        FT_Error error;
+        int col, start, end, width;
+
+        error = Find_Glyph( ctx, g->ch, CACHED_METRICS|CACHED_PIXMAP, &glyph );
+        if ( error ) {
+            TTF_SetFTError( "Couldn't find glyph", error );
+            return -1;
+        }
+        width = glyph->pixmap.width;
+        if ( font->outline <= 0 && width > glyph->maxx - glyph->minx ) {
+            width = glyph->maxx - glyph->minx;
+        }
+        col = edit->shift + g->left;
+        start = (col > x0) ? col : x0;
+        end = col + width;
+        if ( end > fn_w(textbuf) ) {
+            end = fn_w(textbuf);
+        }
+        if ( start >= end ) {
+            continue;
+        }
+
+        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
+            if ( row+glyph->yoffset < 0 ) {
+                continue;
             }
-            dst = (Uint8*) (textbuf + 8) +
-                (row+glyph->yoffset) * fn_p(textbuf) +
-                xstart + glyph->minx;
-            src = current->buffer + row * current->pitch;
+            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
+                continue;
+            }
+            TTF_blendRow( &edit->lut,
+                (Uint8*)(textbuf + 8) + (row+glyph->yoffset) * fn_p(textbuf) + start * bpp,
+                dst_check,
+                glyph->pixmap.buffer + glyph->pixmap.pitch * row + (start - col),
+                end - start );
+        }
+    }
+
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        TTF_drawLineSpan_LUT( font, textbuf, TTF_underline_top_row(font),
+                              x0, fn_w(textbuf) - x0, &edit->lut );
+    }
+    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+        TTF_drawLineSpan_LUT( font, textbuf, TTF_strikethrough_top_row(font),
+                              x0, fn_w(textbuf) - x0, &edit->lut );
+    }
+    return 0;
+}
+
+/* Forget the layout and pixels, so the next text is drawn in full */
+static void TTF_ResetEditText( TTF_EditText *edit )
+{
+    free( edit->surface );
+    edit->surface = NULL;
+    edit->capacity = 0;
+    edit->numglyphs = 0;
+}
+
+/* Set the columns from x0 to x1 of every row to the background */
+static void TTF_ClearColumns( Uint8 *textbuf, Uint32 pixel, int x0, int x1 )
+{
+    Uint8 *row = textbuf + 8;
+    int y, x;
+
+    for ( y = 0; y < fn_h(textbuf); ++y ) {
+        if ( fn_d(textbuf) == 32 ) {
+            for ( x = x0; x < x1; ++x ) {
+                ((Uint32 *)row)[x] = pixel;
+            }
+        } else if ( fn_d(textbuf) == 16 ) {
+            for ( x = x0; x < x1; ++x ) {
+                ((Uint16 *)row)[x] = (Uint16)pixel;
+            }
+        } else {
+            memset( row + x0, (Uint8)pixel, x1 - x0 );
+        }
+        row += fn_p(textbuf);
+    }
+}
+
+int TTF_SetEditText( TTF_EditText *edit, const char *text, TTF_Rect *dirty )
+{
+    TTF_Font *font;
+    TTF_Context *ctx;
+    c_glyph *glyph;
+    FT_Error error;
+    FT_Long use_kerning;
+    FT_UInt prev_index = 0;
+    size_t textlen;
+    int first, i, x;
+    int oldw, oldh, width, height;
+    int minx, maxx, miny;
+    int shift, x0, x1;
+    int outline_delta = 0;
+
+    TTF_CHECKPOINTER( edit, -1 );
+    TTF_CHECKPOINTER( text, -1 );
+
+    font = edit->font;
+    ctx = TTF_GetContext( font );
+    if ( ctx == NULL ) {
+        return -1;
+    }
+
+    oldw = edit->surface ? fn_w(edit->surface) : 0;
+    oldh = edit->surface ? fn_h(edit->surface) : 0;
+
+    /* A layout made with other settings can't be reused */
+    if ( edit->serial != font->serial || edit->style != font->style ||
+         edit->outline != font->outline || edit->hinting != font->hinting ||
+         edit->kerning != font->kerning ) {
+        TTF_ResetEditText( edit );
+        edit->serial = font->serial;
+        edit->style = font->style;
+        edit->outline = font->outline;
+        edit->hinting = font->hinting;
+        edit->kerning = font->kerning;
+    }
+
+    /* Skip the characters that didn't change */
+    textlen = strlen( text );
+    first = 0;
+    while ( textlen > 0 && first < edit->numglyphs ) {
+        const char *next = text;
+        size_t nextlen = textlen;
+        Uint16 c = UTF8_getch( &next, &nextlen );
+
+        if ( c != UNICODE_BOM_NATIVE && c != UNICODE_BOM_SWAPPED ) {
+            if ( c != edit->glyphs[first].ch ) {
+                break;
+            }
+            ++first;
+        }
+        text = next;
+        textlen = nextlen;
+    }
+
+    /* The columns of the glyphs going away */
+    x0 = INT_MAX;
+    for ( i = first; i < edit->numglyphs; ++i ) {
+        if ( x0 > edit->glyphs[i].left ) {
+            x0 = edit->glyphs[i].left;
+        }
+    }
+
+    /* Lay out the rest, from the pen position after the kept glyphs */
+    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+    x = 0;
+    if ( first > 0 ) {
+        x = edit->glyphs[first-1].next;
+        prev_index = edit->glyphs[first-1].index;
+    }
+    edit->numglyphs = first;
+    Prefetch_Glyphs( font, text, CACHED_METRICS|CACHED_PIXMAP );
+    while ( textlen > 0 ) {
+        Uint16 c = UTF8_getch( &text, &textlen );
+        TTF_EditGlyph *g;
+
+        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+            continue;
+        }
+
+        error = Find_Glyph( ctx, c, CACHED_METRICS, &glyph );
+        if ( error ) {
+            TTF_SetFTError( "Couldn't find glyph", error );
+            TTF_ResetEditText( edit );
+            return -1;
+        }
+        if ( edit->numglyphs == edit->maxglyphs ) {
+            int maxglyphs = edit->maxglyphs ? edit->maxglyphs * 2 : 64;
+            TTF_EditGlyph *glyphs;
+
+            glyphs = (TTF_EditGlyph *)realloc( edit->glyphs, maxglyphs * sizeof(*glyphs) );
+            if ( glyphs == NULL ) {
+                TTF_OutOfMemory();
+                TTF_ResetEditText( edit );
+                return -1;
+            }
+            edit->glyphs = glyphs;
+            edit->maxglyphs = maxglyphs;
+        }
+
+        if ( use_kerning && prev_index && glyph->index ) {
+            FT_Vector delta;
+            FT_Get_Kerning( ctx->face, prev_index, glyph->index, ft_kerning_default, &delta );
+            x += delta.x >> 6;
+        }
+
+        g = &edit->glyphs[edit->numglyphs++];
+        g->ch = c;
+        g->index = glyph->index;
+        g->left = x + glyph->minx;
+        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
+            x += font->glyph_overhang;
+        }
+        g->right = x + ((glyph->advance > glyph->maxx) ? glyph->advance : glyph->maxx);
+        x += glyph->advance;
+        g->next = x;
+        g->miny = glyph->miny;
+        prev_index = glyph->index;
+
+        if ( x0 > g->left ) {
+            x0 = g->left;
+        }
+    }
+
+    /* Find the new size, as TTF_SizeUTF8() does */
+    minx = maxx = miny = 0;
+    for ( i = 0; i < edit->numglyphs; ++i ) {
+        const TTF_EditGlyph *g = &edit->glyphs[i];
+
+        if ( minx > g->left ) {
+            minx = g->left;
+        }
+        if ( maxx < g->right ) {
+            maxx = g->right;
+        }
+        if ( miny > g->miny ) {
+            miny = g->miny;
+        }
+    }
+    if ( font->outline > 0 ) {
+        outline_delta = font->outline * 2;
+    }
+    width = (maxx - minx) + outline_delta;
+    height = (font->ascent - miny) + outline_delta;
+    if ( height < font->height ) {
+        height = font->height;
+    }
+    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+        int bottom_row = TTF_underline_bottom_row(font);
+        if ( height < bottom_row ) {
+            height = bottom_row;
+        }
+    }
+    shift = 0;
+    if ( edit->numglyphs > 0 && edit->glyphs[0].left < 0 ) {
+        shift = -edit->glyphs[0].left;
+    }
 
-            for ( col=width; col>0 && dst < dst_check; --col ) {
-                *dst++ |= *src++;
+    if ( width == 0 ) {
+        free( edit->surface );
+        edit->surface = NULL;
+        edit->capacity = 0;
+        x0 = 0;
+        x1 = oldw;
+        height = oldh;
+    } else if ( edit->surface == NULL || height != oldh || width > edit->capacity ) {
+        /* A new surface, with room to grow */
+        int capacity = width + width / 2;
+
+        free( edit->surface );
+        edit->surface = TTF_CreateRGBSurface( capacity, height, edit->lut.depth, 0, 0, 0, 0 );
+        if ( edit->surface == NULL ) {
+            TTF_OutOfMemory();
+            TTF_ResetEditText( edit );
+            return -1;
+        }
+        edit->capacity = capacity;
+        edit->shift = shift;
+        fn_set_w( edit->surface, width );
+        TTF_FillRect( edit->surface, edit->lut.pixel[0] );
+        x0 = 0;
+        x1 = (width > oldw) ? width : oldw;
+        if ( height < oldh ) {
+            height = oldh;
+        }
+    } else {
+        if ( shift != edit->shift ) {
+            edit->shift = shift;
+            x0 = 0;
+        } else if ( x0 == INT_MAX ) {
+            /* Nothing changed */
+            x0 = width;
+        } else {
+            x0 += shift;
+            if ( x0 < 0 ) {
+                x0 = 0;
             }
         }
-
-        xstart += glyph->advance;
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            xstart += font->glyph_overhang;
+        /* The lines of the style run the whole width */
+        if ( x0 > oldw && (TTF_HANDLE_STYLE_UNDERLINE(font) ||
+                           TTF_HANDLE_STYLE_STRIKETHROUGH(font)) ) {
+            x0 = oldw;
         }
-        prev_index = glyph->index;
+        x1 = (width > oldw) ? width : oldw;
+        if ( x0 > x1 ) {
+            x0 = x1;
+        }
+        TTF_ClearColumns( edit->surface, edit->lut.pixel[0], x0, x1 );
+        fn_set_w( edit->surface, width );
     }
 
-    /* Handle the underline style */
-    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
-        row = TTF_underline_top_row(font);
-        TTF_drawLine_Solid(font, textbuf, row);
+    if ( edit->surface && x0 < width && TTF_DrawEditText( edit, ctx, x0 ) < 0 ) {
+        TTF_ResetEditText( edit );
+        return -1;
     }
 
-    /* Handle the strikethrough style */
-    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
-        row = TTF_strikethrough_top_row(font);
-        TTF_drawLine_Solid(font, textbuf, row);
+    if ( dirty ) {
+        dirty->x = x0;
+        dirty->y = 0;
+        dirty->w = x1 - x0;
+        dirty->h = (x1 > x0) ? height : 0;
     }
-    return textbuf;
+    return 0;
 }
 
-Uint8 *TTF_RenderUNICODE_Solid(TTF_Font *font,
-                const Uint16 *text, Uint32 fg)
+const Uint8 *TTF_GetEditTextSurface( const TTF_EditText *edit )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+    return edit ? edit->surface : NULL;
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+void TTF_FreeEditText( TTF_EditText *edit )
+{
+    if ( edit ) {
+        free( edit->surface );
+        free( edit->glyphs );
+        free( edit );
+    }
+}
 
-    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
-    if ( utf8 ) {
-        UCS2_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Solid(font, (char *)utf8, fg);
-        free(utf8);
-    } else {
+/* Document layout index.  Paragraphs are broken into lines only when a
+   line of theirs is first asked for, and their line counts are kept in
+   a Fenwick tree, so that the paragraph holding any line, and the first
+   line of any paragraph, are found in O(log n) steps.  Changing a
+   paragraph updates its count along one path of the tree; only inserting
+   paragraphs in the middle builds the tree again, still without breaking
+   any line.  A paragraph not broken yet counts as one line.
+*/
+typedef struct {
+    char *text;
+    int numLines;   /* 0 until broken into lines */
+    Uint32 *lines;  /* start and length of each line, NULL for all of text */
+} TTF_DocParagraph;
+
+struct _TTF_Document {
+    TTF_Font *font;
+    Uint32 wrapLength;
+    TTF_DocParagraph *paragraphs;
+    long *tree;     /* line counts, 1-based */
+    int numparagraphs;
+    int maxparagraphs;
+    int unmeasured;
+    int cursor;     /* every paragraph before it is broken */
+    int open;       /* the last paragraph has no line ending yet */
+};
+
+#define DOC_LINES( p )  ((p)->numLines ? (p)->numLines : 1)
+
+static void Document_AddLines( TTF_Document *doc, int paragraph, long delta )
+{
+    int i;
+
+    for ( i = paragraph + 1; i <= doc->numparagraphs; i += i & -i ) {
+        doc->tree[i] += delta;
+    }
+}
+
+/* The number of lines before a paragraph */
+static long Document_Prefix( const TTF_Document *doc, int paragraph )
+{
+    long sum = 0;
+    int i;
+
+    for ( i = paragraph; i > 0; i -= i & -i ) {
+        sum += doc->tree[i];
+    }
+    return sum;
+}
+
+static void Document_Rebuild( TTF_Document *doc )
+{
+    int i, j;
+
+    for ( i = 1; i <= doc->numparagraphs; ++i ) {
+        doc->tree[i] = DOC_LINES( &doc->paragraphs[i - 1] );
+    }
+    for ( i = 1; i <= doc->numparagraphs; ++i ) {
+        j = i + (i & -i);
+        if ( j <= doc->numparagraphs ) {
+            doc->tree[j] += doc->tree[i];
+        }
+    }
+}
+
+static int Document_Reserve( TTF_Document *doc, int count )
+{
+    TTF_DocParagraph *paragraphs;
+    long *tree;
+    int maxparagraphs = doc->maxparagraphs;
+
+    if ( doc->numparagraphs + count <= maxparagraphs ) {
+        return 0;
+    }
+    while ( maxparagraphs < doc->numparagraphs + count ) {
+        maxparagraphs = maxparagraphs ? maxparagraphs * 2 : 64;
+    }
+    paragraphs = (TTF_DocParagraph *)realloc( doc->paragraphs,
+                                              maxparagraphs * sizeof(*paragraphs) );
+    if ( paragraphs == NULL ) {
         TTF_OutOfMemory();
+        return -1;
     }
-    return surface;
+    doc->paragraphs = paragraphs;
+    tree = (long *)realloc( doc->tree, (maxparagraphs + 1) * sizeof(*tree) );
+    if ( tree == NULL ) {
+        TTF_OutOfMemory();
+        return -1;
+    }
+    doc->tree = tree;
+    doc->maxparagraphs = maxparagraphs;
+    return 0;
 }
 
-Uint8 *TTF_RenderGlyph_Solid(TTF_Font *font, Uint16 ch, Uint32 fg)
+/* Add an unbroken paragraph at the end, taking its text */
+static void Document_Push( TTF_Document *doc, char *text )
 {
-    Uint16 ucs2[2] = { ch, 0 };
-    Uint8 utf8[4];
+    int n = ++doc->numparagraphs;
 
-    UCS2_to_UTF8(ucs2, utf8);
-    return TTF_RenderUTF8_Solid(font, (char *)utf8, fg);
+    doc->paragraphs[n - 1].text = text;
+    doc->paragraphs[n - 1].numLines = 0;
+    doc->paragraphs[n - 1].lines = NULL;
+    doc->tree[n] = 1 + Document_Prefix( doc, n - 1 ) - Document_Prefix( doc, n - (n & -n) );
+    ++doc->unmeasured;
 }
 
-Uint8 *TTF_RenderText_Shaded(TTF_Font *font,
-                const char *text, Uint32 fg, Uint32 bg)
+static void Document_Invalidate( TTF_Document *doc, int paragraph )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+    TTF_DocParagraph *p = &doc->paragraphs[paragraph];
+
+    if ( p->numLines ) {
+        Document_AddLines( doc, paragraph, 1 - p->numLines );
+        free( p->lines );
+        p->lines = NULL;
+        p->numLines = 0;
+        ++doc->unmeasured;
+    }
+    if ( paragraph < doc->cursor ) {
+        doc->cursor = paragraph;
+    }
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+/* Break a paragraph into lines as TTF_RenderUTF8_Blended_Wrapped() would */
+static int Document_Measure( TTF_Document *doc, int paragraph )
+{
+    TTF_DocParagraph *p = &doc->paragraphs[paragraph];
+    char *str, **strLines;
+    int numLines, i;
 
-    utf8 = (Uint8*)malloc(strlen(text)*2+1);
-    if ( utf8 ) {
-        LATIN1_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Shaded(font, (char *)utf8, fg, bg);
-        free(utf8);
+    if ( p->numLines ) {
+        return 0;
+    }
+    if ( TTF_WrapLines( doc->font, p->text, doc->wrapLength,
+                        &str, &strLines, &numLines ) < 0 ) {
+        return -1;
+    }
+    if ( strLines ) {
+        p->lines = (Uint32 *)malloc( numLines * 2 * sizeof(*p->lines) );
+        if ( p->lines == NULL ) {
+            free( strLines );
+            free( str );
+            TTF_OutOfMemory();
+            return -1;
+        }
+        for ( i = 0; i < numLines; ++i ) {
+            p->lines[2 * i] = (Uint32)(strLines[i] - str);
+            p->lines[2 * i + 1] = (Uint32)strlen( strLines[i] );
+        }
+        free( strLines );
+        free( str );
+    }
+    p->numLines = numLines;
+    Document_AddLines( doc, paragraph, numLines - 1 );
+    --doc->unmeasured;
+    return 0;
+}
+
+/* The length of text up to its first line ending, with *next set past
+   the line ending, or NULL if there is none */
+static size_t Document_LineEnd( const char *text, const char **next )
+{
+    size_t len = strcspn( text, "\r\n" );
+    const char *end = text + len;
+
+    if ( *end == '\r' ) {
+        ++end;
+        if ( *end == '\n' ) {
+            ++end;
+        }
+    } else if ( *end == '\n' ) {
+        ++end;
     } else {
+        end = NULL;
+    }
+    *next = end;
+    return len;
+}
+
+static char *Document_Copy( const char *text, size_t len )
+{
+    char *copy = (char *)malloc( len + 1 );
+
+    if ( copy == NULL ) {
         TTF_OutOfMemory();
+        return NULL;
     }
-    return surface;
+    memcpy( copy, text, len );
+    copy[len] = '\0';
+    return copy;
 }
 
-/* Convert the UTF-8 text to UNICODE and render it
-*/
-Uint8 *TTF_RenderUTF8_Shaded(TTF_Font *font,
-                const char *text, Uint32 fg, Uint32 bg)
+TTF_Document *TTF_CreateDocument( TTF_Font *font, Uint32 wrapLength )
 {
-    int first;
-    int xstart;
-    int width;
-    int height;
-    Uint8* textbuf;
-    //SDL_Palette* palette;
-    int index;
-    int rdiff;
-    int gdiff;
-    int bdiff;
-    Uint8* src;
-    Uint8* dst;
-    Uint8* dst_check;
-    int row, col;
-    FT_Bitmap* current;
-    c_glyph *glyph;
-    FT_Error error;
-    FT_Long use_kerning;
-    FT_UInt prev_index = 0;
-    size_t textlen;
+    TTF_Document *doc;
 
-    TTF_CHECKPOINTER(text, NULL);
+    TTF_CHECKPOINTER( font, NULL );
 
-    /* Get the dimensions of the text surface */
-    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
-        TTF_SetError("Text has zero width");
+    doc = (TTF_Document *)calloc( 1, sizeof(*doc) );
+    if ( doc == NULL ) {
+        TTF_OutOfMemory();
         return NULL;
     }
-
-    /* Create the target surface */
-    textbuf = TTF_CreateRGBSurface(width, height, 8, 0, 0, 0, 0);
-    if ( textbuf == NULL ) {
+    doc->font = font;
+    doc->wrapLength = wrapLength;
+    if ( Document_Reserve( doc, 1 ) < 0 ) {
+        free( doc );
         return NULL;
     }
+    doc->tree[0] = 0;
+    return doc;
+}
 
-    /* Adding bound checking to avoid all kinds of memory corruption errors
-       that may occur. */
-    dst_check = (Uint8*)(textbuf + 8) + fn_p(textbuf) * fn_h(textbuf);
-
-    printf("here was palette! %s\n", __func__);
-    /* Fill the palette with NUM_GRAYS levels of shading from bg to fg */
-    //palette = textbuf->format->palette;
-    rdiff = cl_r(fg) - cl_r(bg);
-    gdiff = cl_g(fg) - cl_g(bg);
-    bdiff = cl_b(fg) - cl_b(bg);
+int TTF_AppendDocumentText( TTF_Document *doc, const char *text )
+{
+    TTF_CHECKPOINTER( doc, -1 );
+    TTF_CHECKPOINTER( text, -1 );
+
+    while ( *text ) {
+        const char *next;
+        size_t len = Document_LineEnd( text, &next );
+
+        if ( doc->open ) {
+            /* Continue the last paragraph */
+            TTF_DocParagraph *p = &doc->paragraphs[doc->numparagraphs - 1];
+            size_t oldlen = strlen( p->text );
+            char *joined = (char *)realloc( p->text, oldlen + len + 1 );
+
+            if ( joined == NULL ) {
+                TTF_OutOfMemory();
+                return -1;
+            }
+            memcpy( joined + oldlen, text, len );
+            joined[oldlen + len] = '\0';
+            p->text = joined;
+            Document_Invalidate( doc, doc->numparagraphs - 1 );
+        } else {
+            char *copy;
 
-    printf("NUM_GRAYS = %d\n", NUM_GRAYS);
-    for ( index = 0; index < NUM_GRAYS; ++index ) {
-        //palette->colors[index].r = cl_r(bg) + (index*rdiff) / (NUM_GRAYS-1);
-        //palette->colors[index].g = cl_g(bg) + (index*gdiff) / (NUM_GRAYS-1);
-        //palette->colors[index].b = cl_b(bg) + (index*bdiff) / (NUM_GRAYS-1);
+            if ( Document_Reserve( doc, 1 ) < 0 ||
+                 (copy = Document_Copy( text, len )) == NULL ) {
+                return -1;
+            }
+            Document_Push( doc, copy );
+        }
+        doc->open = (next == NULL);
+        text = next ? next : text + len;
     }
+    return 0;
+}
 
-    /* check kerning */
-    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+int TTF_SetDocumentParagraph( TTF_Document *doc, int paragraph, const char *text )
+{
+    TTF_DocParagraph *p;
+    const char *rest, *next;
+    char **copies;
+    size_t len;
+    int count, i;
 
-    /* Load and render each character */
-    textlen = strlen(text);
-    first = 0;
-    xstart = 0;
-    while ( textlen > 0 ) {
-        Uint16 c = UTF8_getch(&text, &textlen);
-        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
-            continue;
+    TTF_CHECKPOINTER( doc, -1 );
+    TTF_CHECKPOINTER( text, -1 );
+
+    if ( paragraph < 0 || paragraph >= doc->numparagraphs ) {
+        TTF_SetError( "No paragraph %d in the document", paragraph );
+        return -1;
+    }
+
+    /* Every line ending starts one more paragraph */
+    count = 1;
+    for ( rest = text; ; rest = next ) {
+        Document_LineEnd( rest, &next );
+        if ( next == NULL ) {
+            break;
+        }
+        ++count;
+    }
+    if ( Document_Reserve( doc, count - 1 ) < 0 ) {
+        return -1;
+    }
+    copies = (char **)malloc( count * sizeof(*copies) );
+    if ( copies == NULL ) {
+        TTF_OutOfMemory();
+        return -1;
+    }
+    for ( i = 0, rest = text; i < count; ++i, rest = next ) {
+        len = Document_LineEnd( rest, &next );
+        copies[i] = Document_Copy( rest, len );
+        if ( copies[i] == NULL ) {
+            while ( i-- > 0 ) {
+                free( copies[i] );
+            }
+            free( copies );
+            return -1;
         }
+    }
 
-        error = Find_Glyph(font, c, CACHED_METRICS|CACHED_PIXMAP);
-        if ( error ) {
-            TTF_SetFTError("Couldn't find glyph", error);
-            free( textbuf );
-            return NULL;
+    p = &doc->paragraphs[paragraph];
+    free( p->text );
+    p->text = copies[0];
+    Document_Invalidate( doc, paragraph );
+    if ( count > 1 ) {
+        /* Make room for the new paragraphs and count them all again */
+        memmove( &doc->paragraphs[paragraph + count], &doc->paragraphs[paragraph + 1],
+                 (doc->numparagraphs - paragraph - 1) * sizeof(*doc->paragraphs) );
+        for ( i = 1; i < count; ++i ) {
+            p = &doc->paragraphs[paragraph + i];
+            p->text = copies[i];
+            p->numLines = 0;
+            p->lines = NULL;
         }
-        glyph = font->current;
-        /* Ensure the width of the pixmap is correct. On some cases,
-         * freetype may report a larger pixmap than possible.*/
-        width = glyph->pixmap.width;
-        if (font->outline <= 0 && width > glyph->maxx - glyph->minx) {
-            width = glyph->maxx - glyph->minx;
+        doc->numparagraphs += count - 1;
+        doc->unmeasured += count - 1;
+        Document_Rebuild( doc );
+    }
+    free( copies );
+    return 0;
+}
+
+void TTF_SetDocumentWrapLength( TTF_Document *doc, Uint32 wrapLength )
+{
+    int i;
+
+    if ( doc == NULL ) {
+        return;
+    }
+    for ( i = 0; i < doc->numparagraphs; ++i ) {
+        TTF_DocParagraph *p = &doc->paragraphs[i];
+
+        free( p->lines );
+        p->lines = NULL;
+        p->numLines = 0;
+    }
+    doc->wrapLength = wrapLength;
+    doc->unmeasured = doc->numparagraphs;
+    doc->cursor = 0;
+    Document_Rebuild( doc );
+}
+
+int TTF_GetDocumentParagraphs( const TTF_Document *doc )
+{
+    return doc ? doc->numparagraphs : 0;
+}
+
+long TTF_GetDocumentLines( const TTF_Document *doc )
+{
+    return doc ? Document_Prefix( doc, doc->numparagraphs ) : 0;
+}
+
+long TTF_GetDocumentParagraphLine( const TTF_Document *doc, int paragraph )
+{
+    TTF_CHECKPOINTER( doc, -1 );
+
+    if ( paragraph < 0 || paragraph > doc->numparagraphs ) {
+        TTF_SetError( "No paragraph %d in the document", paragraph );
+        return -1;
+    }
+    return Document_Prefix( doc, paragraph );
+}
+
+int TTF_FindDocumentLine( TTF_Document *doc, long line, int *paragraph, int *subline )
+{
+    int step, pos;
+    long rest;
+
+    TTF_CHECKPOINTER( doc, -1 );
+
+    for ( ; ; ) {
+        /* Descend the tree to the last paragraph starting at or before the line */
+        pos = 0;
+        rest = line;
+        step = 1;
+        while ( step * 2 <= doc->numparagraphs ) {
+            step *= 2;
         }
-        /* do kerning, if possible AC-Patch */
-        if ( use_kerning && prev_index && glyph->index ) {
-            FT_Vector delta;
-            FT_Get_Kerning( font->face, prev_index, glyph->index, ft_kerning_default, &delta );
-            xstart += delta.x >> 6;
+        for ( ; step > 0 && rest >= 0; step /= 2 ) {
+            if ( pos + step <= doc->numparagraphs && doc->tree[pos + step] <= rest ) {
+                pos += step;
+                rest -= doc->tree[pos];
+            }
         }
-        /* Compensate for the wrap around with negative minx's */
-        if ( first && (glyph->minx < 0) ) {
-            xstart -= glyph->minx;
+        if ( line < 0 || pos >= doc->numparagraphs ) {
+            TTF_SetError( "No line %ld in the document", line );
+            return -1;
         }
-        first = 0;
 
-        current = &glyph->pixmap;
-        for ( row = 0; row < current->rows; ++row ) {
-            /* Make sure we don't go either over, or under the
-             * limit */
-            if ( row+glyph->yoffset < 0 ) {
-                continue;
-            }
-            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
-                continue;
+        /* Breaking the paragraph leaves the lines before it alone */
+        if ( doc->paragraphs[pos].numLines ) {
+            break;
+        }
+        if ( Document_Measure( doc, pos ) < 0 ) {
+            return -1;
+        }
+    }
+    if ( paragraph ) {
+        *paragraph = pos;
+    }
+    if ( subline ) {
+        *subline = (int)rest;
+    }
+    return 0;
+}
+
+int TTF_MeasureDocument( TTF_Document *doc, int count )
+{
+    TTF_CHECKPOINTER( doc, -1 );
+
+    while ( doc->cursor < doc->numparagraphs && count != 0 ) {
+        if ( !doc->paragraphs[doc->cursor].numLines ) {
+            if ( Document_Measure( doc, doc->cursor ) < 0 ) {
+                return -1;
             }
-            dst = (Uint8*) (textbuf + 8) +
-                (row+glyph->yoffset) * fn_p(textbuf) +
-                xstart + glyph->minx;
-            src = current->buffer + row * current->pitch;
-            for ( col=width; col>0 && dst < dst_check; --col ) {
-                *dst++ |= *src++;
+            if ( count > 0 ) {
+                --count;
             }
         }
+        ++doc->cursor;
+    }
+    return doc->unmeasured;
+}
 
-        xstart += glyph->advance;
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            xstart += font->glyph_overhang;
-        }
-        prev_index = glyph->index;
+Uint8 *TTF_RenderDocument_Blended( TTF_Document *doc, long line, int count,
+                                   Uint32 fg, int format )
+{
+    TTF_Font *font;
+    TTF_Context *ctx;
+    TTF_PixelLUT lut;
+    const char **starts = NULL;
+    size_t *lens;
+    char **lines = NULL;
+    char *buffer = NULL;
+    size_t total = 0;
+    int paragraph, subline;
+    int width, height, w, h;
+    int n, i;
+    Uint8 *textbuf = NULL;
+
+    TTF_CHECKPOINTER( doc, NULL );
+
+    font = doc->font;
+    ctx = TTF_GetContext( font );
+    if ( ctx == NULL ) {
+        return NULL;
+    }
+    if ( TTF_initPixelLUT( &lut, format, fg ) < 0 ) {
+        return NULL;
+    }
+    if ( count <= 0 ) {
+        TTF_SetError( "No lines to render" );
+        return NULL;
+    }
+    if ( TTF_FindDocumentLine( doc, line, &paragraph, &subline ) < 0 ) {
+        return NULL;
     }
 
-    /* Handle the underline style */
-    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
-        row = TTF_underline_top_row(font);
-        TTF_drawLine_Shaded(font, textbuf, row);
+    starts = (const char **)malloc( count * (sizeof(*starts) + sizeof(*lens) + sizeof(*lines)) );
+    if ( starts == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
     }
+    lens = (size_t *)(starts + count);
+    lines = (char **)(lens + count);
 
-    /* Handle the strikethrough style */
-    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
-        row = TTF_strikethrough_top_row(font);
-        TTF_drawLine_Shaded(font, textbuf, row);
+    /* Gather the lines, breaking paragraphs on the way */
+    for ( n = 0; n < count && paragraph < doc->numparagraphs; ++n ) {
+        TTF_DocParagraph *p;
+
+        if ( Document_Measure( doc, paragraph ) < 0 ) {
+            goto done;
+        }
+        p = &doc->paragraphs[paragraph];
+        if ( p->lines ) {
+            starts[n] = p->text + p->lines[2 * subline];
+            lens[n] = p->lines[2 * subline + 1];
+        } else {
+            starts[n] = p->text;
+            lens[n] = strlen( p->text );
+        }
+        total += lens[n] + 1;
+        if ( ++subline == p->numLines ) {
+            subline = 0;
+            ++paragraph;
+        }
+    }
+
+    buffer = (char *)malloc( total );
+    if ( buffer == NULL ) {
+        TTF_OutOfMemory();
+        goto done;
+    }
+    /* Lines are as high as the wrapped path measures its whole text,
+     * which covers descenders and outlines reaching below the font */
+    width = doc->wrapLength;
+    height = font->height;
+    for ( i = 0, total = 0; i < n; ++i ) {
+        lines[i] = buffer + total;
+        memcpy( lines[i], starts[i], lens[i] );
+        lines[i][lens[i]] = '\0';
+        total += lens[i] + 1;
+        if ( TTF_SizeUTF8( font, lines[i], &w, &h ) < 0 ) {
+            goto done;
+        }
+        if ( !doc->wrapLength && w > width ) {
+            width = w;
+        }
+        if ( h > height ) {
+            height = h;
+        }
+    }
+    if ( !width ) {
+        TTF_SetError( "Text has zero width" );
+        goto done;
     }
+    textbuf = Render_WrappedLines( ctx, lines, n, width, height, &lut );
+
+done:
+    free( buffer );
+    free( starts );
     return textbuf;
 }
 
-Uint8* TTF_RenderUNICODE_Shaded( TTF_Font* font,
-                       const Uint16* text,
-                       Uint32 fg,
-                       Uint32 bg )
+void TTF_FreeDocument( TTF_Document *doc )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+    int i;
 
-    TTF_CHECKPOINTER(text, NULL);
+    if ( doc ) {
+        for ( i = 0; i < doc->numparagraphs; ++i ) {
+            free( doc->paragraphs[i].text );
+            free( doc->paragraphs[i].lines );
+        }
+        free( doc->paragraphs );
+        free( doc->tree );
+        free( doc );
+    }
+}
 
-    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
-    if ( utf8 ) {
-        UCS2_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Shaded(font, (char *)utf8, fg, bg);
-        free(utf8);
-    } else {
-        TTF_OutOfMemory();
+/* Batches of labels.  Every label is laid out first, fonts one after the
+   other, and cut into pieces: one per glyph, and one per underline or
+   strikethrough.  The pieces are sorted by glyph, so that each pixmap is
+   composited for all its uses at once while it is hot, and given to the
+   tiles of the canvas they reach.  Tiles do not overlap, so they can be
+   composited by the render threads at the same time.  Each piece is
+   clipped to the box TTF_RenderUTF8_Blended() would give its label.
+*/
+typedef struct {
+    int label;
+    TTF_Font *font;
+    Uint32 color;
+} TTF_LabelOrder;
+
+typedef struct {
+    const c_glyph *glyph;   /* or NULL for a line */
+    int x, y;               /* top left pixel in the canvas */
+    int width, rows;
+    int label;
+} TTF_LabelPiece;
+
+typedef struct {
+    int x0, y0, x1, y1;     /* box of the label, within the canvas */
+    int lut;
+} TTF_LabelBox;
+
+typedef struct {
+    Uint8 *canvas;
+    const TTF_LabelPiece *pieces;
+    const TTF_LabelBox *boxes;
+    const TTF_PixelLUT *luts;
+    const int *order;
+    int first, count;       /* pieces of the tile in order[] */
+    int x0, y0, x1, y1;
+} TTF_LabelTile;
+
+static int TTF_CompareLabels( const void *a, const void *b )
+{
+    const TTF_LabelOrder *la = (const TTF_LabelOrder *)a;
+    const TTF_LabelOrder *lb = (const TTF_LabelOrder *)b;
+
+    if ( la->font != lb->font ) {
+        return (la->font < lb->font) ? -1 : 1;
     }
-    return surface;
+    if ( la->color != lb->color ) {
+        return (la->color < lb->color) ? -1 : 1;
+    }
+    return la->label - lb->label;
 }
 
-Uint8* TTF_RenderGlyph_Shaded( TTF_Font* font,
-                     Uint16 ch,
-                     Uint32 fg,
-                     Uint32 bg )
+static int TTF_ComparePieces( const void *a, const void *b )
 {
-    Uint16 ucs2[2] = { ch, 0 };
-    Uint8 utf8[4];
+    const TTF_LabelPiece *pa = (const TTF_LabelPiece *)a;
+    const TTF_LabelPiece *pb = (const TTF_LabelPiece *)b;
 
-    UCS2_to_UTF8(ucs2, utf8);
-    return TTF_RenderUTF8_Shaded(font, (char *)utf8, fg, bg);
+    if ( pa->glyph != pb->glyph ) {
+        return (pa->glyph < pb->glyph) ? -1 : 1;
+    }
+    if ( pa->label != pb->label ) {
+        return pa->label - pb->label;
+    }
+    return (pa->y != pb->y) ? pa->y - pb->y : pa->x - pb->x;
 }
 
-Uint8 *TTF_RenderText_Blended(TTF_Font *font,
-                const char *text, Uint32 fg)
+/* The part of the canvas a piece may draw to */
+static void TTF_ClipPiece( const TTF_LabelPiece *piece, const TTF_LabelBox *box,
+                           int *x0, int *y0, int *x1, int *y1 )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+    *x0 = (piece->x > box->x0) ? piece->x : box->x0;
+    *y0 = (piece->y > box->y0) ? piece->y : box->y0;
+    *x1 = (piece->x + piece->width < box->x1) ? piece->x + piece->width : box->x1;
+    *y1 = (piece->y + piece->rows < box->y1) ? piece->y + piece->rows : box->y1;
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+static void Composite_LabelTile( void *data )
+{
+    const TTF_LabelTile *tile = (const TTF_LabelTile *)data;
+    Uint8 *pixels = tile->canvas + 8;
+    const int pitch = fn_p(tile->canvas);
+    const Uint8 *dst_check = pixels + pitch * fn_h(tile->canvas);
+    int i, row, col;
+
+    for ( i = tile->first; i < tile->first + tile->count; ++i ) {
+        const TTF_LabelPiece *piece = &tile->pieces[tile->order[i]];
+        const TTF_PixelLUT *lut = &tile->luts[tile->boxes[piece->label].lut];
+        const int bpp = lut->depth / 8;
+        int x0, y0, x1, y1;
+
+        TTF_ClipPiece( piece, &tile->boxes[piece->label], &x0, &y0, &x1, &y1 );
+        if ( x0 < tile->x0 ) {
+            x0 = tile->x0;
+        }
+        if ( y0 < tile->y0 ) {
+            y0 = tile->y0;
+        }
+        if ( x1 > tile->x1 ) {
+            x1 = tile->x1;
+        }
+        if ( y1 > tile->y1 ) {
+            y1 = tile->y1;
+        }
+        for ( row = y0; row < y1; ++row ) {
+            Uint8 *dst = pixels + row * pitch + x0 * bpp;
 
-    utf8 = (Uint8*)malloc(strlen(text)*2+1);
-    if ( utf8 ) {
-        LATIN1_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Blended(font, (char *)utf8, fg);
-        free(utf8);
-    } else {
-        TTF_OutOfMemory();
+            if ( piece->glyph ) {
+                const FT_Bitmap *pixmap = &piece->glyph->pixmap;
+
+                TTF_blendRow( lut, dst, dst_check,
+                              pixmap->buffer + pixmap->pitch * (row - piece->y) + (x0 - piece->x),
+                              x1 - x0 );
+            } else {
+                /* Lines are drawn at full coverage */
+                Uint32 pixel = lut->pixel[NUM_GRAYS - 1];
+
+                for ( col = x0; col < x1; ++col, dst += bpp ) {
+                    if ( bpp == 4 ) {
+                        *(Uint32 *)dst = pixel;
+                    } else if ( bpp == 2 ) {
+                        *(Uint16 *)dst = (Uint16)pixel;
+                    } else {
+                        *dst = (Uint8)pixel;
+                    }
+                }
+            }
+        }
     }
-    return surface;
 }
 
-Uint8 *TTF_RenderUTF8_Blended(TTF_Font *font,
-                const char *text, Uint32 fg)
+/* Add a piece for an underline or strikethrough at the given row of a
+   label, as TTF_drawLine_LUT() would draw it */
+static void TTF_AddLinePiece( TTF_LabelPiece *piece, TTF_Font *font, const TTF_Label *label,
+                              int index, int row, int width )
 {
-    int first;
-    int xstart;
-    int width, height;
-    Uint8 *textbuf;
-    Uint32 alpha;
-    Uint32 pixel;
-    Uint8 *src;
-    Uint32 *dst;
-    Uint32 *dst_check;
-    int row, col;
-    c_glyph *glyph;
-    FT_Error error;
-    FT_Long use_kerning;
-    FT_UInt prev_index = 0;
-    size_t textlen;
+    piece->glyph = NULL;
+    piece->x = label->x;
+    piece->y = label->y + ((row > 0) ? row : 0);
+    piece->width = width;
+    piece->rows = font->underline_height;
+    if ( font->outline > 0 ) {
+        piece->rows += font->outline * 2;
+    }
+    piece->label = index;
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+int TTF_RenderLabels_Blended( Uint8 *canvas, int format, const TTF_Label *labels,
+                              int numlabels, int tile_size )
+{
+    TTF_LabelOrder *sorted = NULL;
+    TTF_LabelBox *boxes = NULL;
+    TTF_LabelPiece *pieces = NULL;
+    TTF_PlacedGlyph *placed = NULL;
+    TTF_PixelLUT *luts = NULL;
+    Uint32 *colors = NULL;
+    TTF_Context **pinned = NULL;
+    TTF_LabelTile *tiles = NULL;
+    TTF_Task *tasks = NULL;
+    int *order = NULL;
+    size_t maxplaced = 0;
+    int numpieces = 0, maxpieces = 0;
+    int numluts = 0, maxluts = 0, lut = 0;
+    int numpinned = 0;
+    int canvas_w, canvas_h;
+    int tiles_x, tiles_y, numtiles, ntasks;
+    TTF_Context *ctx = NULL;
+    TTF_Font *font = NULL;
+    int status = -1;
+    int i, j;
 
-    /* Get the dimensions of the text surface */
-    if ( ( TTF_SizeUTF8(font, text, &width, &height) < 0 ) || !width ) {
-        TTF_SetError("Text has zero width");
-        return(NULL);
-    }
+    TTF_CHECKPOINTER( canvas, -1 );
+    TTF_CHECKPOINTER( labels, -1 );
 
-    /* Create the target surface */
-    textbuf = TTF_CreateRGBSurface(width, height, 32,
-                               0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-    if ( textbuf == NULL ) {
-        return(NULL);
+    canvas_w = fn_w(canvas);
+    canvas_h = fn_h(canvas);
+    if ( numlabels <= 0 ) {
+        return 0;
     }
 
-    /* Adding bound checking to avoid all kinds of memory corruption errors
-       that may occur. */
-    dst_check = (Uint32*)(textbuf + 8) + fn_p(textbuf)/4 * fn_h(textbuf);
+    sorted = (TTF_LabelOrder *)malloc( numlabels * sizeof(*sorted) );
+    boxes = (TTF_LabelBox *)malloc( numlabels * sizeof(*boxes) );
+    pinned = (TTF_Context **)malloc( numlabels * sizeof(*pinned) );
+    if ( sorted == NULL || boxes == NULL || pinned == NULL ) {
+        TTF_OutOfMemory();
+        goto done;
+    }
 
-    /* check kerning */
-    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+    /* Lay out font by font, and color by color within a font */
+    for ( i = 0; i < numlabels; ++i ) {
+        sorted[i].label = i;
+        sorted[i].font = labels[i].font;
+        sorted[i].color = labels[i].color;
+    }
+    qsort( sorted, numlabels, sizeof(*sorted), TTF_CompareLabels );
 
-    /* Load and render each character */
-    textlen = strlen(text);
+    for ( i = 0; i < numlabels; ++i ) {
+        const TTF_Label *label = &labels[sorted[i].label];
+        TTF_LabelBox *box = &boxes[sorted[i].label];
+        size_t textlen;
+        int w, h, count;
+        FT_UInt prev_index = 0;
 
-    first = 1;
-    xstart = 0;
-    pixel = fg & 0x00FFFFFF;
-    TTF_FillRect(textbuf, pixel);
-    while ( textlen > 0 ) {
-        Uint16 c = UTF8_getch(&text, &textlen);
-        if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
+        box->x0 = box->x1 = 0;
+        if ( label->text == NULL || label->font == NULL ) {
             continue;
         }
-
-        error = Find_Glyph(font, c, CACHED_METRICS|CACHED_PIXMAP);
-        if ( error ) {
-            TTF_SetFTError("Couldn't find glyph", error);
-            free( textbuf );
-            return NULL;
-        }
-        glyph = font->current;
-        /* Ensure the width of the pixmap is correct. On some cases,
-         * freetype may report a larger pixmap than possible.*/
-        width = glyph->pixmap.width;
-        if (font->outline <= 0 && width > glyph->maxx - glyph->minx) {
-            width = glyph->maxx - glyph->minx;
+        if ( label->font != font ) {
+            font = label->font;
+            ctx = TTF_GetContext( font );
+            if ( ctx == NULL ) {
+                goto done;
+            }
+            /* Glyphs found now must stay cached until composited */
+            ++ctx->cache_pins;
+            pinned[numpinned++] = ctx;
         }
-        /* do kerning, if possible AC-Patch */
-        if ( use_kerning && prev_index && glyph->index ) {
-            FT_Vector delta;
-            FT_Get_Kerning( font->face, prev_index, glyph->index, ft_kerning_default, &delta );
-            xstart += delta.x >> 6;
+        if ( TTF_SizeUTF8( font, label->text, &w, &h ) < 0 ) {
+            goto done;
         }
 
-        /* Compensate for the wrap around bug with negative minx's */
-        if ( first && (glyph->minx < 0) ) {
-            xstart -= glyph->minx;
+        /* Labels off the canvas are skipped */
+        box->x0 = (label->x > 0) ? label->x : 0;
+        box->y0 = (label->y > 0) ? label->y : 0;
+        box->x1 = (label->x + w < canvas_w) ? label->x + w : canvas_w;
+        box->y1 = (label->y + h < canvas_h) ? label->y + h : canvas_h;
+        if ( box->x0 >= box->x1 || box->y0 >= box->y1 ) {
+            box->x0 = box->x1 = 0;
+            continue;
         }
-        first = 0;
 
-        for ( row = 0; row < glyph->pixmap.rows; ++row ) {
-            /* Make sure we don't go either over, or under the
-             * limit */
-            if ( row+glyph->yoffset < 0 ) {
-                continue;
+        /* One table per color, shared by all fonts */
+        if ( numluts == 0 || colors[lut] != label->color ) {
+            lut = 0;
+            while ( lut < numluts && colors[lut] != label->color ) {
+                ++lut;
             }
-            if ( row+glyph->yoffset >= fn_h(textbuf) ) {
-                continue;
+            if ( lut == numluts ) {
+                if ( numluts == maxluts ) {
+                    TTF_PixelLUT *more_luts;
+                    Uint32 *more_colors;
+
+                    maxluts = maxluts ? maxluts * 2 : 4;
+                    more_luts = (TTF_PixelLUT *)realloc( luts, maxluts * sizeof(*luts) );
+                    if ( more_luts != NULL ) {
+                        luts = more_luts;
+                    }
+                    more_colors = (Uint32 *)realloc( colors, maxluts * sizeof(*colors) );
+                    if ( more_colors != NULL ) {
+                        colors = more_colors;
+                    }
+                    if ( more_luts == NULL || more_colors == NULL ) {
+                        TTF_OutOfMemory();
+                        goto done;
+                    }
+                }
+                if ( TTF_initPixelLUT( &luts[numluts], format, label->color ) < 0 ) {
+                    goto done;
+                }
+                if ( luts[numluts].depth != fn_d(canvas) ) {
+                    TTF_SetError( "Canvas depth doesn't match the format" );
+                    goto done;
+                }
+                colors[numluts++] = label->color;
+            }
+        }
+        box->lut = lut;
+
+        textlen = strlen( label->text );
+        if ( textlen + 1 > maxplaced ) {
+            free( placed );
+            maxplaced = textlen + 1;
+            placed = (TTF_PlacedGlyph *)malloc( maxplaced * sizeof(*placed) );
+            if ( placed == NULL ) {
+                TTF_OutOfMemory();
+                goto done;
             }
-            dst = (Uint32*) (textbuf + 8) +
-                (row+glyph->yoffset) * fn_p(textbuf)/4 +
-                xstart + glyph->minx;
+        }
+        if ( numpieces + (int)textlen + 2 > maxpieces ) {
+            TTF_LabelPiece *more;
 
-            /* Added code to adjust src pointer for pixmaps to
-             * account for pitch.
-             * */
-            src = (Uint8*) (glyph->pixmap.buffer + glyph->pixmap.pitch * row);
-            for ( col = width; col>0 && dst < dst_check; --col) {
-                alpha = *src++;
-                *dst++ |= pixel | (alpha << 24);
+            while ( numpieces + (int)textlen + 2 > maxpieces ) {
+                maxpieces = maxpieces ? maxpieces * 2 : 256;
+            }
+            more = (TTF_LabelPiece *)realloc( pieces, maxpieces * sizeof(*pieces) );
+            if ( more == NULL ) {
+                TTF_OutOfMemory();
+                goto done;
             }
+            pieces = more;
         }
 
-        xstart += glyph->advance;
-        if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-            xstart += font->glyph_overhang;
+        count = Layout_WrappedLine( ctx, label->text, &prev_index, placed );
+        if ( count < 0 ) {
+            goto done;
         }
-        prev_index = glyph->index;
+        for ( j = 0; j < count; ++j ) {
+            TTF_LabelPiece *piece = &pieces[numpieces++];
+
+            piece->glyph = placed[j].glyph;
+            piece->x = label->x + placed[j].x;
+            piece->y = label->y + placed[j].glyph->yoffset;
+            piece->width = placed[j].width;
+            piece->rows = placed[j].glyph->pixmap.rows;
+            piece->label = sorted[i].label;
+        }
+        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
+            TTF_AddLinePiece( &pieces[numpieces++], font, label, sorted[i].label,
+                              TTF_underline_top_row(font), w );
+        }
+        if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
+            TTF_AddLinePiece( &pieces[numpieces++], font, label, sorted[i].label,
+                              TTF_strikethrough_top_row(font), w );
+        }
+    }
+    if ( numpieces == 0 ) {
+        status = 0;
+        goto done;
     }
 
-    /* Handle the underline style */
-    if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
-        row = TTF_underline_top_row(font);
-        TTF_drawLine_Blended(font, textbuf, row, pixel);
+    /* Glyph by glyph, then hand them out to the tiles they reach */
+    qsort( pieces, numpieces, sizeof(*pieces), TTF_ComparePieces );
+
+    if ( tile_size <= 0 ) {
+        tile_size = (canvas_w > canvas_h) ? canvas_w : canvas_h;
     }
+    tiles_x = (canvas_w + tile_size - 1) / tile_size;
+    tiles_y = (canvas_h + tile_size - 1) / tile_size;
+    numtiles = tiles_x * tiles_y;
+    tiles = (TTF_LabelTile *)calloc( numtiles, sizeof(*tiles) + sizeof(*tasks) );
+    if ( tiles == NULL ) {
+        TTF_OutOfMemory();
+        goto done;
+    }
+    tasks = (TTF_Task *)(tiles + numtiles);
 
-    /* Handle the strikethrough style */
-    if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
-        row = TTF_strikethrough_top_row(font);
-        TTF_drawLine_Blended(font, textbuf, row, pixel);
+    /* Count the pieces of each tile, then place them */
+    for ( i = 0; i < numpieces; ++i ) {
+        int x0, y0, x1, y1, tx, ty;
+
+        TTF_ClipPiece( &pieces[i], &boxes[pieces[i].label], &x0, &y0, &x1, &y1 );
+        for ( ty = y0 / tile_size; x0 < x1 && y0 < y1 && ty <= (y1 - 1) / tile_size; ++ty ) {
+            for ( tx = x0 / tile_size; tx <= (x1 - 1) / tile_size; ++tx ) {
+                ++tiles[ty * tiles_x + tx].count;
+            }
+        }
     }
-    return(textbuf);
-}
+    for ( i = 0, j = 0; i < numtiles; ++i ) {
+        tiles[i].first = j;
+        j += tiles[i].count;
+        tiles[i].count = 0;
+    }
+    order = (int *)malloc( (j + 1) * sizeof(*order) );
+    if ( order == NULL ) {
+        TTF_OutOfMemory();
+        goto done;
+    }
+    for ( i = 0; i < numpieces; ++i ) {
+        int x0, y0, x1, y1, tx, ty;
 
-Uint8 *TTF_RenderUNICODE_Blended(TTF_Font *font,
-                const Uint16 *text, Uint32 fg)
-{
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+        TTF_ClipPiece( &pieces[i], &boxes[pieces[i].label], &x0, &y0, &x1, &y1 );
+        for ( ty = y0 / tile_size; x0 < x1 && y0 < y1 && ty <= (y1 - 1) / tile_size; ++ty ) {
+            for ( tx = x0 / tile_size; tx <= (x1 - 1) / tile_size; ++tx ) {
+                TTF_LabelTile *tile = &tiles[ty * tiles_x + tx];
 
-    TTF_CHECKPOINTER(text, NULL);
+                order[tile->first + tile->count++] = i;
+            }
+        }
+    }
 
-    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
-    if ( utf8 ) {
-        UCS2_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Blended(font, (char *)utf8, fg);
-        free(utf8);
+    ntasks = 0;
+    for ( i = 0; i < numtiles; ++i ) {
+        TTF_LabelTile *tile = &tiles[i];
+
+        if ( tile->count == 0 ) {
+            continue;
+        }
+        tile->canvas = canvas;
+        tile->pieces = pieces;
+        tile->boxes = boxes;
+        tile->luts = luts;
+        tile->order = order;
+        tile->x0 = (i % tiles_x) * tile_size;
+        tile->y0 = (i / tiles_x) * tile_size;
+        tile->x1 = tile->x0 + tile_size;
+        tile->y1 = tile->y0 + tile_size;
+        tasks[ntasks].run = Composite_LabelTile;
+        tasks[ntasks].data = tile;
+        ++ntasks;
+    }
+
+    /* The calling thread takes the first tile itself */
+    if ( ntasks > 1 && TTF_pool.nworkers > 0 ) {
+        TTF_TaskGroup group = { 0 };
+
+        TTF_SubmitTasks( tasks + 1, ntasks - 1, &group );
+        Composite_LabelTile( tasks[0].data );
+        TTF_WaitTasks( &group );
     } else {
-        TTF_OutOfMemory();
+        for ( i = 0; i < ntasks; ++i ) {
+            Composite_LabelTile( tasks[i].data );
+        }
     }
-    return surface;
+    status = 0;
+
+done:
+    for ( i = 0; i < numpinned; ++i ) {
+        --pinned[i]->cache_pins;
+    }
+    free( order );
+    free( tiles );
+    free( colors );
+    free( luts );
+    free( placed );
+    free( pieces );
+    free( pinned );
+    free( boxes );
+    free( sorted );
+    return status;
 }
 
+/* Label atlas.  Labels are rendered into one page, packed on shelves:
+   rows as high as the first label put on them, filled left to right,
+   each keeping a sorted list of the spans still free on it.  A label
+   goes on the shelf closest to its height with a span wide enough,
+   else on a new shelf below the others, and only failing that on any
+   shelf high enough.  Releasing a label gives its span back, merged
+   with its neighbours, and a shelf left empty at the bottom is given
+   back to the page.  Labels are found again in a hash table by the
+   state of their font, color and text, keyed like the surface cache, so
+   the same label is only rendered once.
+*/
+#define ATLAS_PADDING   1   /* transparent pixels right of and below labels */
+
+typedef struct {
+    int x;
+    int w;
+} TTF_AtlasSpan;
+
+typedef struct {
+    int y;
+    int h;
+    int labels;
+    TTF_AtlasSpan *spans;   /* free, sorted by x */
+    int numspans;
+    int maxspans;
+} TTF_AtlasShelf;
+
+typedef struct {
+    char *text;             /* NULL while the handle is unused */
+    TTF_SurfaceKey key;
+    Uint32 hash;
+    int refcount;
+    int shelf;
+    TTF_Rect rect;
+    int next;               /* in the hash chain, or the unused handles */
+} TTF_AtlasEntry;
+
+struct _TTF_LabelAtlas {
+    Uint8 *page;
+    int format;
+    TTF_AtlasShelf *shelves;
+    int numshelves;
+    int maxshelves;
+    int bottom;             /* first row below the shelves */
+    TTF_AtlasEntry *entries;    /* handle - 1 */
+    int numentries;
+    int maxentries;
+    int unused;             /* first unused handle - 1, or -1 */
+    int *buckets;
+    int numbuckets;
+    int labels;
+    int references;
+    long used;
+    TTF_Rect dirty;
+};
 
-Uint8 *TTF_RenderText_Blended_Wrapped(TTF_Font *font, const char *text, Uint32 fg, Uint32 wrapLength)
+static void TTF_AtlasDirty( TTF_LabelAtlas *atlas, int x, int y, int w, int h )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
-
-    TTF_CHECKPOINTER(text, NULL);
-
-    utf8 = (Uint8*)malloc(strlen(text)*2+1);
-    if ( utf8 ) {
-        LATIN1_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Blended_Wrapped(font, (char *)utf8, fg, wrapLength);
-        free(utf8);
-    } else {
-        TTF_OutOfMemory();
+    TTF_Rect *dirty = &atlas->dirty;
+
+    if ( dirty->w == 0 ) {
+        dirty->x = x;
+        dirty->y = y;
+        dirty->w = w;
+        dirty->h = h;
+        return;
+    }
+    if ( x < dirty->x ) {
+        dirty->w += dirty->x - x;
+        dirty->x = x;
+    }
+    if ( y < dirty->y ) {
+        dirty->h += dirty->y - y;
+        dirty->y = y;
+    }
+    if ( x + w > dirty->x + dirty->w ) {
+        dirty->w = x + w - dirty->x;
+    }
+    if ( y + h > dirty->y + dirty->h ) {
+        dirty->h = y + h - dirty->y;
     }
-    return surface;
 }
 
-static int CharacterIsDelimiter(char c, const char *delimiters)
+static int TTF_AtlasAddSpan( TTF_AtlasShelf *shelf, int at, int x, int w )
 {
-    while (*delimiters) {
-        if (c == *delimiters) {
-            return 1;
+    if ( shelf->numspans == shelf->maxspans ) {
+        int maxspans = shelf->maxspans ? shelf->maxspans * 2 : 4;
+        TTF_AtlasSpan *spans = (TTF_AtlasSpan *)realloc( shelf->spans, maxspans * sizeof(*spans) );
+
+        if ( spans == NULL ) {
+            TTF_OutOfMemory();
+            return -1;
         }
-        ++delimiters;
+        shelf->spans = spans;
+        shelf->maxspans = maxspans;
     }
+    memmove( &shelf->spans[at + 1], &shelf->spans[at],
+             (shelf->numspans - at) * sizeof(*shelf->spans) );
+    shelf->spans[at].x = x;
+    shelf->spans[at].w = w;
+    ++shelf->numspans;
     return 0;
 }
 
-Uint8 *TTF_RenderUTF8_Blended_Wrapped(TTF_Font *font,
-                                    const char *text, Uint32 fg, Uint32 wrapLength)
+static void TTF_AtlasRemoveSpan( TTF_AtlasShelf *shelf, int at )
 {
-    int first;
-    int xstart;
-    int width, height;
-    Uint8 *textbuf;
-    Uint32 alpha;
-    Uint32 pixel;
-    Uint8 *src;
-    Uint32 *dst;
-    Uint32 *dst_check;
-    int row, col;
-    c_glyph *glyph;
-    FT_Error error;
-    FT_Long use_kerning;
-    FT_UInt prev_index = 0;
-    const int lineSpace = 2;
-    int line, numLines, rowSize;
-    char *str, **strLines;
-    size_t textlen;
+    --shelf->numspans;
+    memmove( &shelf->spans[at], &shelf->spans[at + 1],
+             (shelf->numspans - at) * sizeof(*shelf->spans) );
+}
 
-    TTF_CHECKPOINTER(text, NULL);
+/* The first span of a shelf that fits a width, or -1 */
+static int TTF_AtlasFindSpan( const TTF_AtlasShelf *shelf, int w )
+{
+    int i;
 
-    /* Get the dimensions of the text surface */
-    if ( (TTF_SizeUTF8(font, text, &width, &height) < 0) || !width ) {
-        TTF_SetError("Text has zero width");
-        return(NULL);
+    for ( i = 0; i < shelf->numspans; ++i ) {
+        if ( shelf->spans[i].w >= w ) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    numLines = 1;
-    str = NULL;
-    strLines = NULL;
-    if ( wrapLength > 0 && *text ) {
-        const char *wrapDelims = " \t\r\n";
-        int w, h;
-        int line = 0;
-        char *spot, *tok, *next_tok, *end;
-        char delim;
-        size_t str_len = strlen(text);
-
-        numLines = 0;
+/* Find room for w x h pixels, padding included; returns the shelf, or
+   -1 if the page is full */
+static int TTF_AtlasPack( TTF_LabelAtlas *atlas, int w, int h, int *x )
+{
+    int best = -1, span = -1;
+    int pass, i;
 
-        str = (char*)malloc(str_len+1);
-        if ( str == NULL ) {
-            TTF_SetError("Out of memory");
-            return(NULL);
-        }
+    for ( pass = 0; pass < 2 && best < 0; ++pass ) {
+        for ( i = 0; i < atlas->numshelves; ++i ) {
+            const TTF_AtlasShelf *shelf = &atlas->shelves[i];
+            int at;
 
-        strncpy(str, text, str_len+1);
-        tok = str;
-        end = str + str_len;
-        do {
-            strLines = (char **)realloc(strLines, (numLines+1)*sizeof(*strLines));
-            if (!strLines) {
-                TTF_SetError("Out of memory");
-                return(NULL);
+            /* First only shelves a quarter higher at most */
+            if ( shelf->h < h || (pass == 0 && shelf->h > h + h / 4) ) {
+                continue;
             }
-            strLines[numLines++] = tok;
-
-            /* Look for the end of the line */
-            if ((spot = strchr(tok, '\r')) != NULL ||
-                (spot = strchr(tok, '\n')) != NULL) {
-                if (*spot == '\r') {
-                    ++spot;
-                }
-                if (*spot == '\n') {
-                    ++spot;
+            if ( best >= 0 && shelf->h >= atlas->shelves[best].h ) {
+                continue;
+            }
+            at = TTF_AtlasFindSpan( shelf, w );
+            if ( at >= 0 ) {
+                best = i;
+                span = at;
+            }
+        }
+        if ( best < 0 && pass == 0 &&
+             atlas->bottom + h <= fn_h(atlas->page) && w <= fn_w(atlas->page) ) {
+            /* Open a new shelf */
+            TTF_AtlasShelf *shelf;
+
+            if ( atlas->numshelves == atlas->maxshelves ) {
+                int maxshelves = atlas->maxshelves ? atlas->maxshelves * 2 : 16;
+                TTF_AtlasShelf *shelves = (TTF_AtlasShelf *)realloc( atlas->shelves,
+                                            maxshelves * sizeof(*shelves) );
+                if ( shelves == NULL ) {
+                    TTF_OutOfMemory();
+                    return -1;
                 }
-            } else {
-                spot = end;
+                atlas->shelves = shelves;
+                atlas->maxshelves = maxshelves;
             }
-            next_tok = spot;
+            shelf = &atlas->shelves[atlas->numshelves];
+            memset( shelf, 0, sizeof(*shelf) );
+            shelf->y = atlas->bottom;
+            shelf->h = h;
+            if ( TTF_AtlasAddSpan( shelf, 0, 0, fn_w(atlas->page) ) < 0 ) {
+                return -1;
+            }
+            atlas->bottom += h;
+            best = atlas->numshelves++;
+            span = 0;
+        }
+    }
+    if ( best < 0 ) {
+        TTF_SetError( "Label atlas is full" );
+        return -1;
+    }
 
-            /* Get the longest string that will fit in the desired space */
-            for ( ; ; ) {
-                /* Strip trailing whitespace */
-                while ( spot > tok &&
-                        CharacterIsDelimiter(spot[-1], wrapDelims) ) {
-                    --spot;
-                }
-                if ( spot == tok ) {
-                    if (CharacterIsDelimiter(*spot, wrapDelims)) {
-                        *spot = '\0';
-                    }
-                    break;
-                }
-                delim = *spot;
-                *spot = '\0';
+    *x = atlas->shelves[best].spans[span].x;
+    atlas->shelves[best].spans[span].x += w;
+    atlas->shelves[best].spans[span].w -= w;
+    if ( atlas->shelves[best].spans[span].w == 0 ) {
+        TTF_AtlasRemoveSpan( &atlas->shelves[best], span );
+    }
+    ++atlas->shelves[best].labels;
+    return best;
+}
 
-                TTF_SizeUTF8(font, tok, &w, &h);
-                if ((Uint32)w <= wrapLength) {
-                    break;
-                } else {
-                    /* Back up and try again... */
-                    *spot = delim;
-                }
+/* Give the room of a label back to its shelf */
+static int TTF_AtlasUnpack( TTF_LabelAtlas *atlas, int index, int x, int w )
+{
+    TTF_AtlasShelf *shelf = &atlas->shelves[index];
+    int at;
 
-                while ( spot > tok &&
-                        !CharacterIsDelimiter(spot[-1], wrapDelims) ) {
-                    --spot;
-                }
-                if ( spot > tok ) {
-                    next_tok = spot;
-                }
-            }
-            tok = next_tok;
-        } while (tok < end);
+    at = 0;
+    while ( at < shelf->numspans && shelf->spans[at].x < x ) {
+        ++at;
     }
-
-    /* Create the target surface */
-    textbuf = TTF_CreateRGBSurface(
-            (numLines > 1) ? wrapLength : width,
-            height * numLines + (lineSpace * (numLines - 1)),
-            32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-    if ( textbuf == NULL ) {
-        if ( strLines ) {
-            free(strLines);
-            free(str);
+    if ( at > 0 && shelf->spans[at - 1].x + shelf->spans[at - 1].w == x ) {
+        shelf->spans[at - 1].w += w;
+        if ( at < shelf->numspans && x + w == shelf->spans[at].x ) {
+            shelf->spans[at - 1].w += shelf->spans[at].w;
+            TTF_AtlasRemoveSpan( shelf, at );
         }
-        return(NULL);
+    } else if ( at < shelf->numspans && x + w == shelf->spans[at].x ) {
+        shelf->spans[at].x = x;
+        shelf->spans[at].w += w;
+    } else if ( TTF_AtlasAddSpan( shelf, at, x, w ) < 0 ) {
+        return -1;
     }
+    --shelf->labels;
+
+    /* Empty shelves at the bottom go back to the page */
+    while ( atlas->numshelves > 0 &&
+            atlas->shelves[atlas->numshelves - 1].labels == 0 ) {
+        shelf = &atlas->shelves[--atlas->numshelves];
+        atlas->bottom = shelf->y;
+        free( shelf->spans );
+    }
+    return 0;
+}
 
-    rowSize = fn_p(textbuf)/4 * height;
+static int TTF_AtlasGrowBuckets( TTF_LabelAtlas *atlas )
+{
+    int numbuckets = atlas->numbuckets ? atlas->numbuckets * 2 : 64;
+    int *buckets = (int *)malloc( numbuckets * sizeof(*buckets) );
+    int i;
 
-    /* Adding bound checking to avoid all kinds of memory corruption errors
-     that may occur. */
-    dst_check = (Uint32*)(textbuf + 8) + fn_p(textbuf)/4 * fn_h(textbuf);
+    if ( buckets == NULL ) {
+        TTF_OutOfMemory();
+        return -1;
+    }
+    for ( i = 0; i < numbuckets; ++i ) {
+        buckets[i] = -1;
+    }
+    for ( i = 0; i < atlas->numentries; ++i ) {
+        TTF_AtlasEntry *entry = &atlas->entries[i];
 
-    /* check kerning */
-    use_kerning = FT_HAS_KERNING( font->face ) && font->kerning;
+        if ( entry->text ) {
+            entry->next = buckets[entry->hash & (numbuckets - 1)];
+            buckets[entry->hash & (numbuckets - 1)] = i;
+        }
+    }
+    free( atlas->buckets );
+    atlas->buckets = buckets;
+    atlas->numbuckets = numbuckets;
+    return 0;
+}
 
-    /* Load and render each character */
-    pixel = fg & 0x00FFFFFF;
-    TTF_FillRect(textbuf, pixel); /* Initialize with fg and 0 alpha */
+TTF_LabelAtlas *TTF_CreateLabelAtlas( int width, int height, int format )
+{
+    TTF_LabelAtlas *atlas;
+    TTF_PixelLUT lut;
 
-    for ( line = 0; line < numLines; line++ ) {
-        if ( strLines ) {
-            text = strLines[line];
-        }
-        textlen = strlen(text);
-        first = 1;
-        xstart = 0;
-        while ( textlen > 0 ) {
-            Uint16 c = UTF8_getch(&text, &textlen);
-            if ( c == UNICODE_BOM_NATIVE || c == UNICODE_BOM_SWAPPED ) {
-                continue;
-            }
+    if ( width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF ) {
+        TTF_SetError( "Invalid atlas size %dx%d", width, height );
+        return NULL;
+    }
+    if ( (format & 0xFF) == TTF_PIXELFORMAT_INDEX8 ||
+         (format & 0xFF) == TTF_PIXELFORMAT_INDEX1MSB ) {
+        TTF_SetError( "Label atlas needs a format without a palette" );
+        return NULL;
+    }
+    if ( TTF_initPixelLUT( &lut, format, 0 ) < 0 ) {
+        return NULL;
+    }
 
-            error = Find_Glyph(font, c, CACHED_METRICS|CACHED_PIXMAP);
-            if ( error ) {
-                TTF_SetFTError("Couldn't find glyph", error);
-                free( textbuf );
-                return NULL;
-            }
-            glyph = font->current;
-            /* Ensure the width of the pixmap is correct. On some cases,
-             * freetype may report a larger pixmap than possible.*/
-            width = glyph->pixmap.width;
-            if ( font->outline <= 0 && width > glyph->maxx - glyph->minx ) {
-                width = glyph->maxx - glyph->minx;
-            }
-            /* do kerning, if possible AC-Patch */
-            if ( use_kerning && prev_index && glyph->index ) {
-                FT_Vector delta;
-                FT_Get_Kerning( font->face, prev_index, glyph->index, ft_kerning_default, &delta );
-                xstart += delta.x >> 6;
-            }
+    atlas = (TTF_LabelAtlas *)calloc( 1, sizeof(*atlas) );
+    if ( atlas == NULL ) {
+        TTF_OutOfMemory();
+        return NULL;
+    }
+    atlas->page = TTF_CreateRGBSurface( width, height, lut.depth, 0, 0, 0, 0 );
+    if ( atlas->page == NULL || TTF_AtlasGrowBuckets( atlas ) < 0 ) {
+        free( atlas->page );
+        free( atlas );
+        return NULL;
+    }
+    atlas->format = format;
+    atlas->unused = -1;
+    return atlas;
+}
 
-            /* Compensate for the wrap around bug with negative minx's */
-            if ( first && (glyph->minx < 0) ) {
-                xstart -= glyph->minx;
-            }
-            first = 0;
+int TTF_AddAtlasLabel( TTF_LabelAtlas *atlas, TTF_Font *font, const char *text, Uint32 fg )
+{
+    TTF_AtlasEntry *entry;
+    TTF_SurfaceKey key;
+    Uint8 *label;
+    Uint32 hash;
+    int index, shelf, x, row;
+    int bpp;
+
+    TTF_CHECKPOINTER( atlas, -1 );
+    TTF_CHECKPOINTER( font, -1 );
+    TTF_CHECKPOINTER( text, -1 );
+
+    /* The same label again only takes a reference, unless the font
+       changed since.  Zeroed first, so padding doesn't spoil hashing */
+    memset( &key, 0, sizeof(key) );
+    key.font = font;
+    key.serial = font->serial;
+    key.style = font->style;
+    key.outline = font->outline;
+    key.hinting = font->hinting;
+    key.kerning = font->kerning;
+    key.mode = TTF_RENDER_BLENDED;
+    key.format = atlas->format;
+    key.fg = fg;
+    hash = TTF_HashSurface( &key, text );
+    for ( index = atlas->buckets[hash & (atlas->numbuckets - 1)]; index >= 0; index = entry->next ) {
+        entry = &atlas->entries[index];
+        if ( entry->hash == hash && memcmp( &entry->key, &key, sizeof(key) ) == 0 &&
+             strcmp( entry->text, text ) == 0 ) {
+            ++entry->refcount;
+            ++atlas->references;
+            return index + 1;
+        }
+    }
 
-            for ( row = 0; row < glyph->pixmap.rows; ++row ) {
-                /* Make sure we don't go either over, or under the
-                 * limit */
-                if ( row+glyph->yoffset < 0 ) {
-                    continue;
-                }
-                if ( row+glyph->yoffset >= fn_h(textbuf) ) {
-                    continue;
-                }
-                dst =  ((Uint32*)(textbuf + 8) + rowSize * line) +
-                (row+glyph->yoffset) * fn_p(textbuf)/4 +
-                xstart + glyph->minx;
-
-                /* Added code to adjust src pointer for pixmaps to
-                 * account for pitch.
-                 * */
-                src = (Uint8*) (glyph->pixmap.buffer + glyph->pixmap.pitch * row);
-                for ( col = width; col>0 && dst < dst_check; --col) {
-                    alpha = *src++;
-                    *dst++ |= pixel | (alpha << 24);
-                }
-            }
+    label = TTF_RenderUTF8_Blended_Format( font, text, fg, atlas->format );
+    if ( label == NULL ) {
+        return -1;
+    }
+    shelf = TTF_AtlasPack( atlas, fn_w(label) + ATLAS_PADDING, fn_h(label) + ATLAS_PADDING, &x );
+    if ( shelf < 0 ) {
+        free( label );
+        return -1;
+    }
 
-            xstart += glyph->advance;
-            if ( TTF_HANDLE_STYLE_BOLD(font) ) {
-                xstart += font->glyph_overhang;
+    /* Take a handle */
+    if ( atlas->unused >= 0 ) {
+        index = atlas->unused;
+        atlas->unused = atlas->entries[index].next;
+    } else {
+        if ( atlas->numentries == atlas->maxentries ) {
+            int maxentries = atlas->maxentries ? atlas->maxentries * 2 : 64;
+            TTF_AtlasEntry *entries = (TTF_AtlasEntry *)realloc( atlas->entries,
+                                        maxentries * sizeof(*entries) );
+            if ( entries == NULL ) {
+                TTF_OutOfMemory();
+                TTF_AtlasUnpack( atlas, shelf, x, fn_w(label) + ATLAS_PADDING );
+                free( label );
+                return -1;
             }
-            prev_index = glyph->index;
+            atlas->entries = entries;
+            atlas->maxentries = maxentries;
         }
-
-        /* Handle the underline style *
-        if ( TTF_HANDLE_STYLE_UNDERLINE(font) ) {
-            row = TTF_underline_top_row(font);
-            TTF_drawLine_Blended(font, textbuf, row, pixel);
+        index = atlas->numentries++;
+        atlas->entries[index].text = NULL;
+    }
+    entry = &atlas->entries[index];
+    entry->text = (char *)malloc( strlen( text ) + 1 );
+    if ( entry->text == NULL ) {
+        TTF_OutOfMemory();
+        entry->next = atlas->unused;
+        atlas->unused = index;
+        TTF_AtlasUnpack( atlas, shelf, x, fn_w(label) + ATLAS_PADDING );
+        free( label );
+        return -1;
+    }
+    strcpy( entry->text, text );
+    entry->key = key;
+    entry->hash = hash;
+    entry->refcount = 1;
+    entry->shelf = shelf;
+    entry->rect.x = x;
+    entry->rect.y = atlas->shelves[shelf].y;
+    entry->rect.w = fn_w(label);
+    entry->rect.h = fn_h(label);
+    entry->next = atlas->buckets[hash & (atlas->numbuckets - 1)];
+    atlas->buckets[hash & (atlas->numbuckets - 1)] = index;
+
+    /* Copy the label in, clearing what released ones left around it */
+    bpp = fn_d(atlas->page) / 8;
+    for ( row = 0; row < atlas->shelves[shelf].h; ++row ) {
+        Uint8 *dst = atlas->page + 8 + (entry->rect.y + row) * fn_p(atlas->page) + x * bpp;
+        int w = entry->rect.w + ATLAS_PADDING;
+
+        if ( row < entry->rect.h ) {
+            memcpy( dst, label + 8 + row * fn_p(label), entry->rect.w * bpp );
+            memset( dst + entry->rect.w * bpp, 0, (w - entry->rect.w) * bpp );
+        } else {
+            memset( dst, 0, w * bpp );
         }
-        */
+    }
+    free( label );
+    TTF_AtlasDirty( atlas, x, entry->rect.y, entry->rect.w + ATLAS_PADDING,
+                    atlas->shelves[shelf].h );
+
+    ++atlas->labels;
+    ++atlas->references;
+    atlas->used += (long)(entry->rect.w + ATLAS_PADDING) * atlas->shelves[shelf].h;
+    if ( atlas->labels > atlas->numbuckets ) {
+        TTF_AtlasGrowBuckets( atlas );
+    }
+    return index + 1;
+}
 
-        /* Handle the strikethrough style *
-        if ( TTF_HANDLE_STYLE_STRIKETHROUGH(font) ) {
-            row = TTF_strikethrough_top_row(font);
-            TTF_drawLine_Blended(font, textbuf, row, pixel);
-        }
-        */
+static TTF_AtlasEntry *TTF_AtlasEntryOf( const TTF_LabelAtlas *atlas, int handle )
+{
+    if ( handle < 1 || handle > atlas->numentries || !atlas->entries[handle - 1].text ) {
+        TTF_SetError( "Invalid atlas label %d", handle );
+        return NULL;
     }
+    return &atlas->entries[handle - 1];
+}
 
-    if ( strLines ) {
-        free(strLines);
-        free(str);
+int TTF_GetAtlasLabel( const TTF_LabelAtlas *atlas, int handle, TTF_Rect *rect, float *uv )
+{
+    const TTF_AtlasEntry *entry;
+
+    TTF_CHECKPOINTER( atlas, -1 );
+
+    entry = TTF_AtlasEntryOf( atlas, handle );
+    if ( entry == NULL ) {
+        return -1;
     }
-    return(textbuf);
+    if ( rect ) {
+        *rect = entry->rect;
+    }
+    if ( uv ) {
+        uv[0] = (float)entry->rect.x / fn_w(atlas->page);
+        uv[1] = (float)entry->rect.y / fn_h(atlas->page);
+        uv[2] = (float)(entry->rect.x + entry->rect.w) / fn_w(atlas->page);
+        uv[3] = (float)(entry->rect.y + entry->rect.h) / fn_h(atlas->page);
+    }
+    return 0;
 }
 
-Uint8 *TTF_RenderUNICODE_Blended_Wrapped(TTF_Font *font, const Uint16* text,
-                                               Uint32 fg, Uint32 wrapLength)
+int TTF_ReleaseAtlasLabel( TTF_LabelAtlas *atlas, int handle )
 {
-    Uint8 *surface = NULL;
-    Uint8 *utf8;
+    TTF_AtlasEntry *entry;
+    int *link;
+    int index;
 
-    TTF_CHECKPOINTER(text, NULL);
+    TTF_CHECKPOINTER( atlas, -1 );
 
-    utf8 = (Uint8*)malloc(UCS2_len(text)*3+1);
-    if ( utf8 ) {
-        UCS2_to_UTF8(text, utf8);
-        surface = TTF_RenderUTF8_Blended_Wrapped(font, (char *)utf8, fg, wrapLength);
-        free(utf8);
-    } else {
-        TTF_OutOfMemory();
+    entry = TTF_AtlasEntryOf( atlas, handle );
+    if ( entry == NULL ) {
+        return -1;
     }
-    return surface;
+    --atlas->references;
+    if ( --entry->refcount > 0 ) {
+        return 0;
+    }
+
+    /* Unlink it and give its room back */
+    index = handle - 1;
+    link = &atlas->buckets[entry->hash & (atlas->numbuckets - 1)];
+    while ( *link != index ) {
+        link = &atlas->entries[*link].next;
+    }
+    *link = entry->next;
+    atlas->used -= (long)(entry->rect.w + ATLAS_PADDING) * atlas->shelves[entry->shelf].h;
+    --atlas->labels;
+    free( entry->text );
+    entry->text = NULL;
+    entry->next = atlas->unused;
+    atlas->unused = index;
+    return TTF_AtlasUnpack( atlas, entry->shelf, entry->rect.x, entry->rect.w + ATLAS_PADDING );
 }
 
-Uint8 *TTF_RenderGlyph_Blended(TTF_Font *font, Uint16 ch, Uint32 fg)
+const Uint8 *TTF_GetAtlasPage( TTF_LabelAtlas *atlas, TTF_Rect *dirty )
 {
-    Uint16 ucs2[2] = { ch, 0 };
-    Uint8 utf8[4];
+    TTF_CHECKPOINTER( atlas, NULL );
 
-    UCS2_to_UTF8(ucs2, utf8);
-    return TTF_RenderUTF8_Blended(font, (char *)utf8, fg);
+    if ( dirty ) {
+        *dirty = atlas->dirty;
+        atlas->dirty.x = atlas->dirty.y = atlas->dirty.w = atlas->dirty.h = 0;
+    }
+    return atlas->page;
+}
+
+void TTF_GetAtlasStats( const TTF_LabelAtlas *atlas, TTF_AtlasStats *stats )
+{
+    long area, free_area, largest, block;
+    int i, j;
+
+    if ( atlas == NULL || stats == NULL ) {
+        return;
+    }
+    area = (long)fn_w(atlas->page) * fn_h(atlas->page);
+    free_area = area - atlas->used;
+
+    /* The largest block free for a label, on a shelf or below them all */
+    largest = (long)fn_w(atlas->page) * (fn_h(atlas->page) - atlas->bottom);
+    for ( i = 0; i < atlas->numshelves; ++i ) {
+        const TTF_AtlasShelf *shelf = &atlas->shelves[i];
+
+        for ( j = 0; j < shelf->numspans; ++j ) {
+            block = (long)shelf->spans[j].w * shelf->h;
+            if ( block > largest ) {
+                largest = block;
+            }
+        }
+    }
+
+    stats->labels = atlas->labels;
+    stats->references = atlas->references;
+    stats->shelves = atlas->numshelves;
+    stats->used_pixels = atlas->used;
+    stats->free_pixels = free_area;
+    stats->occupancy = (float)atlas->used / area;
+    stats->fragmentation = free_area > 0 ? 1.0f - (float)largest / free_area : 0.0f;
+}
+
+void TTF_FreeLabelAtlas( TTF_LabelAtlas *atlas )
+{
+    int i;
+
+    if ( atlas ) {
+        for ( i = 0; i < atlas->numentries; ++i ) {
+            free( atlas->entries[i].text );
+        }
+        for ( i = 0; i < atlas->numshelves; ++i ) {
+            free( atlas->shelves[i].spans );
+        }
+        free( atlas->entries );
+        free( atlas->shelves );
+        free( atlas->buckets );
+        free( atlas->page );
+        free( atlas );
+    }
 }
 
 void TTF_SetFontStyle( TTF_Font* font, int style )
@@ -2203,6 +9211,7 @@ void TTF_SetFontOutline( TTF_Font* font, int outline )
 {
     font->outline = outline;
     Flush_Cache( font );
+    TTF_CloseVariants( font );
 }
 
 int TTF_GetFontOutline( const TTF_Font* font )
@@ -2222,6 +9231,7 @@ void TTF_SetFontHinting( TTF_Font* font, int hinting )
         font->hinting = 0;
 
     Flush_Cache( font );
+    TTF_CloseVariants( font );
 }
 
 int TTF_GetFontHinting( const TTF_Font* font )
@@ -2237,21 +9247,41 @@ int TTF_GetFontHinting( const TTF_Font* font )
 
 void TTF_Quit( void )
 {
+    if ( TTF_INITIALIZED() == 1 ) {
+        TTF_StopPool();
+    }
+    pthread_mutex_lock( &TTF_library_lock );
     if ( TTF_initialized ) {
-        if ( --TTF_initialized == 0 ) {
+        if ( __atomic_sub_fetch( &TTF_initialized, 1, __ATOMIC_RELEASE ) == 0 ) {
             FT_Done_FreeType( library );
         }
     }
+    pthread_mutex_unlock( &TTF_library_lock );
 }
 
 int TTF_WasInit( void )
 {
-    return TTF_initialized;
+    return TTF_INITIALIZED();
+}
+
+int TTF_SetThreadSafe( int enable )
+{
+    return __atomic_exchange_n( &TTF_threadsafe, enable ? 1 : 0, __ATOMIC_ACQ_REL );
+}
+
+int TTF_FontIsThreadSafe( const TTF_Font *font )
+{
+    return font->shared;
 }
 
 int TTF_GetFontKerningSize(TTF_Font* font, int prev_index, int index)
 {
     FT_Vector delta;
-    FT_Get_Kerning( font->face, prev_index, index, ft_kerning_default, &delta );
+    TTF_Context *ctx = TTF_GetContext(font);
+
+    if ( ctx == NULL ) {
+        return 0;
+    }
+    FT_Get_Kerning( ctx->face, prev_index, index, ft_kerning_default, &delta );
     return (delta.x >> 6);
 }
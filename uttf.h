@@ -46,6 +46,7 @@ extern "C" {
 #define Uint32 uint32_t
 #define Sint32 int32_t
 #define Sint64 int64_t
+#define Uint64 uint64_t
 #define fn_w(ptr) (((uint16_t*)ptr)[0])
 #define fn_h(ptr) (((uint16_t*)ptr)[1])
 #define fn_d(ptr) (((uint16_t*)ptr)[2])
@@ -54,6 +55,8 @@ extern "C" {
 #define fn_set_h(ptr, h) { ((uint16_t*)ptr)[1] = h; }
 #define fn_set_d(ptr, d) { ((uint16_t*)ptr)[2] = d; }
 #define fn_set_p(ptr, p) { ((uint16_t*)ptr)[3] = p; }
+/* 8-bit shaded surfaces carry their 256 ARGB8888 colors after the pixels */
+#define fn_palette(ptr) ((Uint32*)((Uint8*)ptr + 8 + fn_p(ptr) * fn_h(ptr)))
 #define fn_to_sdl_surface(ptr) SDL_CreateRGBSurfaceFrom((void*)((Uint8*)((Uint8*)ptr + 8)), fn_w(ptr), fn_h(ptr), fn_d(ptr), fn_p(ptr), 0,0,0,0 )
 #define cl_g(color) (((color & 0x0000FF00) >> 8) & 0xFF)
 #define cl_r(color) (((color & 0x00FF0000) >> 16) & 0xFF)
@@ -63,20 +66,57 @@ extern "C" {
 
 //0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
 
+/* Create a zeroed surface: a header of 16-bit width, height, depth and
+   pitch, read with the fn_ macros above, followed by the pixels.  The
+   unused arguments mirror SDL_CreateRGBSurface().  A palette surface is
+   8 bits deep with room for 'ncolors' ARGB8888 colors after the pixels.
+   Surfaces are freed with free().  Both return NULL if out of memory.
+ */
+extern DECLSPEC Uint8 * SDLCALL TTF_CreateRGBSurface(int width, int heigth, int depth, int unused0, int unused1, int unused2, int unused3);
+extern DECLSPEC Uint8 * SDLCALL TTF_CreatePaletteSurface(int width, int heigth, int ncolors);
+
 /* This function tells the library whether UNICODE text is generally
    byteswapped.  A UNICODE BOM character in a string will override
    this setting for the remainder of that string.
+   The setting applies to the calling thread only.
 */
 extern DECLSPEC void SDLCALL TTF_ByteSwappedUNICODE(int swapped);
 
 /* The internal structure containing font information */
 typedef struct _TTF_Font TTF_Font;
 
+/* A rectangle in pixels, 'x' and 'y' being its top left corner */
+typedef struct {
+    int x, y;
+    int w, h;
+} TTF_Rect;
+
 /* Initialize the TTF engine - returns 0 if successful, -1 on error */
 extern DECLSPEC int SDLCALL TTF_Init(void);
 
+/* Get the last error set by a library call on the calling thread.
+   Each thread has its own error buffer. */
 extern DECLSPEC char* SDLCALL TTF_GetError(void);
 
+/* Log message levels, in increasing order of severity */
+#define TTF_LOG_DEBUG   0
+#define TTF_LOG_INFO    1
+#define TTF_LOG_WARN    2
+#define TTF_LOG_ERROR   3
+#define TTF_LOG_NONE    4
+
+typedef void (SDLCALL *TTF_LogFunction)(void *userdata, int level, const char *message);
+
+/* Install a callback that receives library messages of 'level' or above.
+   Errors reported through TTF_GetError() are also passed to it at
+   TTF_LOG_ERROR.  Pass NULL to remove the callback; nothing is logged by
+   default.  When the library is built with NDEBUG, logging is compiled
+   out unless TTF_ENABLE_LOGGING is defined, and the callback is never
+   called.  The callback runs on the thread logging, render threads
+   included, and may be replaced from any thread at any time.
+ */
+extern DECLSPEC void SDLCALL TTF_SetLogFunction(TTF_LogFunction func, void *userdata, int level);
+
 /* Open a font file and create a font of the specified point size.
  * Some .fon fonts will have several sizes embedded in the file, so the
  * point size becomes the index of choosing which size.  If the value
@@ -86,6 +126,138 @@ extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontIndex(const char *file, int ptsiz
 extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontRW(FILE *src, int freesrc, int ptsize);
 extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontIndexRW(FILE *src, int freesrc, int ptsize, long index);
 
+/* Files are mapped into memory when possible, and read through a small
+   read-ahead buffer otherwise.  A mapped file must not be truncated while
+   the font is open.  The stream passed to TTF_OpenFontRW() is closed as
+   soon as it has been mapped if freesrc is set.
+
+   TTF_OpenFontMem() opens a font from a buffer that stays in use, without
+   copying it, until the font is closed.  If freedata is set the buffer
+   must come from malloc() and the font takes ownership of it, freeing it
+   on close or if opening fails.
+ */
+extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontMem(const void *data, size_t size, int freedata, int ptsize);
+extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontIndexMem(const void *data, size_t size, int freedata, int ptsize, long index);
+
+/* Create another size of an open font, with the default style.  The new
+   font shares the FreeType face of the first, and with it the character
+   map and kerning tables, so it costs no more than its own glyph cache;
+   the file is not read again.  TTF_OpenFontSizeFixed() takes the size in
+   26.6 fixed point, 1/64 of a point, for fractional sizes.  Close the
+   sizes before the font they were made from.  A size of a thread-safe
+   font is thread-safe, but setting up or closing either must not overlap
+   with calls using the other.
+ */
+extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontSize(TTF_Font *font, int ptsize);
+extern DECLSPEC TTF_Font * SDLCALL TTF_OpenFontSizeFixed(TTF_Font *font, long ptsize);
+
+/* Enable or disable thread-safe mode for fonts opened afterwards, and
+   return the previous setting.  A font opened in this mode is mapped or
+   read into memory once and may then be measured and rendered from any
+   number of threads at the same time; each thread gets its own FreeType
+   face over the shared data the first time it uses the font, kept until
+   the font is closed.  Setting the style, outline, hinting or kerning of
+   the font, and closing it, must not overlap with other calls using it.
+   TTF_Init(), TTF_Quit() and opening fonts are safe from any thread.
+   Each thread's face parses the font tables again, costing about as much
+   time and memory as opening the font, so that glyphs are loaded without
+   a lock; the sizes of the font add only a size to those faces.
+ */
+extern DECLSPEC int SDLCALL TTF_SetThreadSafe(int enable);
+extern DECLSPEC int SDLCALL TTF_FontIsThreadSafe(const TTF_Font *font);
+
+/* Start 'threads' worker threads that rasterize the glyphs a render call
+   finds missing from the cache of a thread-safe font, in parallel, before
+   the text is composited.  Each worker uses its own FreeType face.  Pass
+   0 to stop them again, the default.  The threads also composite the
+   lines of wrapped text in parallel, with the same result as a single
+   thread.  The same threads run the jobs of TTF_SubmitRender().  Must
+   not be called while rendering.
+   Returns 0 if successful, -1 on error.
+ */
+extern DECLSPEC int SDLCALL TTF_SetRenderThreads(int threads);
+
+/* Asynchronous rendering.  TTF_SubmitRender() queues a render of UTF-8
+   text with a thread-safe font for the render threads and returns a job
+   handle at once.  Jobs with a higher priority run first; the jobs of one
+   font are kept together on one thread while the others steal work when
+   idle.  Without render threads the job is done before the call returns.
+   The font must outlive its jobs.
+ */
+#define TTF_RENDER_SOLID            0
+#define TTF_RENDER_SHADED           1
+#define TTF_RENDER_BLENDED          2
+#define TTF_RENDER_BLENDED_WRAPPED  3
+
+/* Job states, in the order a job goes through them */
+#define TTF_JOB_PENDING     0
+#define TTF_JOB_RUNNING     1
+#define TTF_JOB_DONE        2
+#define TTF_JOB_FAILED      3
+#define TTF_JOB_CANCELLED   4
+
+typedef struct _TTF_RenderJob TTF_RenderJob;
+
+/* Called on a render thread when a job has finished with TTF_JOB_DONE or
+   TTF_JOB_FAILED, before waiters are woken.  It may take the surface. */
+typedef void (SDLCALL *TTF_RenderCallback)(void *userdata, TTF_RenderJob *job, int status);
+
+typedef struct {
+    int mode;                   /* TTF_RENDER_SOLID, ... */
+    int format;                 /* TTF_PIXELFORMAT_ARGB8888, ... */
+    Uint32 fg;
+    Uint32 bg;                  /* for TTF_RENDER_SHADED */
+    Uint32 wrapLength;          /* for TTF_RENDER_BLENDED_WRAPPED */
+    int priority;               /* higher runs first */
+    TTF_RenderCallback callback;    /* or NULL */
+    void *userdata;
+} TTF_RenderParams;
+
+extern DECLSPEC TTF_RenderJob * SDLCALL TTF_SubmitRender(TTF_Font *font, const char *text, const TTF_RenderParams *params);
+
+/* Get the state of a job without blocking */
+extern DECLSPEC int SDLCALL TTF_PollRender(TTF_RenderJob *job);
+
+/* Block until a job is done, has failed or was cancelled, and return
+   its state.  On failure the reason is available from TTF_GetError(). */
+extern DECLSPEC int SDLCALL TTF_WaitRender(TTF_RenderJob *job);
+
+/* Take the rendered surface out of a finished job.  The caller frees it;
+   NULL if the job did not succeed or the surface was already taken. */
+extern DECLSPEC Uint8 * SDLCALL TTF_TakeRenderSurface(TTF_RenderJob *job);
+
+/* Cancel a job that has not started yet, e.g. for text that scrolled out
+   of view.  Returns 0 if cancelled, -1 if it is already running or over.
+   Stopping the render threads cancels all pending jobs. */
+extern DECLSPEC int SDLCALL TTF_CancelRender(TTF_RenderJob *job);
+
+/* Release a job handle, and its surface unless taken.  A job still
+   pending or running is not cancelled and will call its callback. */
+extern DECLSPEC void SDLCALL TTF_FreeRenderJob(TTF_RenderJob *job);
+
+/* Cache of rendered text, for labels drawn again and again.
+   TTF_CacheRender() renders text as TTF_SubmitRender() would, ignoring
+   the priority and callback, or returns the surface of an earlier render
+   with the same font, font settings, text, mode, format and colors.  The
+   surface is shared and must not be modified; give it back with
+   TTF_ReleaseCachedSurface().  Surfaces nobody holds are dropped, least
+   recently used first, to keep the cache within 'budget' bytes.  Threads
+   asking for a render already in progress wait for it instead of
+   rendering it again.  The entries of a font that is closed, or whose
+   face a font manager releases, are no longer found; flushing the cache
+   drops them.
+ */
+typedef struct _TTF_SurfaceCache TTF_SurfaceCache;
+
+extern DECLSPEC TTF_SurfaceCache * SDLCALL TTF_CreateSurfaceCache(size_t budget);
+extern DECLSPEC const Uint8 * SDLCALL TTF_CacheRender(TTF_SurfaceCache *cache, TTF_Font *font, const char *text, const TTF_RenderParams *params);
+extern DECLSPEC void SDLCALL TTF_ReleaseCachedSurface(TTF_SurfaceCache *cache, const Uint8 *surface);
+/* Drop every surface nobody holds */
+extern DECLSPEC void SDLCALL TTF_FlushSurfaceCache(TTF_SurfaceCache *cache);
+extern DECLSPEC void SDLCALL TTF_GetSurfaceCacheStats(TTF_SurfaceCache *cache, size_t *bytes, unsigned long *hits, unsigned long *misses);
+/* Free the cache and its surfaces, which must all have been released */
+extern DECLSPEC void SDLCALL TTF_FreeSurfaceCache(TTF_SurfaceCache *cache);
+
 /* Set and retrieve the font style */
 #define TTF_STYLE_NORMAL        0x00
 #define TTF_STYLE_BOLD          0x01
@@ -149,6 +321,54 @@ extern DECLSPEC int SDLCALL TTF_SizeText(TTF_Font *font, const char *text, int *
 extern DECLSPEC int SDLCALL TTF_SizeUTF8(TTF_Font *font, const char *text, int *w, int *h);
 extern DECLSPEC int SDLCALL TTF_SizeUNICODE(TTF_Font *font, const Uint16 *text, int *w, int *h);
 
+/* Get the glyphs of 'len' bytes of UTF-8 text, or up to its end, placed
+   as TTF_RenderUTF8_Blended() places them, without rendering anything;
+   for renderers drawing glyphs from an atlas of their own.  Each glyph
+   has its index in the face, its character, its pen position on the
+   baseline, and the box its pixels are drawn to, taken from the glyph
+   metrics; with an outline the box grows by twice the outline width.
+   All are in the coordinates of the surface TTF_RenderUTF8_Blended()
+   would return, whose size is given too.  The run must be zeroed before
+   its first use; its array grows as needed and may be reused.
+   Returns 0 if successful, -1 on error.
+ */
+typedef struct {
+    Uint32 index;
+    Uint16 ch;
+    int x, y;                   /* pen position on the baseline */
+    TTF_Rect bounds;
+} TTF_ShapedGlyph;
+
+typedef struct {
+    TTF_ShapedGlyph *glyphs;
+    int numglyphs;
+    int maxglyphs;
+    int w, h;                   /* of the rendered surface */
+} TTF_GlyphRun;
+
+extern DECLSPEC int SDLCALL TTF_ShapeUTF8(TTF_Font *font, const char *text, size_t len, TTF_GlyphRun *run);
+/* Free the glyph array of a run */
+extern DECLSPEC void SDLCALL TTF_FreeGlyphRun(TTF_GlyphRun *run);
+
+/* Pixel formats for the *_Format render functions.  The 32-bit formats
+   are packed into a native Uint32 the way SDL does it, so ARGB8888 is
+   0xAARRGGBB.  TTF_PIXELFORMAT_PREMULTIPLIED may be or'ed into a 32-bit
+   format to get color channels already multiplied by alpha.  A8 holds
+   coverage only, and RGB565 has no alpha so the text color is scaled by
+   coverage as if drawn on black.  INDEX8 is the paletted output of the
+   Solid and Shaded functions, INDEX1MSB packs Solid output 8 pixels to
+   the byte, most significant bit first, with rows padded to 32 bits.
+   Surfaces are 32, 16, 8 or 1 bits deep.
+*/
+#define TTF_PIXELFORMAT_ARGB8888        0
+#define TTF_PIXELFORMAT_BGRA8888        1
+#define TTF_PIXELFORMAT_RGBA8888        2
+#define TTF_PIXELFORMAT_A8              3
+#define TTF_PIXELFORMAT_RGB565          4
+#define TTF_PIXELFORMAT_INDEX8          5
+#define TTF_PIXELFORMAT_INDEX1MSB       6
+#define TTF_PIXELFORMAT_PREMULTIPLIED   0x100
+
 /* Create an 8-bit palettized surface and render the given text at
    fast quality with the given font and color.  The 0 pixel is the
    colorkey, giving a transparent background, and the 1 pixel is set
@@ -162,6 +382,20 @@ extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Solid(TTF_Font *font,
 extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Solid(TTF_Font *font,
                 const Uint16 *text, Uint32 fg);
 
+/* Same as the Solid functions above, but in the requested pixel format,
+   TTF_PIXELFORMAT_INDEX8 or TTF_PIXELFORMAT_INDEX1MSB.  With the packed
+   format the glyph cache also keeps the glyphs 1 bit per pixel.
+   This function returns the new surface, or NULL if there was an error.
+*/
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderText_Solid_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Solid_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Solid_Format(TTF_Font *font,
+                const Uint16 *text, Uint32 fg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyph_Solid_Format(TTF_Font *font,
+                Uint16 ch, Uint32 fg, int format);
+
 /* Create an 8-bit palettized surface and render the given glyph at
    fast quality with the given font and color.  The 0 pixel is the
    colorkey, giving a transparent background, and the 1 pixel is set
@@ -174,7 +408,8 @@ extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyph_Solid(TTF_Font *font,
 
 /* Create an 8-bit palettized surface and render the given text at
    high quality with the given font and colors.  The 0 pixel is background,
-   while other pixels have varying degrees of the foreground color.
+   while other pixels have varying degrees of the foreground color.  The
+   256 colors of the ramp are attached to the surface, see fn_palette().
    This function returns the new surface, or NULL if there was an error.
 */
 extern DECLSPEC Uint8 * SDLCALL TTF_RenderText_Shaded(TTF_Font *font,
@@ -184,6 +419,22 @@ extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Shaded(TTF_Font *font,
 extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Shaded(TTF_Font *font,
                 const Uint16 *text, Uint32 fg, Uint32 bg);
 
+/* Same as the Shaded functions above, but in the requested pixel format.
+   TTF_PIXELFORMAT_INDEX8 gives the palettized surface, the 32-bit and
+   RGB565 formats give opaque pixels colored straight from the bg to fg
+   ramp, and A8 gives the coverage indices without a palette.  The ramp
+   is computed once per color pair and reused by later calls.
+   This function returns the new surface, or NULL if there was an error.
+*/
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderText_Shaded_Format(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 bg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Shaded_Format(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 bg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Shaded_Format(TTF_Font *font,
+                const Uint16 *text, Uint32 fg, Uint32 bg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyph_Shaded_Format(TTF_Font *font,
+                Uint16 ch, Uint32 fg, Uint32 bg, int format);
+
 /* Create an 8-bit palettized surface and render the given glyph at
    high quality with the given font and colors.  The 0 pixel is background,
    while other pixels have varying degrees of the foreground color.
@@ -206,6 +457,25 @@ extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Blended(TTF_Font *font,
                 const Uint16 *text, Uint32 fg);
 
 
+/* Same as the Blended functions above, but the surface is emitted
+   directly in the requested pixel format.
+   This function returns the new surface, or NULL if there was an error.
+*/
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderText_Blended_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Blended_Format(TTF_Font *font,
+                const Uint16 *text, Uint32 fg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderText_Blended_Wrapped_Format(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 wrapLength, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Wrapped_Format(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 wrapLength, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Blended_Wrapped_Format(TTF_Font *font,
+                const Uint16 *text, Uint32 fg, Uint32 wrapLength, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyph_Blended_Format(TTF_Font *font,
+                Uint16 ch, Uint32 fg, int format);
+
 /* Create a 32-bit ARGB surface and render the given text at high quality,
    using alpha blending to dither the font with the given color.
    Text is wrapped to multiple lines on line endings and on word boundaries
@@ -219,6 +489,34 @@ extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Wrapped(TTF_Font *font,
 extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Blended_Wrapped(TTF_Font *font,
                 const Uint16 *text, Uint32 fg, Uint32 wrapLength);
 
+/* Get the size TTF_RenderUTF8_Blended_Wrapped() would give the text,
+   without the 16-bit limit of a surface.
+   This function returns 0 on success, or -1 if there was an error.
+*/
+extern DECLSPEC int SDLCALL TTF_SizeUTF8_Wrapped(TTF_Font *font,
+                const char *text, Uint32 wrapLength, int *w, int *h);
+
+/* Called with each tile of streamed text and the position of its top
+   left corner in the whole text.  The tile is reused for the next one,
+   so copy out what is needed.  Return nonzero to stop rendering. */
+typedef int (SDLCALL *TTF_TileCallback)(void *userdata, const Uint8 *tile, int x, int y);
+
+/* Render wrapped text like TTF_RenderUTF8_Blended_Wrapped_Format(), but
+   tile by tile on a grid of tile_w x tile_h pixels from the top left,
+   left to right and top to bottom.  Only the tiles meeting 'area' are
+   rendered, or all of them if it is NULL.  A tile_w of 0 gives bands
+   the full width of the text, and a tile_h of 0 one line high.  Tiles at
+   the right and bottom edges are cut to the text size, which may be
+   larger than a single surface can be.  Glyphs are clipped at the edges
+   of the text instead of running on into the next row.
+   This function returns 0 when all tiles were rendered, the value the
+   callback stopped it with, or -1 if there was an error.
+*/
+extern DECLSPEC int SDLCALL TTF_RenderUTF8_Blended_Wrapped_Tiles(TTF_Font *font,
+                const char *text, Uint32 fg, Uint32 wrapLength, int format,
+                int tile_w, int tile_h, const TTF_Rect *area,
+                TTF_TileCallback callback, void *userdata);
+
 /* Create a 32-bit ARGB surface and render the given glyph at high quality,
    using alpha blending to dither the font with the given color.
    The glyph is rendered without any padding or centering in the X
@@ -228,6 +526,263 @@ extern DECLSPEC Uint8 * SDLCALL TTF_RenderUNICODE_Blended_Wrapped(TTF_Font *font
 extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyph_Blended(TTF_Font *font,
                         Uint16 ch, Uint32 fg);
 
+/* Same as TTF_RenderUTF8_Blended_Format(), but the surface only covers
+   the pixels the text inks: its glyph pixmaps and lines, within the box
+   TTF_SizeUTF8() gives.  The position of the surface in that box is
+   returned in x and y, so drawing it there gives the same picture with
+   none of the transparent rows and columns around the text.
+   This function returns the new surface, or NULL if there was an error
+   or the text has no ink, such as only spaces.
+*/
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Tight(TTF_Font *font,
+                const char *text, Uint32 fg, int *x, int *y);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Tight_Format(TTF_Font *font,
+                const char *text, Uint32 fg, int format, int *x, int *y);
+
+/* Render text shaped elsewhere: 'count' glyphs given by their index in
+   the face, each with its pen position on the baseline in the surface,
+   as TTF_ShapeUTF8() returns them.  There is no decoding, character map
+   lookup or kerning, and the glyphs are cached by index.  The surface
+   reaches from the origin to the last glyph, with the font height below
+   the baselines as the other functions make it.  The lines of the
+   underline and strikethrough styles are not drawn.
+   This function returns the new surface, or NULL if there was an error.
+*/
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyphRun_Shaded(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg, Uint32 bg);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyphRun_Shaded_Format(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg, Uint32 bg, int format);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyphRun_Blended(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderGlyphRun_Blended_Format(TTF_Font *font, const Uint32 *indices,
+                const int *x, const int *y, int count, Uint32 fg, int format);
+
+/* Font stacks draw each character of a text with the first of a list of
+   fonts that has a glyph for it, for text mixing scripts that no single
+   font covers.  The characters a font provides are found once, when it
+   is opened, and each stack keeps a table giving the font of every
+   character.  The fonts are aligned on the highest baseline
+   among them, and keep their own style; kerning applies within runs of
+   one font.  Characters no font provides are drawn with the first font.
+   Fonts are not closed with the stack and must outlive it.  Adding fonts
+   must not overlap with other calls using the stack.
+ */
+typedef struct _TTF_FontStack TTF_FontStack;
+
+extern DECLSPEC TTF_FontStack * SDLCALL TTF_CreateFontStack(void);
+/* Add a font after those already in the stack, up to 255 fonts */
+extern DECLSPEC int SDLCALL TTF_FontStackAdd(TTF_FontStack *stack, TTF_Font *font);
+/* Get the font that draws a character, or NULL if none provides it */
+extern DECLSPEC TTF_Font * SDLCALL TTF_FontStackFont(const TTF_FontStack *stack, Uint16 ch);
+extern DECLSPEC int SDLCALL TTF_FontStackHeight(const TTF_FontStack *stack);
+extern DECLSPEC int SDLCALL TTF_FontStackAscent(const TTF_FontStack *stack);
+extern DECLSPEC void SDLCALL TTF_FreeFontStack(TTF_FontStack *stack);
+
+extern DECLSPEC int SDLCALL TTF_SizeUTF8_Stack(TTF_FontStack *stack, const char *text, int *w, int *h);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Stack(TTF_FontStack *stack,
+                const char *text, Uint32 fg);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Stack_Format(TTF_FontStack *stack,
+                const char *text, Uint32 fg, int format);
+
+/* Rich text: a line of UTF-8 text whose spans have their own font, style
+   and color, laid out and rendered in one pass.  Text outside the spans
+   is drawn with the font given, in its style, and with 'fg'.  The spans
+   are given in order of their first byte and must not overlap.  All the
+   text sits on the highest baseline among the fonts used, and kerning
+   carries across spans drawn from the same face at the same size.  The
+   bold and italic spans of a font are drawn from variants of it with
+   glyph caches of their own, made when first needed, so mixing styles
+   doesn't flush its cache.  Underline and strikethrough are drawn per
+   span, in the span color.
+ */
+typedef struct {
+    size_t start;               /* first byte of the span in the text */
+    size_t length;              /* in bytes */
+    TTF_Font *font;             /* or NULL for the font of the call */
+    int style;                  /* TTF_STYLE_* */
+    Uint32 color;
+} TTF_TextSpan;
+
+extern DECLSPEC int SDLCALL TTF_SizeUTF8_Rich(TTF_Font *font, const char *text,
+                const TTF_TextSpan *spans, int numspans, int *w, int *h);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Rich(TTF_Font *font, const char *text,
+                const TTF_TextSpan *spans, int numspans, Uint32 fg);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderUTF8_Blended_Rich_Format(TTF_Font *font, const char *text,
+                const TTF_TextSpan *spans, int numspans, Uint32 fg, int format);
+
+/* Font directory index.  TTF_IndexFonts() lists the font files in a
+   directory and its subdirectories, with the name, style and characters
+   of every face in them, without keeping any face open.  Only files with
+   a font extension such as .ttf, .otf, .ttc or .fon are read.  The files
+   are scanned in parallel, on the render threads if there are any, or on
+   threads started for the scan otherwise.  When a cache file is given,
+   files whose modification time and size match the cache are taken from
+   it, and the cache is rewritten when anything changed.  Returns NULL on
+   error.
+ */
+typedef struct _TTF_FontIndex TTF_FontIndex;
+
+typedef struct {
+    const char *file;
+    long index;                 /* of the face in the file */
+    long faces;                 /* in the file */
+    const char *family;         /* or NULL */
+    const char *style;          /* or NULL */
+    int fixed_width;
+    int scalable;
+    int face_style;             /* TTF_STYLE_BOLD and TTF_STYLE_ITALIC */
+} TTF_FontInfo;
+
+extern DECLSPEC TTF_FontIndex * SDLCALL TTF_IndexFonts(const char *dir, const char *cachefile);
+extern DECLSPEC int SDLCALL TTF_FontIndexCount(const TTF_FontIndex *index);
+extern DECLSPEC const TTF_FontInfo * SDLCALL TTF_FontIndexInfo(const TTF_FontIndex *index, int i);
+/* Check whether face i of the index has a glyph for a character */
+extern DECLSPEC int SDLCALL TTF_FontIndexProvides(const TTF_FontIndex *index, int i, Uint16 ch);
+/* Find the first face of a family, and style if not NULL, ignoring case.
+   Returns its number in the index, or -1 if there is none. */
+extern DECLSPEC int SDLCALL TTF_FontIndexFind(const TTF_FontIndex *index, const char *family, const char *style);
+extern DECLSPEC TTF_Font * SDLCALL TTF_OpenIndexedFont(const TTF_FontIndex *index, int i, int ptsize);
+extern DECLSPEC void SDLCALL TTF_FreeFontIndex(TTF_FontIndex *index);
+
+/* Font manager, for programs using more fonts than they can keep open.
+   A managed font is acquired for use and released afterwards; only the
+   'maxopen' most recently used fonts keep their face and file open, and
+   the others are reopened when next acquired, keeping their style and
+   glyph cache meanwhile.  The font returned by TTF_AcquireFont() is valid
+   until the matching TTF_ReleaseFont(); fonts that are held are never
+   closed, even beyond the limit.  Sizes made of a managed font with
+   TTF_OpenFontSize() share its face, so they hold it open the same way
+   until they are closed; a font with such sizes is never evicted.  Don't
+   close managed fonts, and don't change their files while they are
+   managed.  The manager may be used from any thread.
+ */
+typedef struct _TTF_FontManager TTF_FontManager;
+typedef struct _TTF_FontHandle TTF_FontHandle;
+
+extern DECLSPEC TTF_FontManager * SDLCALL TTF_CreateFontManager(int maxopen);
+extern DECLSPEC TTF_FontHandle * SDLCALL TTF_ManagerOpenFont(TTF_FontManager *manager, const char *file, int ptsize, long index);
+extern DECLSPEC TTF_Font * SDLCALL TTF_AcquireFont(TTF_FontHandle *handle);
+extern DECLSPEC void SDLCALL TTF_ReleaseFont(TTF_FontHandle *handle);
+extern DECLSPEC void SDLCALL TTF_ManagerCloseFont(TTF_FontHandle *handle);
+/* Get the number of fonts open, and how often faces were closed and reopened */
+extern DECLSPEC void SDLCALL TTF_GetFontManagerStats(TTF_FontManager *manager, int *open, int *evictions, int *reopens);
+/* Close the manager and all its fonts */
+extern DECLSPEC void SDLCALL TTF_FreeFontManager(TTF_FontManager *manager);
+
+/* Editable text, for text fields redrawn on every key stroke.  The
+   object keeps the layout and surface of the last text it was given, and
+   TTF_SetEditText() lays out again only from the first changed character
+   and composites again only the columns from there on, giving the same
+   pixels as TTF_RenderUTF8_Blended_Format().  The part of the surface
+   that changed is returned in 'dirty', which may reach past the new
+   width when the text got shorter, and is empty when nothing changed.
+   The surface belongs to the object; it is valid until the next text is
+   set, and NULL for text of zero width.  The pitch of the surface may
+   be larger than its width needs.  The font must outlive the object.
+   Returns 0 if successful, -1 on error.
+ */
+typedef struct _TTF_EditText TTF_EditText;
+
+extern DECLSPEC TTF_EditText * SDLCALL TTF_CreateEditText(TTF_Font *font, Uint32 fg, int format);
+extern DECLSPEC int SDLCALL TTF_SetEditText(TTF_EditText *edit, const char *text, TTF_Rect *dirty);
+extern DECLSPEC const Uint8 * SDLCALL TTF_GetEditTextSurface(const TTF_EditText *edit);
+extern DECLSPEC void SDLCALL TTF_FreeEditText(TTF_EditText *edit);
+
+/* A document of wrapped text too long to lay out at once, such as a log
+   of a million lines.  The text is kept as paragraphs, split at line
+   endings, each broken into lines by the rules of
+   TTF_RenderUTF8_Blended_Wrapped() only when one of its lines is first
+   needed.  Finding the paragraph at a line, or the line a paragraph
+   starts at, takes O(log n) steps, and appending or changing text only
+   breaks again the paragraphs it touches.  A paragraph not broken yet
+   counts as one line, so line numbers after it are estimates until it
+   is; TTF_MeasureDocument() breaks up to 'count' more paragraphs from
+   the top, or all of them if it is negative, and returns how many are
+   left.
+   TTF_SetDocumentParagraph() replaces a paragraph; line endings in the
+   text start new paragraphs after it.  Set the wrap length again after
+   changing the size or style of the font, to break everything anew.
+   TTF_RenderDocument_Blended() renders 'count' lines from 'line' on, or
+   as many as there are, into a surface wrapLength wide, or as wide as
+   the widest of them without wrapping.  Each line is as high as
+   TTF_SizeUTF8() measures the lines rendered, at least TTF_FontHeight(),
+   more where glyphs reach below the descent or have an outline, and the
+   lines are 2 pixels apart, as in TTF_RenderUTF8_Blended_Wrapped().
+   The font must outlive the document.
+   Functions returning int return 0 if successful, -1 on error.
+ */
+typedef struct _TTF_Document TTF_Document;
+
+extern DECLSPEC TTF_Document * SDLCALL TTF_CreateDocument(TTF_Font *font, Uint32 wrapLength);
+extern DECLSPEC int SDLCALL TTF_AppendDocumentText(TTF_Document *doc, const char *text);
+extern DECLSPEC int SDLCALL TTF_SetDocumentParagraph(TTF_Document *doc, int paragraph, const char *text);
+extern DECLSPEC void SDLCALL TTF_SetDocumentWrapLength(TTF_Document *doc, Uint32 wrapLength);
+extern DECLSPEC int SDLCALL TTF_GetDocumentParagraphs(const TTF_Document *doc);
+extern DECLSPEC long SDLCALL TTF_GetDocumentLines(const TTF_Document *doc);
+extern DECLSPEC long SDLCALL TTF_GetDocumentParagraphLine(const TTF_Document *doc, int paragraph);
+extern DECLSPEC int SDLCALL TTF_FindDocumentLine(TTF_Document *doc, long line, int *paragraph, int *subline);
+extern DECLSPEC int SDLCALL TTF_MeasureDocument(TTF_Document *doc, int count);
+extern DECLSPEC Uint8 * SDLCALL TTF_RenderDocument_Blended(TTF_Document *doc, long line, int count, Uint32 fg, int format);
+extern DECLSPEC void SDLCALL TTF_FreeDocument(TTF_Document *doc);
+
+/* A label for TTF_RenderLabels_Blended(), placed where the top left
+   corner of TTF_RenderUTF8_Blended() would go */
+typedef struct {
+    const char *text;
+    TTF_Font *font;
+    Uint32 color;
+    int x, y;
+} TTF_Label;
+
+/* Composite many labels straight into one canvas made by
+   TTF_CreateRGBSurface() with the depth of 'format', without a surface
+   per label.  Each label gives the pixels of TTF_RenderUTF8_Blended() in
+   its color, merged with what the canvas holds the same way glyphs of
+   one render are; where labels overlap, the color of either may win.
+   With a tile_size above 0 the canvas is split into tiles of that many
+   pixels a side, composited by the render threads when there are any.
+   Labels off the canvas are skipped.
+   This function returns 0 if successful, or -1 if there was an error.
+*/
+extern DECLSPEC int SDLCALL TTF_RenderLabels_Blended(Uint8 *canvas, int format,
+                const TTF_Label *labels, int numlabels, int tile_size);
+
+/* A label atlas: one page of the given size and pixel format holding
+   many labels rendered by TTF_RenderUTF8_Blended_Format(), to be
+   uploaded as a single texture.  TTF_AddAtlasLabel() returns a handle
+   to the label, rendering and packing it only if the same text, font
+   and color isn't in the page already, with the font's style, outline,
+   hinting and kerning unchanged; otherwise it takes one more reference
+   to it.  Each TTF_ReleaseAtlasLabel() drops one, and the
+   room of a label without references is used again for others.
+   TTF_GetAtlasLabel() gives where a label is in the page, in pixels
+   and as texture coordinates u0, v0, u1, v1.  TTF_GetAtlasPage() returns
+   the page along with the part of it changed since the last call.
+   Fragmentation is the part of the free pixels outside the largest
+   free block.  Fonts must outlive the labels made with them.
+   Functions returning int return -1 on error, for instance when the
+   page is full.
+*/
+typedef struct _TTF_LabelAtlas TTF_LabelAtlas;
+
+typedef struct {
+    int labels;             /* labels in the page */
+    int references;         /* handles taken on them */
+    int shelves;            /* rows of labels */
+    long used_pixels;       /* taken by labels, padding included */
+    long free_pixels;
+    float occupancy;        /* used part of the page */
+    float fragmentation;
+} TTF_AtlasStats;
+
+extern DECLSPEC TTF_LabelAtlas * SDLCALL TTF_CreateLabelAtlas(int width, int height, int format);
+extern DECLSPEC int SDLCALL TTF_AddAtlasLabel(TTF_LabelAtlas *atlas, TTF_Font *font, const char *text, Uint32 fg);
+extern DECLSPEC int SDLCALL TTF_GetAtlasLabel(const TTF_LabelAtlas *atlas, int handle, TTF_Rect *rect, float *uv);
+extern DECLSPEC int SDLCALL TTF_ReleaseAtlasLabel(TTF_LabelAtlas *atlas, int handle);
+extern DECLSPEC const Uint8 * SDLCALL TTF_GetAtlasPage(TTF_LabelAtlas *atlas, TTF_Rect *dirty);
+extern DECLSPEC void SDLCALL TTF_GetAtlasStats(const TTF_LabelAtlas *atlas, TTF_AtlasStats *stats);
+extern DECLSPEC void SDLCALL TTF_FreeLabelAtlas(TTF_LabelAtlas *atlas);
+
 /* For compatibility with previous versions, here are the old functions */
 #define TTF_RenderText(font, text, fg, bg)  \
     TTF_RenderText_Shaded(font, text, fg, bg)